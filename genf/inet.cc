@@ -41,7 +41,7 @@ bool Thread::makeNonBlocking( int fd )
 	return true;
 }
 
-int Thread::inetListen( uint16_t port, bool transparent )
+int Thread::inetListen( uint16_t port, bool transparent, bool reusePort )
 {
 	/* Create the socket. */
 	int listenFd = socket( PF_INET, SOCK_STREAM, 0 );
@@ -54,6 +54,16 @@ int Thread::inetListen( uint16_t port, bool transparent )
 	int optionVal = 1;
 	setsockopt( listenFd, SOL_SOCKET, SO_REUSEADDR,
 			(char*)&optionVal, sizeof(int) );
+
+	/* Several sockets bound to the same port, the kernel distributes
+	 * connections between them. */
+	if ( reusePort ) {
+		int r = setsockopt( listenFd, SOL_SOCKET, SO_REUSEPORT, &optionVal, sizeof(optionVal) );
+		if ( r < 0 ) {
+			log_ERROR( "inet listen: failed to set "
+					"SO_REUSEPORT flag on socket: " << strerror(errno) );
+		}
+	}
 	
 	if ( transparent ) {
 		int optionVal = 1;
@@ -206,6 +206,8 @@ struct SelectFd
 		bio(0),
 		remoteHost(0),
 		sslVerifyError(false),
+		hostVerified(false),
+		verifyCached(false),
 		closed(false),
 		tlsWantRead(false),
 		tlsWantWrite(false),
@@ -254,6 +256,12 @@ struct SelectFd
 	BIO *bio;
 	const char *remoteHost;
 	bool sslVerifyError;
+
+	/* Peer cert matched remoteHost during verify. Verify cached means the
+	 * chain was verified by an earlier connection. */
+	bool hostVerified;
+	bool verifyCached;
+
 	bool closed;
 
 	/* If connection is tls, the application should use these. */
@@ -477,7 +485,7 @@ public:
 	virtual const char *pkgConfDir() = 0;
 
 	virtual	bool poll() = 0;
-	int inetListen( uint16_t port, bool transparent = false );
+	int inetListen( uint16_t port, bool transparent = false, bool reusePort = false );
 	int selectLoop( timeval *timer = 0, bool wantPoll = true );
 
 	int pselectLoop( sigset_t *sigmask, timeval *timer, bool wantPoll );
@@ -526,6 +534,7 @@ public:
 	SSL_CTX *sslCtxClientPublic();
 	SSL_CTX *sslCtxClientInternal();
 	SSL_CTX *sslCtxClient( const SSL_METHOD *method, const char *verify, const char *key = 0, const char *cert = 0 );
+	void sslCtxVerifyCache( SSL_CTX *ctx, long ttl );
 
 	SSL_CTX *sslCtxServerInternal();
 	SSL_CTX *sslCtxServer( const char *key, const char *cert, const char *verify = 0 );
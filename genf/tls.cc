@@ -7,16 +7,23 @@
 #include <openssl/x509v3.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
+#include <openssl/ocsp.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <aapl/astring.h>
+#include <aapl/avlmap.h>
 #include "config.h"
 
 #define PEER_CN_NAME_LEN 256
 
 #define CA_CERT_FILE "/etc/ssl/certs/ca-certificates.crt"
 
+#define VERIFY_CACHE_MAX 10000
+
+/* Allowed clock skew on OCSP responses, in seconds. */
+#define OCSP_SKEW 300
+
 static pthread_mutex_t crypto_mutex_arr[CRYPTO_NUM_LOCKS];
 
 static void cryptoLock(int mode, int n, const char *file, int line)
@@ -106,6 +113,241 @@ SSL_CTX *Thread::sslCtxClient( const SSL_METHOD *method, const char *verify, con
 	return ctx;
 }
 
+/*
+ * Verified chains. A leaf that verified against a trust store and matched a
+ * host name is good for that pair until the TTL runs out, so later
+ * connections skip chain building and the SAN walk. Revoked entries come from
+ * stapled OCSP responses, which are checked only when the chain is verified.
+ */
+
+struct VerifyEntry
+{
+	time_t expires;
+	bool revoked;
+};
+
+struct VerifyCache
+{
+	typedef AvlMap<String, VerifyEntry, CmpStr> Map;
+
+	VerifyCache()
+		: ttl(0)
+	{
+		pthread_rwlock_init( &lock, 0 );
+	}
+
+	bool find( const char *key, VerifyEntry *entry );
+	void insert( const char *key, time_t expires, bool revoked );
+
+	pthread_rwlock_t lock;
+	Map map;
+	long ttl;
+};
+
+static VerifyCache verifyCache;
+
+bool VerifyCache::find( const char *key, VerifyEntry *entry )
+{
+	pthread_rwlock_rdlock( &lock );
+	Map::El *el = map.find( key );
+	bool found = el != 0 && el->value.expires > time(0);
+	if ( found )
+		*entry = el->value;
+	pthread_rwlock_unlock( &lock );
+	return found;
+}
+
+void VerifyCache::insert( const char *key, time_t expires, bool revoked )
+{
+	VerifyEntry entry;
+	entry.expires = expires;
+	entry.revoked = revoked;
+
+	pthread_rwlock_wrlock( &lock );
+
+	Map::El *el = map.find( key );
+	if ( el != 0 )
+		el->value = entry;
+	else {
+		if ( map.length() >= VERIFY_CACHE_MAX ) {
+			time_t now = time(0);
+			Map::Iter i = map;
+			while ( i.lte() ) {
+				Map::El *cur = i;
+				i++;
+				if ( cur->value.expires <= now )
+					map.remove( cur );
+			}
+
+			/* Still full, drop one. */
+			Map::Iter first = map;
+			if ( map.length() >= VERIFY_CACHE_MAX && first.lte() )
+				map.remove( first );
+		}
+
+		map.insert( key, entry );
+	}
+
+	pthread_rwlock_unlock( &lock );
+}
+
+/* Leaf fingerprint, trust store and host. */
+static bool verifyKey( SSL *ssl, X509 *leaf, const char *host, char *key, int keyLen )
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdLen;
+
+	if ( host == 0 || !X509_digest( leaf, EVP_sha256(), md, &mdLen ) )
+		return false;
+
+	char hex[EVP_MAX_MD_SIZE * 2 + 1];
+	for ( unsigned int i = 0; i < mdLen; i++ )
+		sprintf( hex + i * 2, "%02x", md[i] );
+
+	X509_STORE *store = SSL_CTX_get_cert_store( SSL_get_SSL_CTX( ssl ) );
+	int n = snprintf( key, keyLen, "%s:%p:%s", hex, (void*)store, host );
+	return n > 0 && n < keyLen;
+}
+
+/* The check connTlsConnectReady makes, so hostVerified can stand in for it. */
+static bool leafHostMatch( SelectFd *selectFd, X509 *leaf )
+{
+	const char *name = selectFd->remoteHost;
+
+#ifdef HAVE_X509_CHECK_HOST
+	return X509_check_host( leaf, name, strlen( name ), 0, 0 ) == 1;
+#else
+	return selectFd->thread->hostMatch( leaf, name );
+#endif
+}
+
+/* Replaces OpenSSL's chain verification for contexts with the cache on. */
+static int verifyCertCallback( X509_STORE_CTX *storeCtx, void * )
+{
+	SSL *ssl = (SSL*)X509_STORE_CTX_get_ex_data( storeCtx,
+			SSL_get_ex_data_X509_STORE_CTX_idx() );
+	SelectFd *selectFd = (SelectFd*)SSL_get_ex_data( ssl, 0 );
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509 *leaf = X509_STORE_CTX_get0_cert( storeCtx );
+#else
+	X509 *leaf = storeCtx->cert;
+#endif
+
+	char key[EVP_MAX_MD_SIZE * 2 + 32 + PEER_CN_NAME_LEN];
+	bool haveKey = selectFd != 0 && leaf != 0 &&
+			verifyKey( ssl, leaf, selectFd->remoteHost, key, sizeof(key) );
+
+	VerifyEntry entry;
+	if ( haveKey && verifyCache.find( key, &entry ) &&
+			X509_cmp_current_time( X509_get_notAfter( leaf ) ) > 0 )
+	{
+		log_debug( DBG_TLS, "verify cache hit for " << selectFd->remoteHost );
+
+		selectFd->verifyCached = true;
+
+		if ( entry.revoked ) {
+			X509_STORE_CTX_set_error( storeCtx, X509_V_ERR_CERT_REVOKED );
+			return 0;
+		}
+
+		X509_STORE_CTX_set_error( storeCtx, X509_V_OK );
+		selectFd->hostVerified = true;
+		return 1;
+	}
+
+	int result = X509_verify_cert( storeCtx );
+
+	/* Only pairs that pass both checks are kept. */
+	if ( result > 0 && haveKey && leafHostMatch( selectFd, leaf ) ) {
+		verifyCache.insert( key, time(0) + verifyCache.ttl, false );
+		selectFd->hostVerified = true;
+	}
+
+	return result;
+}
+
+/* Stapled OCSP response for a chain we just verified. Anything we can't use
+ * is ignored, the handshake fails only on a valid response saying the leaf
+ * is revoked. */
+static int ocspStatusCallback( SSL *ssl, void * )
+{
+	SelectFd *selectFd = (SelectFd*)SSL_get_ex_data( ssl, 0 );
+	if ( selectFd == 0 || selectFd->verifyCached )
+		return 1;
+
+	const unsigned char *data;
+	long len = SSL_get_tlsext_status_ocsp_resp( ssl, &data );
+	if ( data == 0 || len <= 0 )
+		return 1;
+
+	OCSP_RESPONSE *resp = d2i_OCSP_RESPONSE( 0, &data, len );
+	if ( resp == 0 )
+		return 1;
+
+	OCSP_BASICRESP *basic = 0;
+	OCSP_CERTID *id = 0;
+	bool revoked = false;
+
+	STACK_OF(X509) *chain = SSL_get_peer_cert_chain( ssl );
+	X509 *leaf = SSL_get_peer_certificate( ssl );
+	X509_STORE *store = SSL_CTX_get_cert_store( SSL_get_SSL_CTX( ssl ) );
+
+	/* Issuer is the next cert the server sent. */
+	X509 *issuer = 0;
+	for ( int i = 0; chain != 0 && leaf != 0 && i < sk_X509_num( chain ); i++ ) {
+		X509 *c = sk_X509_value( chain, i );
+		if ( X509_check_issued( c, leaf ) == X509_V_OK ) {
+			issuer = c;
+			break;
+		}
+	}
+
+	if ( issuer != 0 && OCSP_response_status( resp ) == OCSP_RESPONSE_STATUS_SUCCESSFUL &&
+			( basic = OCSP_response_get1_basic( resp ) ) != 0 &&
+			OCSP_basic_verify( basic, chain, store, 0 ) > 0 &&
+			( id = OCSP_cert_to_id( 0, leaf, issuer ) ) != 0 )
+	{
+		int status, reason;
+		ASN1_GENERALIZEDTIME *revtime, *thisupd, *nextupd;
+		if ( OCSP_resp_find_status( basic, id, &status, &reason, &revtime, &thisupd, &nextupd ) &&
+				OCSP_check_validity( thisupd, nextupd, OCSP_SKEW, -1 ) )
+		{
+			revoked = status == V_OCSP_CERTSTATUS_REVOKED;
+		}
+	}
+
+	if ( revoked ) {
+		log_ERROR( "stapled OCSP response: peer certificate revoked: " << selectFd->remoteHost );
+
+		char key[EVP_MAX_MD_SIZE * 2 + 32 + PEER_CN_NAME_LEN];
+		if ( verifyKey( ssl, leaf, selectFd->remoteHost, key, sizeof(key) ) )
+			verifyCache.insert( key, time(0) + verifyCache.ttl, true );
+	}
+
+	OCSP_CERTID_free( id );
+	OCSP_BASICRESP_free( basic );
+	OCSP_RESPONSE_free( resp );
+	X509_free( leaf );
+
+	return revoked ? 0 : 1;
+}
+
+/* Turn on the verified chain cache and stapled OCSP checks for a client
+ * context. The cache is shared by every context in the process, ttl is in
+ * seconds. */
+void Thread::sslCtxVerifyCache( SSL_CTX *ctx, long ttl )
+{
+	verifyCache.ttl = ttl;
+
+	SSL_CTX_set_cert_verify_callback( ctx, verifyCertCallback, 0 );
+
+	SSL_CTX_set_tlsext_status_cb( ctx, ocspStatusCallback );
+#ifdef SSL_CTX_set_tlsext_status_type
+	SSL_CTX_set_tlsext_status_type( ctx, TLSEXT_STATUSTYPE_ocsp );
+#endif
+}
+
 SSL_CTX *Thread::sslCtxServerInternal()
 {
 	String key    = String(pkgConfDir()) + "/key.pem";
@@ -168,11 +410,31 @@ SSL_CTX *Thread::sslCtxServer( EVP_PKEY *pkey, X509 *x509 )
 	if ( result != 1 )
 		log_FATAL( "failed to load TLS certificate" );
 
+	/* ECDSA keys can only be used with ECDHE suites. Not needed from 1.1 on. */
+#ifdef SSL_CTX_set_ecdh_auto
+	SSL_CTX_set_ecdh_auto( ctx, 1 );
+#endif
+
 	SSL_CTX_set_mode( ctx, SSL_MODE_ENABLE_PARTIAL_WRITE );
 
+	/* Same as the file based contexts, so sessions survive switching to this
+	 * one on SNI. */
+	SSL_CTX_set_session_id_context( ctx,
+			 (const unsigned char*)&ssl_session_ctx_id, sizeof(ssl_session_ctx_id) );
+
 	return ctx;
 }
 
+/* OpenSSL turns on kernel TLS for socket BIOs only. */
+static BIO *tlsBio( SSL_CTX *ctx, int fd )
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	if ( SSL_CTX_get_options( ctx ) & SSL_OP_ENABLE_KTLS )
+		return BIO_new_socket( fd, BIO_NOCLOSE );
+#endif
+	return BIO_new_fd( fd, BIO_NOCLOSE );
+}
+
 void Thread::startTlsClient( SSL_CTX *clientCtx, SelectFd *selectFd, const char *remoteHost )
 {
 	log_debug( DBG_CONNECTION, "starting TLS client" );
@@ -181,7 +443,7 @@ void Thread::startTlsClient( SSL_CTX *clientCtx, SelectFd *selectFd, const char
 	if ( !nb )
 		log_ERROR( "TLS start client: non-blocking IO not available" );
 
-	BIO *bio = BIO_new_fd( selectFd->fd, BIO_NOCLOSE );
+	BIO *bio = tlsBio( clientCtx, selectFd->fd );
 
 	/* Create the SSL object and set it in the secure BIO. */
 	SSL *ssl = SSL_new( clientCtx );
@@ -203,7 +465,7 @@ void Thread::startTlsClient( SSL_CTX *clientCtx, SelectFd *selectFd, const char
 
 void Thread::startTlsServer( SSL_CTX *defaultCtx, SelectFd *selectFd )
 {
-	BIO *bio = BIO_new_fd( selectFd->fd, BIO_NOCLOSE );
+	BIO *bio = tlsBio( defaultCtx, selectFd->fd );
 
 	/* Create the SSL object an set it in the secure BIO. */
 	SSL *ssl = SSL_new( defaultCtx );
@@ -458,7 +720,7 @@ void Thread::connTlsConnectReady( SelectFd *fd )
 			c->close();
 		}
 		else {
-			if ( c->checkHost && !hostMatch( fd, fd->remoteHost ) ) {
+			if ( c->checkHost && !fd->hostVerified && !hostMatch( fd, fd->remoteHost ) ) {
 				fd->sslVerifyError = true;
 
 				log_ERROR( "unable to match peer host to: " << fd->remoteHost );
@@ -1,9 +1,6 @@
 #include "krkern.h"
-
-struct kring
-{
-	struct kobject kobj;
-};
+#include "attribute.h"
+#include "module.h"
 
 
 static struct kring_ringset *head = 0;
@@ -30,82 +27,145 @@ struct kring_ringset *kring_find_ring( const char *name )
 	return 0;
 }
 
-static void *kring_alloc_shared_memory( int size )
+static void *kring_alloc_shared_memory( unsigned long size )
 {
 	void *mem;
 	size = PAGE_ALIGN( size );
 	mem = vmalloc_user( size );
-	memset( mem, 0, size );
+	if ( mem != 0 )
+		memset( mem, 0, size );
 	return mem;
 }
 
-static void kring_ring_alloc( struct kring_params *params, struct kring_ring *r )
-{
-	int i;
+/*
+ * Large rings are allocated in physically contiguous huge-page sized chunks
+ * when the allocator can satisfy it. Each chunk is split into order-0 pages so
+ * they can be inserted into user mappings and freed individually. Otherwise we
+ * fall back to single pages.
+ */
+#define KRING_HUGE_ORDER ( PMD_SHIFT - PAGE_SHIFT )
+#define KRING_HUGE_NPAGES ( 1L << KRING_HUGE_ORDER )
 
-	r->num_writers = 0;
-	r->num_readers = 0;
-
-	r->pd = kmalloc( sizeof(struct kring_page_desc) * params->npages, GFP_KERNEL );
-	for ( i = 0; i < params->npages; i++ ) {
-		r->pd[i].p = alloc_page( GFP_KERNEL | __GFP_ZERO );
-		if ( r->pd[i].p ) {
-			r->pd[i].m = page_address(r->pd[i].p);
+static int kring_ring_alloc_pages( struct kring_ring *r, long npages )
+{
+	long i = 0, j;
+	int order = npages >= KRING_HUGE_NPAGES ? KRING_HUGE_ORDER : 0;
+
+	while ( i < npages ) {
+		struct page *p = 0;
+
+		if ( order > 0 && npages - i >= KRING_HUGE_NPAGES ) {
+			p = alloc_pages( GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY, order );
+			if ( p != 0 ) {
+				split_page( p, order );
+				for ( j = 0; j < KRING_HUGE_NPAGES; j++, i++ ) {
+					r->pd[i].p = p + j;
+					r->pd[i].m = page_address( p + j );
+				}
+				continue;
+			}
+
+			/* Don't keep trying for huge pages. */
+			order = 0;
 		}
-		else {
+
+		p = alloc_page( GFP_KERNEL | __GFP_ZERO );
+		if ( p == 0 ) {
 			printk( "alloc_page for ring allocation failed\n" );
+			return -ENOMEM;
 		}
+
+		r->pd[i].p = p;
+		r->pd[i].m = page_address( p );
+		i += 1;
 	}
 
+	return 0;
+}
+
+static int kring_ring_alloc( struct kring_ringset *rs, struct kring_ring *r )
+{
+	struct kring_params *params = rs->params;
+
+	r->num_writers = 0;
+	r->num_readers = 0;
+
 	init_waitqueue_head( &r->waitqueue );
 
-	r->ctrl = kring_alloc_shared_memory( params->ctrl_sz );
+	r->pd = vzalloc( sizeof(struct kring_page_desc) * rs->npages );
+	if ( r->pd == 0 )
+		return -ENOMEM;
+
+	if ( kring_ring_alloc_pages( r, rs->npages ) < 0 )
+		return -ENOMEM;
+
+	r->ctrl = kring_alloc_shared_memory( (*params->ctrl_sz)( rs->npages, rs->readers, rs->writers ) );
+	if ( r->ctrl == 0 )
+		return -ENOMEM;
+
+	(*params->map_control)( &r->_control_, r->ctrl, rs->readers, rs->writers );
+	(*params->init_control)( rs, r );
+
+	return 0;
+}
+
+static void kring_ring_free( struct kring_ringset *rs, struct kring_ring *r )
+{
+	long i;
 
-	r->_control_.head = r->ctrl + params->ctrl_off_head;
-	r->_control_.writer = r->ctrl + params->ctrl_off_writer;
-	r->_control_.reader = r->ctrl + params->ctrl_off_reader;
-	r->_control_.descriptor = r->ctrl + params->ctrl_off_desc;
+	if ( r->pd != 0 ) {
+		for ( i = 0; i < rs->npages; i++ ) {
+			if ( r->pd[i].p != 0 )
+				__free_page( r->pd[i].p );
+		}
+	}
 
-	(*params->init_control)( r );
+	vfree( r->ctrl );
+	vfree( r->pd );
 }
 
-void kring_ringset_alloc( struct kring_params *params, struct kring_ringset *r, const char *name, long nrings )
+int kring_ringset_alloc( struct kring_params *params, struct kring_ringset *r, const char *name,
+		long nrings, long npages, int readers, int writers )
 {
 	int i;
 
-	printk( "allocating %ld rings\n", nrings );
+	printk( "allocating %ld rings of %ld pages, %d readers, %d writers\n",
+			nrings, npages, readers, writers );
 
 	strncpy( r->name, name, KRING_NLEN );
 	r->name[KRING_NLEN-1] = 0;
 
+	r->params = params;
 	r->nrings = nrings;
-
-	r->ring = kmalloc( sizeof(struct kring_ring) * nrings, GFP_KERNEL );
-	memset( r->ring, 0, sizeof(struct kring_ring) * nrings  );
-
-	for ( i = 0; i < nrings; i++ )
-		kring_ring_alloc( params, &r->ring[i] );
+	r->npages = npages;
+	r->readers = readers;
+	r->writers = writers;
 
 	init_waitqueue_head( &r->waitqueue );
 
-	r->params = params;
-}
+	r->ring = kmalloc( sizeof(struct kring_ring) * nrings, GFP_KERNEL );
+	if ( r->ring == 0 )
+		return -ENOMEM;
 
-static void kring_ring_free( struct kring_params *params, struct kring_ring *r )
-{
-	int i;
-	for ( i = 0; i < params->npages; i++ )
-		__free_page( r->pd[i].p );
+	memset( r->ring, 0, sizeof(struct kring_ring) * nrings  );
 
-	vfree( r->ctrl );
-	kfree( r->pd );
+	for ( i = 0; i < nrings; i++ ) {
+		if ( kring_ring_alloc( r, &r->ring[i] ) < 0 ) {
+			for ( ; i >= 0; i-- )
+				kring_ring_free( r, &r->ring[i] );
+			kfree( r->ring );
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
 }
 
 static void kring_ringset_free( struct kring_ringset *r )
 {
 	int i;
 	for ( i = 0; i < r->nrings; i++ )
-		kring_ring_free( r->params, &r->ring[i] );
+		kring_ring_free( r, &r->ring[i] );
 	kfree( r->ring );
 }
 
@@ -113,6 +173,8 @@ static void kring_free_ringsets( struct kring_ringset *head )
 {
 	struct kring_ringset *r = head;
 	while ( r != 0 ) {
+		if ( r->kobj != 0 )
+			kobject_put( &r->kobj->kobj );
 		kring_ringset_free( r );
 		r = r->next;
 	}
@@ -131,32 +193,143 @@ static void kring_add_ringset( struct kring_ringset **phead, struct kring_ringse
 	set->next = 0;
 }
 
-ssize_t kring_add_data_store( struct kring *obj, const char *name, long rings_per_set )
+static ssize_t kring_add( struct kring_params *params, const char *name,
+		long rings_per_set, long npages, long readers, long writers )
 {
 	struct kring_ringset *r;
-	if ( rings_per_set < 1 || rings_per_set > KDATA_MAX_RINGS_PER_SET )
+
+	/* Zero selects the default. */
+	if ( npages == 0 )
+		npages = params->npages;
+	if ( readers == 0 )
+		readers = params->readers;
+	if ( writers == 0 )
+		writers = params->writers;
+
+	if ( npages < params->min_npages || npages > params->max_npages )
+		return -EINVAL;
+	if ( readers < 1 || readers > params->max_readers )
+		return -EINVAL;
+	if ( writers < 1 || writers > params->max_writers )
 		return -EINVAL;
 
-	r = kmalloc( sizeof(struct kring_ringset), GFP_KERNEL );
-	kring_ringset_alloc( &kdata_params, r, name, rings_per_set );
+	/* Each reader and writer can hold a page. */
+	if ( npages < readers + writers + 2 )
+		return -EINVAL;
+
+	if ( kring_find_ring( name ) != 0 )
+		return -EEXIST;
+
+	r = kzalloc( sizeof(struct kring_ringset), GFP_KERNEL );
+	if ( r == 0 )
+		return -ENOMEM;
+
+	if ( kring_ringset_alloc( params, r, name, rings_per_set, npages, readers, writers ) < 0 ) {
+		printk( "kring: allocation of ringset %s failed\n", name );
+		kfree( r );
+		return -ENOMEM;
+	}
 
 	kring_add_ringset( &head, r );
 
 	return 0;
 }
 
-ssize_t kring_add_cmd_store( struct kring *obj, const char *name )
+ssize_t ringset_stats_show( struct ringset *obj, char *buf )
+{
+	struct kring_ringset *r = obj->ringset;
+	struct kdata_ring_stats *stats;
+	ssize_t len = 0;
+	int ring, id;
+
+	stats = kmalloc( sizeof(struct kdata_ring_stats), GFP_KERNEL );
+	if ( stats == 0 )
+		return -ENOMEM;
+
+	for ( ring = 0; ring < r->nrings; ring++ ) {
+		kdata_ring_stats( KDATA_CONTROL( r->ring[ring] ), stats );
+
+		len += scnprintf( buf + len, PAGE_SIZE - len,
+				"ring %d npages %lu produced %llu\n",
+				ring, stats->npages, stats->produced );
+
+		for ( id = 0; id < stats->nreaders; id++ ) {
+			if ( !r->ring[ring].reader[id].allocated )
+				continue;
+
+			len += scnprintf( buf + len, PAGE_SIZE - len,
+					"  reader %d consumed %llu skips %lu lag %lu lag_hwm %lu\n",
+					id, stats->reader[id].consumed, stats->reader[id].skips,
+					stats->reader[id].lag, stats->reader[id].lag_hwm );
+		}
+
+		for ( id = 0; id < stats->nwriters; id++ ) {
+			if ( !r->ring[ring].writer[id].allocated )
+				continue;
+
+			len += scnprintf( buf + len, PAGE_SIZE - len,
+					"  writer %d retries %llu wakeups %llu\n",
+					id, stats->writer[id].retries, stats->writer[id].wakeups );
+		}
+	}
+
+	kfree( stats );
+	return len;
+}
+
+ssize_t kring_add_data_store( struct kring *obj, const char *name, long rings_per_set,
+		long npages, long readers, long writers )
 {
 	struct kring_ringset *r;
+	ssize_t ret;
 
-	r = kmalloc( sizeof(struct kring_ringset), GFP_KERNEL );
-	kring_ringset_alloc( &kctrl_params, r, name, 1 );
+	if ( rings_per_set < 1 || rings_per_set > KDATA_MAX_RINGS_PER_SET )
+		return -EINVAL;
 
-	kring_add_ringset( &head, r );
+	ret = kring_add( &kdata_params, name, rings_per_set, npages, readers, writers );
+	if ( ret < 0 )
+		return ret;
+
+	/* Statistics under /sys/kring/<name>. */
+	r = kring_find_ring( name );
+	if ( create_ringset( &r->kobj, r->name, &root_obj->kobj ) == 0 )
+		r->kobj->ringset = r;
+	else
+		r->kobj = 0;
 
 	return 0;
 }
 
+/* Set the wakeup coalescing parameters of a data ringset. */
+ssize_t kring_wake_store( struct kring *obj, const char *name, long batch, long timeout_ms )
+{
+	struct kring_ringset *r;
+	int ring;
+
+	r = kring_find_ring( name );
+	if ( r == 0 || r->params != &kdata_params )
+		return -EINVAL;
+
+	if ( batch < 1 || batch > r->npages / 2 || timeout_ms < 0 )
+		return -EINVAL;
+
+	/* Batching relies on the timeout to bound latency. */
+	if ( batch > 1 && timeout_ms == 0 )
+		return -EINVAL;
+
+	for ( ring = 0; ring < r->nrings; ring++ ) {
+		KDATA_CONTROL( r->ring[ring] )->head->wake_batch = batch;
+		KDATA_CONTROL( r->ring[ring] )->head->wake_timeout = timeout_ms;
+	}
+
+	return 0;
+}
+
+ssize_t kring_add_cmd_store( struct kring *obj, const char *name )
+{
+	return kring_add( &kctrl_params, name, 1, 0, 0, 0 );
+}
+
 ssize_t kring_del_store( struct kring *obj, const char *name  )
 {
 	return 0;
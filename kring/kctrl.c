@@ -13,29 +13,31 @@
 //static int kctrl_sock_create( struct net *net, struct socket *sock, int protocol, int kern );
 int kctrl_bind( struct socket *sock, struct sockaddr *sa, int addr_len);
 
-static void kctrl_init_control( struct kring_ring *ring );
+static unsigned long kctrl_ctrl_size( long npages, int readers, int writers );
+static void kctrl_map_control( struct kring_control *control, void *ctrl, int readers, int writers );
+static void kctrl_init_control( struct kring_ringset *r, struct kring_ring *ring );
 static int  kctrl_wait( struct kring_sock *krs );
+static unsigned int kctrl_poll( struct kring_sock *krs );
 static void kctrl_notify( struct kring_sock *krs );
 static void kctrl_destruct( struct kring_sock *krs );
 
 struct kring_params kctrl_params =
 {
 	KCTRL_NPAGES,
+	KCTRL_READERS,
+	KCTRL_WRITERS,
 
-	KCTRL_CTRL_SZ,
-
-	KCTRL_CTRL_OFF_HEAD,
-	KCTRL_CTRL_OFF_WRITER,
-	KCTRL_CTRL_OFF_READER,
-	KCTRL_CTRL_OFF_DESC,
-
-	KCTRL_DATA_SZ,
-
+	/* Command rings have a fixed geometry. */
+	KCTRL_NPAGES,
+	KCTRL_NPAGES,
 	KCTRL_READERS,
 	KCTRL_WRITERS,
 
+	&kctrl_ctrl_size,
+	&kctrl_map_control,
 	&kctrl_init_control,
 	&kctrl_wait,
+	&kctrl_poll,
 	&kctrl_notify,
 	&kctrl_destruct,
 };
@@ -43,7 +45,7 @@ struct kring_params kctrl_params =
 
 int kctrl_kavail( struct kring_kern *kring )
 {
-	return kctrl_avail_impl( kctrl_control(kring->user.control) );
+	return kctrl_avail_impl( kctrl_control(kring->user.control), kring->user.reader_id );
 }
 
 static int kctrl_wait( struct kring_sock *krs )
@@ -56,7 +58,18 @@ static int kctrl_wait( struct kring_sock *krs )
 
 	wq = &r->waitqueue;
 
-	return wait_event_interruptible( *wq, KCTRL_CONTROL(r->ring[krs->ring_id])->head->free != KCTRL_NULL );
+	return wait_event_interruptible( *wq, kctrl_free_avail( KCTRL_CONTROL(r->ring[krs->ring_id]) ) );
+}
+
+static unsigned int kctrl_poll( struct kring_sock *krs )
+{
+	struct kctrl_control *control = KCTRL_CONTROL(krs->ringset->ring[krs->ring_id]);
+
+	if ( krs->mode == KRING_READ )
+		return kctrl_avail_impl( control, krs->reader_id ) ? POLLIN | POLLRDNORM : 0;
+
+	/* Writers wait for free buffers. */
+	return kctrl_free_avail( control ) ? POLLOUT | POLLWRNORM : 0;
 }
 
 static void kctrl_notify( struct kring_sock *krs )
@@ -78,66 +91,86 @@ static void kctrl_destruct( struct kring_sock *krs )
 		case KRING_READ: {
 			krs->ringset->ring[krs->ring_id].num_readers -= 1;
 
-			/* One ring or all? */
+			/* One ring or all? Commands the reader took but did not get to go
+			 * back on the stack for other readers. */
 			if ( krs->ring_id != KCTRL_RING_ID_ALL ) {
-				// struct kctrl_control *control = &krs->ringset->ring[krs->ring_id].control;
-
+				kctrl_reader_release( KCTRL_CONTROL( krs->ringset->ring[krs->ring_id] ), krs->reader_id );
 				krs->ringset->ring[krs->ring_id].reader[krs->reader_id].allocated = false;
-
-				// if ( control->reader[krs->reader_id].entered ) {
-				//	kctrl_off_t prev = control->reader[krs->reader_id].rhead;
-				//	kctrl_reader_release( krs->reader_id, &control[0], prev );
-				// }
 			}
 			else {
 				for ( i = 0; i < krs->ringset->nrings; i++ ) {
-					// struct kctrl_control *control = &krs->ringset->ring[i].control;
-
+					kctrl_reader_release( KCTRL_CONTROL( krs->ringset->ring[i] ), krs->reader_id );
 					krs->ringset->ring[i].reader[krs->reader_id].allocated = false;
-
-					// if ( control->reader[krs->reader_id].entered ) {
-					//	kctrl_off_t prev = control->reader[krs->reader_id].rhead;
-					//	kctrl_reader_release( krs->reader_id, &control[0], prev );
-					// }
 				}
 			}
+
+			/* Writers may be waiting on the buffer the reader held. */
+			wake_up_interruptible_all( &krs->ringset->waitqueue );
 		}
 	}
 }
 
-void kctrl_knext_plain( struct kring_kern *kring, struct kctrl_plain *plain )
+int kctrl_knext_plain( struct kring_kern *kring, struct kctrl_plain *plain )
 {
 	struct kctrl_plain_header *h;
 
 	h = (struct kctrl_plain_header*) kctrl_next_generic( &kring->user );
+	if ( h == 0 )
+		return 0;
 
 	wake_up_interruptible_all( &kring->ringset->ring[kring->ring_id].waitqueue );
 
 	plain->len = h->len;
 	plain->bytes = (unsigned char*)(h + 1);
+	return 1;
 }
 
-static void kctrl_init_control( struct kring_ring *ring )
+static int kctrl_kwatch_wake( wait_queue_t *wait, unsigned mode, int sync, void *key )
 {
-	struct kctrl_control *control = KCTRL_CONTROL( *ring );
-	int i;
+	struct kring_kern *kring = container_of( wait, struct kring_kern, watch );
+	schedule_work( kring->work );
+	return 0;
+}
+
+/* Schedule work whenever a writer notifies the ringset, instead of checking
+ * for commands from some other path. */
+void kctrl_kwatch( struct kring_kern *kring, struct work_struct *work )
+{
+	kring->work = work;
+	init_waitqueue_func_entry( &kring->watch, kctrl_kwatch_wake );
+	add_wait_queue( &kring->ringset->waitqueue, &kring->watch );
 
-	/* Use the first page as the stack sential. */
-	control->head->head = 0;
-	control->head->tail = 0;
-	control->head->stack = 0;
+	/* Commands may have arrived before we were watching. */
+	schedule_work( work );
+}
 
-	control->descriptor[0].next = KCTRL_NULL;
+void kctrl_kunwatch( struct kring_kern *kring )
+{
+	if ( kring->work == 0 )
+		return;
 
-	/* Link item 1 through to the last into the free list. */
-	control->head->free = 1;
-	for ( i = 1; i < KCTRL_NPAGES - 1; i++ )
-		control->descriptor[i].next = i + 1;
+	remove_wait_queue( &kring->ringset->waitqueue, &kring->watch );
+	cancel_work_sync( kring->work );
+	kring->work = 0;
+}
 
-	/* Terminate the free list. */
-	control->descriptor[KCTRL_NPAGES-1].next = KCTRL_NULL;
+static unsigned long kctrl_ctrl_size( long npages, int readers, int writers )
+{
+	return KCTRL_CTRL_SZ;
+}
+
+static void kctrl_map_control( struct kring_control *control, void *ctrl, int readers, int writers )
+{
+	kctrl_control_map( kctrl_control( control ), ctrl );
+}
+
+static void kctrl_init_control( struct kring_ringset *r, struct kring_ring *ring )
+{
+	kctrl_control_init( KCTRL_CONTROL( *ring ) );
 }
 
 EXPORT_SYMBOL_GPL(kctrl_kavail);
 EXPORT_SYMBOL_GPL(kctrl_knext_plain);
+EXPORT_SYMBOL_GPL(kctrl_kwatch);
+EXPORT_SYMBOL_GPL(kctrl_kunwatch);
 
@@ -3,11 +3,14 @@
 
 /*
  * Three Part:
- *  1. Writer allocates buffers using a free list.
+ *  1. Writer allocates buffers using a free list. The free list head carries
+ *     an ABA tag above the index, advanced on every update.
  *
  *  2. Writer atomically pushes to stack of messages.
  *
- *  3. Reader reverses stack before reading
+ *  3. Reader takes the whole stack with an atomic exchange and reverses it
+ *     into its own pending list before reading. Any number of readers can
+ *     take from the stack, each command goes to one reader.
  */
 
 #if defined(__cplusplus)
@@ -19,7 +22,11 @@ extern "C" {
 #define KCTRL 20
 #define KCTRL_NPAGES 2048
 
-#define KCTRL_INDEX(off) ((off) & 0x7ff)
+/* Offsets in the free list head are tagged. */
+#define KCTRL_INDEX_BITS 16
+#define KCTRL_INDEX_MASK 0xffffUL
+#define KCTRL_INDEX(off) ((off) & KCTRL_INDEX_MASK)
+#define KCTRL_TAG_INC ( 1UL << KCTRL_INDEX_BITS )
 
 #define KRING_PGOFF_CTRL 0
 #define KRING_PGOFF_DATA 1
@@ -30,14 +37,15 @@ extern "C" {
  * Memap identity information. 
  */
 
-/* Must match region shift below. */
-#define KCTRL_MAX_RINGS_PER_SET 32
+/* Must match region shift below, and the kdata encoding, which the kernel
+ * uses to decode offsets for both ring types. */
+#define KCTRL_MAX_RINGS_PER_SET 256
 
 #define KCTRL_PGOFF_ID_SHIFT 0
-#define KCTRL_PGOFF_ID_MASK  0x1f
+#define KCTRL_PGOFF_ID_MASK  0xff
 
-#define KCTRL_PGOFF_REGION_SHIFT 5
-#define KCTRL_PGOFF_REGION_MASK  0x20
+#define KCTRL_PGOFF_REGION_SHIFT 8
+#define KCTRL_PGOFF_REGION_MASK  0x100
 
 #define KCTRL_RING_ID_ALL -1
 
@@ -50,7 +58,7 @@ extern "C" {
 
 #define KCTRL_NLEN 32
 #define KCTRL_WRITERS 6
-#define KCTRL_READERS 1
+#define KCTRL_READERS 6
 
 #define KR_OPT_WRITER_ID 1
 #define KR_OPT_READER_ID 2
@@ -63,24 +71,31 @@ extern "C" {
 typedef unsigned short kctrl_desc_t;
 typedef unsigned long kctrl_off_t;
 
+#define KCTRL_CACHE_ALIGNED __attribute__((aligned(64)))
+
 struct kctrl_shared_head
 {
-	kctrl_off_t head;
-	kctrl_off_t tail;
+	/* Tagged. */
 	kctrl_off_t free;
-	kctrl_off_t stack;
-};
+
+	kctrl_off_t stack KCTRL_CACHE_ALIGNED;
+} KCTRL_CACHE_ALIGNED;
 
 struct kctrl_shared_writer
 {
 	kctrl_off_t wloc;
-};
+} KCTRL_CACHE_ALIGNED;
 
 struct kctrl_shared_reader
 {
-	char unused;
-};
+	/* Commands taken from the stack, oldest first. */
+	kctrl_off_t pending;
+
+	/* Buffer returned by the last read. Freed on the next. */
+	kctrl_off_t current;
+} KCTRL_CACHE_ALIGNED;
 
+/* Untagged. */
 struct kctrl_shared_desc
 {
 	kctrl_off_t next;
@@ -109,6 +124,37 @@ struct kctrl_control
 	struct kctrl_shared_desc *descriptor;
 };
 
+/* Point the control struct into a mapped control region. */
+static inline void kctrl_control_map( struct kctrl_control *control, void *ctrl )
+{
+	char *base = (char*)ctrl;
+	control->head = (struct kctrl_shared_head*)( base + KCTRL_CTRL_OFF_HEAD );
+	control->writer = (struct kctrl_shared_writer*)( base + KCTRL_CTRL_OFF_WRITER );
+	control->reader = (struct kctrl_shared_reader*)( base + KCTRL_CTRL_OFF_READER );
+	control->descriptor = (struct kctrl_shared_desc*)( base + KCTRL_CTRL_OFF_DESC );
+}
+
+/* Initialize a freshly zeroed control region. */
+static inline void kctrl_control_init( struct kctrl_control *control )
+{
+	int i;
+
+	control->head->stack = KCTRL_NULL;
+
+	for ( i = 0; i < KCTRL_READERS; i++ ) {
+		control->reader[i].pending = KCTRL_NULL;
+		control->reader[i].current = KCTRL_NULL;
+	}
+
+	/* Link all items into the free list. */
+	control->head->free = 0;
+	for ( i = 0; i < KCTRL_NPAGES - 1; i++ )
+		control->descriptor[i].next = i + 1;
+
+	/* Terminate the free list. */
+	control->descriptor[KCTRL_NPAGES-1].next = KCTRL_NULL;
+}
+
 struct kctrl_packet
 {
 	char dir;
@@ -151,13 +197,58 @@ struct kctrl_plain_header
 	int len;
 };
 
+/*
+ * Binary commands to the shuttle, carried as the bytes of a plain message.
+ * Addresses and ports are in network byte order.
+ */
+
+#define KCTRL_CMD_VERSION 2
+
+enum KCTRL_CMD
+{
+	KCTRL_CMD_BLOCK = 1,
+	KCTRL_CMD_UNBLOCK,
+	KCTRL_CMD_IP_ADD,
+	KCTRL_CMD_IP_DEL
+};
+
+#define KCTRL_ADDR_IP4 4
+#define KCTRL_ADDR_IP6 6
+
+struct kctrl_addr
+{
+	unsigned char family;
+	unsigned char pad[3];
+	union {
+		unsigned int ip4;
+		unsigned char ip6[16];
+	} a;
+};
+
+struct kctrl_cmd
+{
+	unsigned short version;
+	unsigned short type;
+
+	/* Redirect IP, or the first end of a blocked flow. */
+	struct kctrl_addr addr1;
+	struct kctrl_addr addr2;
+	unsigned short port1;
+	unsigned short port2;
+
+	/* Seconds until a block or redirect expires. Zero for never. */
+	unsigned int ttl;
+};
+
 int kring_open( struct kring_user *u, enum KRING_TYPE type, const char *ringset, enum KRING_PROTO proto, int ring_id, enum KRING_MODE mode );
 int kctrl_write_decrypted( struct kring_user *u, long id, int type, const char *remoteHost, char *data, int len );
 int kctrl_write_plain( struct kring_user *u, char *data, int len );
+int kctrl_write_cmd( struct kring_user *u, const struct kctrl_cmd *cmd );
+int kctrl_parse_addr( struct kctrl_addr *addr, const char *ip );
 int kctrl_read_wait( struct kring_user *u );
-void kctrl_next_packet( struct kring_user *u, struct kctrl_packet *packet );
-void kctrl_next_decrypted( struct kring_user *u, struct kctrl_decrypted *decrypted );
-void kctrl_next_plain( struct kring_user *u, struct kctrl_plain *plain );
+int kctrl_next_packet( struct kring_user *u, struct kctrl_packet *packet );
+int kctrl_next_decrypted( struct kring_user *u, struct kctrl_decrypted *decrypted );
+int kctrl_next_plain( struct kring_user *u, struct kctrl_plain *plain );
 
 static inline int kctrl_packet_max_data(void)
 {
@@ -184,15 +275,19 @@ static inline void *kctrl_page_data( struct kring_user *u, kctrl_off_t off )
 		return u->data->page + KCTRL_INDEX(off);
 }
 
-static inline int kctrl_avail_impl( struct kctrl_control *control )
+static inline int kctrl_avail_impl( struct kctrl_control *control, int reader_id )
 {
-	if ( control->descriptor[ KCTRL_INDEX(control->head->head) ].next != KCTRL_NULL ||
-			control->descriptor[ KCTRL_INDEX(control->head->stack) ].next != KCTRL_NULL )
+	if ( control->reader[reader_id].pending != KCTRL_NULL || control->head->stack != KCTRL_NULL )
 		return 1;
 
 	return 0;
 }
 
+static inline int kctrl_free_avail( struct kctrl_control *control )
+{
+	return KCTRL_INDEX( control->head->free ) != KCTRL_NULL;
+}
+
 static inline struct kctrl_control *kctrl_control( struct kring_control *control )
 {
 	return (struct kctrl_control*) control;
@@ -200,91 +295,136 @@ static inline struct kctrl_control *kctrl_control( struct kring_control *control
 
 static inline int kctrl_avail( struct kring_user *u )
 {
-	return kctrl_avail_impl( kctrl_control( u->control ) );
+	return kctrl_avail_impl( kctrl_control( u->control ), u->reader_id );
 }
 
 /* Return the block to the free list. */
-static inline void kctrl_push_to_free_list( struct kring_user *u, kctrl_off_t head )
+static inline void kctrl_push_to_free_list( struct kctrl_control *control, kctrl_off_t index )
 {
 	kctrl_off_t before, free;
 
 again:
-	free = kctrl_control(u->control)->head->free;
+	free = control->head->free;
 
-	kctrl_control(u->control)->descriptor[KCTRL_INDEX(head)].next = free;
+	control->descriptor[index].next = KCTRL_INDEX(free);
 
-	before = __sync_val_compare_and_swap(
-			&kctrl_control(u->control)->head->free, free, head );
+	/* Advance the tag along with the index. */
+	before = __sync_val_compare_and_swap( &control->head->free, free,
+			( ( free & ~KCTRL_INDEX_MASK ) + KCTRL_TAG_INC ) | index );
 
 	if ( before != free )
 		goto again;
 }
 
-static inline void kctrl_reverse_stack( struct kring_user *u )
+/* Take everything on the stack and append it, oldest first, to the reader's
+ * pending list. */
+static inline void kctrl_take_stack( struct kctrl_control *control, int reader_id )
 {
 	kctrl_off_t prev, next, stack;
 
+	stack = __sync_lock_test_and_set( &control->head->stack, KCTRL_NULL );
+	if ( stack == KCTRL_NULL )
+		return;
+
 	/* Go forward from stack, reversing. */
 	prev = KCTRL_NULL;
-	stack = kctrl_control(u->control)->head->stack;
 	while ( stack != KCTRL_NULL ) {
-		next = kctrl_control(u->control)->descriptor[ KCTRL_INDEX(stack) ].next;
-
-		kctrl_control(u->control)->descriptor[ KCTRL_INDEX(stack) ].next = prev;
-
+		next = control->descriptor[stack].next;
+		control->descriptor[stack].next = prev;
 		prev = stack;
 		stack = next;
 	}
+
+	if ( control->reader[reader_id].pending == KCTRL_NULL )
+		control->reader[reader_id].pending = prev;
+	else {
+		kctrl_off_t last = control->reader[reader_id].pending;
+		while ( control->descriptor[last].next != KCTRL_NULL )
+			last = control->descriptor[last].next;
+		control->descriptor[last].next = prev;
+	}
 }
 
+/* Returns NULL if another reader took what was available. */
 static inline void *kctrl_next_generic( struct kring_user *u )
 {
-	kctrl_off_t head;
+	struct kctrl_control *control = kctrl_control(u->control);
+	struct kctrl_shared_reader *reader = &control->reader[u->reader_id];
+	kctrl_off_t node;
+
+	/* Free the buffer returned last time. */
+	if ( reader->current != KCTRL_NULL ) {
+		kctrl_push_to_free_list( control, reader->current );
+		reader->current = KCTRL_NULL;
+	}
 
-	kctrl_reverse_stack( u );
+	if ( reader->pending == KCTRL_NULL )
+		kctrl_take_stack( control, u->reader_id );
 
-	/* Pull one off the head. */
-	head = kctrl_control(u->control)->head->head;
+	node = reader->pending;
+	if ( node == KCTRL_NULL )
+		return 0;
 
-	kctrl_control(u->control)->head->head = kctrl_control(u->control)->descriptor[ KCTRL_INDEX(kctrl_control(u->control)->head->head) ].next;
+	reader->pending = control->descriptor[node].next;
+	reader->current = node;
 
-	/* Free the node we pulled off. */
-	kctrl_push_to_free_list( u, head );
+	return kctrl_page_data( u, node );
+}
 
-	/* Return the new head. */
-	return kctrl_page_data( u, kctrl_control(u->control)->head->head );
+/* Reader is going away. Free its buffer and give its pending commands back to
+ * the stack for the other readers. */
+static inline void kctrl_reader_release( struct kctrl_control *control, int reader_id )
+{
+	struct kctrl_shared_reader *reader = &control->reader[reader_id];
+	kctrl_off_t node, stack, before;
+
+	if ( reader->current != KCTRL_NULL ) {
+		kctrl_push_to_free_list( control, reader->current );
+		reader->current = KCTRL_NULL;
+	}
+
+	while ( reader->pending != KCTRL_NULL ) {
+		node = reader->pending;
+		reader->pending = control->descriptor[node].next;
+
+	again:
+		stack = control->head->stack;
+		control->descriptor[node].next = stack;
+		before = __sync_val_compare_and_swap( &control->head->stack, stack, node );
+		if ( before != stack )
+			goto again;
+	}
 }
 
 static inline kctrl_off_t kctrl_allocate( struct kring_user *u )
 {
-	volatile kctrl_off_t before, next, free;
+	struct kctrl_control *control = kctrl_control(u->control);
+	kctrl_off_t before, next, free;
 
 again:
 	/* Read the free pointer. If nothing avail then spin. */
-	free = kctrl_control(u->control)->head->free;
-	if ( free == KCTRL_NULL )
+	free = control->head->free;
+	if ( KCTRL_INDEX(free) == KCTRL_NULL )
 		return KCTRL_NULL;
 
-	next = kctrl_control(u->control)->descriptor[free].next;
+	/* May be stale if the block is taken concurrently. The tag makes the
+	 * write back fail in that case. */
+	next = control->descriptor[KCTRL_INDEX(free)].next;
 	
 	/* Attempt to rewrite the pointer to next. */
-	before = __sync_val_compare_and_swap(
-			&kctrl_control(u->control)->head->free, free, next );
+	before = __sync_val_compare_and_swap( &control->head->free, free,
+			( ( free & ~KCTRL_INDEX_MASK ) + KCTRL_TAG_INC ) | next );
 	
 	/* Try again if some other thread wrote first. */
 	if ( before != free ) 
 		goto again;
 
 	/* Success. Record where we are writing to. Clear the item's next pointer. */
-	kctrl_control(u->control)->writer[u->writer_id].wloc = free;
-
-	kctrl_control(u->control)->descriptor[KCTRL_INDEX(free)].next = KCTRL_NULL;
+	control->writer[u->writer_id].wloc = KCTRL_INDEX(free);
 
-#ifndef KERN
-	// printf("allocated: %lu\n", free );
-#endif
+	control->descriptor[KCTRL_INDEX(free)].next = KCTRL_NULL;
 
-	return free;
+	return KCTRL_INDEX(free);
 }
 
 /* Returns NULL if there are no free buffers in the ring. */
@@ -298,19 +438,20 @@ static inline void *kctrl_write_FIRST( struct kring_user *u )
 	return kctrl_page_data( u, free );
 }
 
+/* Untagged. The only removal from the stack is the reader's exchange to NULL,
+ * after which a CAS from a stale top fails, so there is no ABA. */
 static inline void kctrl_push_new( struct kring_user *u )
 {
-	volatile kctrl_off_t stack, before;
+	struct kctrl_control *control = kctrl_control(u->control);
+	kctrl_off_t wloc = control->writer[u->writer_id].wloc;
+	kctrl_off_t stack, before;
 
 again:
-	/* Move forward to the true tail. */
-	stack = kctrl_control(u->control)->head->stack;
+	stack = control->head->stack;
 
-	kctrl_control(u->control)->descriptor[KCTRL_INDEX(kctrl_control(u->control)->writer[u->writer_id].wloc)].next = stack;
+	control->descriptor[wloc].next = stack;
 
-	before = __sync_val_compare_and_swap(
-			&kctrl_control(u->control)->head->stack, stack,
-			kctrl_control(u->control)->writer[u->writer_id].wloc );
+	before = __sync_val_compare_and_swap( &control->head->stack, stack, wloc );
 	
 	if ( before != stack )
 		goto again;
@@ -9,29 +9,30 @@
 
 #include "krkern.h"
 
-static void kdata_init_control( struct kring_ring *ring );
+static unsigned long kdata_ctrl_size( long npages, int readers, int writers );
+static void kdata_map_control( struct kring_control *control, void *ctrl, int readers, int writers );
+static void kdata_init_control( struct kring_ringset *r, struct kring_ring *ring );
 static int  kdata_wait( struct kring_sock *krs );
+static unsigned int kdata_poll( struct kring_sock *krs );
 static void kdata_notify( struct kring_sock *krs );
 static void kdata_destruct( struct kring_sock *krs );
 
 struct kring_params kdata_params =
 {
 	KDATA_NPAGES,
-
-	KDATA_CTRL_SZ,
-
-	KDATA_CTRL_OFF_HEAD,
-	KDATA_CTRL_OFF_WRITER,
-	KDATA_CTRL_OFF_READER,
-	KDATA_CTRL_OFF_DESC,
-
-	KDATA_DATA_SZ,
-
 	KDATA_READERS,
 	KDATA_WRITERS,
 
+	KDATA_MIN_NPAGES,
+	KDATA_MAX_NPAGES,
+	KDATA_MAX_READERS,
+	KDATA_MAX_WRITERS_PER_RING,
+
+	&kdata_ctrl_size,
+	&kdata_map_control,
 	&kdata_init_control,
 	&kdata_wait,
+	&kdata_poll,
 	&kdata_notify,
 	&kdata_destruct,
 };
@@ -50,17 +51,66 @@ static int kdata_kern_avail( struct kring_ringset *r, struct kring_sock *krs )
 	}
 }
 
+/* Advertise to writers that the reader is (or is no longer) sleeping. */
+static void kdata_kern_waiting( struct kring_ringset *r, struct kring_sock *krs, int waiting )
+{
+	if ( krs->ring_id != KDATA_RING_ID_ALL )
+		kdata_reader_waiting( KDATA_CONTROL(r->ring[krs->ring_id]), krs->reader_id, waiting );
+	else {
+		int ring;
+		for ( ring = 0; ring < r->nrings; ring++ )
+			kdata_reader_waiting( KDATA_CONTROL(r->ring[ring]), krs->reader_id, waiting );
+	}
+}
+
 static int kdata_wait( struct kring_sock *krs )
 {
 	struct kring_ringset *r = krs->ringset;
+	struct kdata_shared_head *head = KDATA_CONTROL(r->ring[0])->head;
 	wait_queue_head_t *wq;
+	long ret;
 
 	// wq = krs->ring_id == KRING_RING_ID_ALL ? &r->reader_waitqueue 
 	// : &r->ring[krs->ring_id].reader_waitqueue;
 
 	wq = &r->waitqueue;
 
-	return wait_event_interruptible( *wq, kdata_kern_avail( r, krs ) );
+	kdata_kern_waiting( r, krs, 1 );
+
+	if ( head->wake_batch > 1 ) {
+		/* Writers hold off until a batch is ready, so bound the sleep. */
+		ret = wait_event_interruptible_timeout( *wq, kdata_kern_avail( r, krs ),
+				msecs_to_jiffies( head->wake_timeout ) );
+		if ( ret > 0 )
+			ret = 0;
+	}
+	else {
+		ret = wait_event_interruptible( *wq, kdata_kern_avail( r, krs ) );
+	}
+
+	kdata_kern_waiting( r, krs, 0 );
+
+	return ret;
+}
+
+static unsigned int kdata_poll( struct kring_sock *krs )
+{
+	struct kring_ringset *r = krs->ringset;
+
+	if ( krs->mode != KRING_READ )
+		return POLLOUT | POLLWRNORM;
+
+	/* Writers only wake readers that are waiting. A poller is waiting until it
+	 * reads. With a wake batch above one nothing here bounds the wait as
+	 * kdata_wait does, writers hold off until a batch is ready. Poll users
+	 * must pass a timeout no longer than wake_timeout to poll or epoll_wait
+	 * and check the ring when it expires. */
+	kdata_kern_waiting( r, krs, 1 );
+
+	if ( kdata_kern_avail( r, krs ) )
+		return POLLIN | POLLRDNORM;
+
+	return 0;
 }
 
 static void kdata_notify( struct kring_sock *krs )
@@ -155,18 +205,32 @@ int kring_kopen( struct kring_kern *kring, enum KRING_TYPE type, const char *rsn
 	kring->user.control = &ringset->ring[ring_id]._control_;
 	kring->user.data = 0;
 	kring->user.pd = ringset->ring[ring_id].pd;
+	kring->user.type = type;
 	kring->user.mode = mode;
 	kring->user.ring_id = ring_id;
 	kring->user.reader_id = reader_id;
 	kring->user.writer_id = writer_id;
 	kring->user.nrings = ringset->nrings;
 
+	kring->work = 0;
+
 	return 0;
 }
 
 int kring_kclose( struct kring_kern *kring )
 {
-	kring->ringset->ring[kring->ring_id].num_writers -= 1;
+	struct kring_ring *ring = &kring->ringset->ring[kring->ring_id];
+
+	if ( kring->user.type == KRING_CTRL ) {
+		kctrl_kunwatch( kring );
+		kctrl_reader_release( KCTRL_CONTROL( *ring ), kring->user.reader_id );
+		ring->reader[kring->user.reader_id].allocated = false;
+		ring->num_readers -= 1;
+		return 0;
+	}
+
+	ring->writer[kring->user.writer_id].allocated = false;
+	ring->num_writers -= 1;
 	return 0;
 }
 
@@ -206,16 +270,20 @@ static void kdata_write_single( struct kring_kern *kring, int dir,
 	}
 	#endif
 
-	wake_up_interruptible_all( &r->waitqueue );
+	if ( kdata_wake_needed( KDATA_CONTROL( r->ring[kring->ring_id] ) ) ) {
+		KDATA_CONTROL( r->ring[kring->ring_id] )->writer[kring->user.writer_id].wakeups += 1;
+		wake_up_interruptible_all( &r->waitqueue );
+	}
 }
 
-void kdata_kwrite( struct kring_kern *kring, int dir, const struct sk_buff *skb )
+/* Writes the first total bytes of the skb, splitting across units. */
+static void kdata_kwrite_len( struct kring_kern *kring, int dir, const struct sk_buff *skb, int total )
 {
 	int offset = 0, write, len;
 
 	while ( true ) {
 		/* Number of bytes left in the packet (maybe overflows) */
-		len = skb->len - offset;
+		len = total - offset;
 		if ( len <= 0 )
 			break;
 
@@ -230,12 +298,41 @@ void kdata_kwrite( struct kring_kern *kring, int dir, const struct sk_buff *skb
 	}
 }
 
-static void kdata_init_control( struct kring_ring *r )
+void kdata_kwrite( struct kring_kern *kring, int dir, const struct sk_buff *skb )
+{
+	kdata_kwrite_len( kring, dir, skb, skb->len );
+}
+
+/* Writes at most snaplen bytes, zero for the whole frame. A truncated frame is
+ * written with the truncated length, so readers see a complete, shorter
+ * packet and do not wait for the rest. */
+void kdata_kwrite_snap( struct kring_kern *kring, int dir, const struct sk_buff *skb, int snaplen )
+{
+	int total = skb->len;
+
+	if ( snaplen > 0 && snaplen < total )
+		total = snaplen;
+
+	kdata_kwrite_len( kring, dir, skb, total );
+}
+
+static unsigned long kdata_ctrl_size( long npages, int readers, int writers )
+{
+	return kdata_ctrl_sz( npages, readers, writers );
+}
+
+static void kdata_map_control( struct kring_control *control, void *ctrl, int readers, int writers )
+{
+	kdata_control_map( kdata_control( control ), ctrl, readers, writers );
+}
+
+static void kdata_init_control( struct kring_ringset *r, struct kring_ring *ring )
 {
-	KDATA_CONTROL(*r)->head->whead = KDATA_CONTROL(*r)->head->wresv = kdata_prev( 0 );
+	kdata_control_init( KDATA_CONTROL(*ring), r->npages, r->readers, r->writers );
 }
 
 EXPORT_SYMBOL_GPL(kring_kopen);
 EXPORT_SYMBOL_GPL(kring_kclose);
 
 EXPORT_SYMBOL_GPL(kdata_kwrite);
+EXPORT_SYMBOL_GPL(kdata_kwrite_snap);
@@ -8,7 +8,12 @@ extern "C" {
 #include "krdep.h"
 
 #define KDATA 25
+
+/* Default ring size in pages. Ring size, reader count and writer count are
+ * given when a ringset is added and are recorded in the shared head. */
 #define KDATA_NPAGES 2048
+#define KDATA_MIN_NPAGES 16
+#define KDATA_MAX_NPAGES ( 1 << 18 )
 
 #define KRING_PGOFF_CTRL 0
 #define KRING_PGOFF_DATA 1
@@ -17,16 +22,16 @@ extern "C" {
  * Memap identity information. 
  */
 
-/* Ring id (5), region to map (1) */
+/* Ring id (8), region to map (1) */
 
 /* Must match region shift below. */
-#define KDATA_MAX_RINGS_PER_SET 32
+#define KDATA_MAX_RINGS_PER_SET 256
 
 #define KRING_PGOFF_ID_SHIFT 0
-#define KRING_PGOFF_ID_MASK  0x1f
+#define KRING_PGOFF_ID_MASK  0xff
 
-#define KRING_PGOFF_REGION_SHIFT 5
-#define KRING_PGOFF_REGION_MASK  0x20
+#define KRING_PGOFF_REGION_SHIFT 8
+#define KRING_PGOFF_REGION_MASK  0x100
 
 #define KDATA_RING_ID_ALL -1
 
@@ -34,7 +39,7 @@ extern "C" {
 #define KDATA_DSC_READER_SHIFT    2
 #define KDATA_DSC_WRITER_OWNED    0x01
 #define KDATA_DSC_SKIPPED         0x02
-#define KDATA_DSC_READER_OWNED    0xfc
+#define KDATA_DSC_READER_OWNED    0xfffc
 #define KDATA_DSC_READER_BIT(id)  ( 0x1 << ( KDATA_DSC_READER_SHIFT + (id) ) )
 
 /* Direction: from client, or from server. */
@@ -45,10 +50,14 @@ extern "C" {
 #define KDATA_DIR_OUTSIDE 2
 
 #define KRING_NLEN 32
+
+/* Defaults. */
 #define KDATA_READERS 6
 #define KDATA_WRITERS 6
 
-/* Configurable at allocation time. This specifies the maximum. */
+/* Configurable at allocation time. These specify the maximum. Reader ids are
+ * limited by the reader bits available in the descriptor. */
+#define KDATA_MAX_READERS 14
 #define KDATA_MAX_WRITERS_PER_RING 32
 
 #define KR_OPT_WRITER_ID 1
@@ -62,46 +71,132 @@ extern "C" {
 typedef unsigned short kdata_desc_t;
 typedef unsigned long kdata_off_t;
 
+/*
+ * Control layout version. Bump whenever the shared structs change. User space
+ * refuses to map a control region with a different version.
+ */
+#define KDATA_CTRL_VERSION 4
+
+/* Items written by different parties are kept on separate cache lines. */
+#define KDATA_CACHE_LINE 64
+#define KDATA_CACHE_ALIGNED __attribute__((aligned(KDATA_CACHE_LINE)))
+
 struct kdata_shared_head
 {
-	kdata_off_t whead;
+	/* Written once when the ring is allocated. The version must stay first. */
+	unsigned int version;
+	int nreaders;
+	int nwriters;
+	unsigned long npages;
+
+	/* Wakeup coalescing. A waiting reader is woken once it is wake_batch
+	 * pages behind. With a batch above one, readers sleep at most
+	 * wake_timeout milliseconds, except for poll and epoll users, who must
+	 * bound their own wait. Rarely changed. */
+	unsigned int wake_batch;
+	unsigned int wake_timeout;
+
+	/* Updated by all writers. */
+	kdata_off_t whead KDATA_CACHE_ALIGNED;
 	kdata_off_t wresv;
-	unsigned long long produced;
-};
+
+	/* Updated by the writers for every unit written. */
+	unsigned long long produced KDATA_CACHE_ALIGNED;
+} KDATA_CACHE_ALIGNED;
 
 struct kdata_shared_writer
 {
 	kdata_off_t whead;
 	kdata_off_t wresv;
 	kdata_off_t wbar;
-};
 
+	/* Statistics. Descriptor write backs lost to readers or other writers,
+	 * and wakeups issued. */
+	unsigned long long retries;
+	unsigned long long wakeups;
+} KDATA_CACHE_ALIGNED;
+
+/* Written only by the owning reader, except skips, which writers register. */
 struct kdata_shared_reader
 {
 	kdata_off_t rhead;
 	unsigned long skips;
 	unsigned char entered;
 	unsigned long long consumed;
-};
 
+	/* Highest lag behind the write head seen, in pages. */
+	unsigned long lag_hwm;
+
+	/* Set by the reader before it sleeps. The writer that wakes it clears it,
+	 * so there is one wakeup per sleep. */
+	int waiting;
+} KDATA_CACHE_ALIGNED;
+
+/* Descriptors stay dense. Padding them would cost a cache line per page. */
 struct kdata_shared_desc
 {
 	kdata_desc_t desc;
 };
 
-#define KDATA_CTRL_SZ ( \
-	sizeof(struct kdata_shared_head) + \
-	sizeof(struct kdata_shared_writer) * KDATA_WRITERS + \
-	sizeof(struct kdata_shared_reader) * KDATA_READERS + \
-	sizeof(struct kdata_shared_desc) * KDATA_NPAGES \
-)
-	
-#define KDATA_CTRL_OFF_HEAD   0
-#define KDATA_CTRL_OFF_WRITER KDATA_CTRL_OFF_HEAD + sizeof(struct kdata_shared_head)
-#define KDATA_CTRL_OFF_READER KDATA_CTRL_OFF_WRITER + sizeof(struct kdata_shared_writer) * KDATA_WRITERS
-#define KDATA_CTRL_OFF_DESC   KDATA_CTRL_OFF_READER + sizeof(struct kdata_shared_reader) * KDATA_READERS
+/*
+ * Statistics snapshot of a ring, see kring_stats().
+ */
+
+struct kdata_reader_stats
+{
+	unsigned long long consumed;
+	unsigned long skips;
+	unsigned long lag;
+	unsigned long lag_hwm;
+};
 
-#define KDATA_DATA_SZ KRING_PAGE_SIZE * KDATA_NPAGES
+struct kdata_writer_stats
+{
+	unsigned long long retries;
+	unsigned long long wakeups;
+};
+
+struct kdata_ring_stats
+{
+	unsigned long npages;
+	int nreaders;
+	int nwriters;
+	unsigned long long produced;
+	struct kdata_reader_stats reader[KDATA_MAX_READERS];
+	struct kdata_writer_stats writer[KDATA_MAX_WRITERS_PER_RING];
+};
+
+/*
+ * Control region layout. Computed from the geometry stored in the head, which
+ * is always at offset zero.
+ */
+
+#define KDATA_CTRL_OFF_HEAD 0
+
+static inline unsigned long kdata_ctrl_off_writer( void )
+{
+	return KDATA_CTRL_OFF_HEAD + sizeof(struct kdata_shared_head);
+}
+
+static inline unsigned long kdata_ctrl_off_reader( int nwriters )
+{
+	return kdata_ctrl_off_writer() + sizeof(struct kdata_shared_writer) * nwriters;
+}
+
+static inline unsigned long kdata_ctrl_off_desc( int nreaders, int nwriters )
+{
+	return kdata_ctrl_off_reader( nwriters ) + sizeof(struct kdata_shared_reader) * nreaders;
+}
+
+static inline unsigned long kdata_ctrl_sz( unsigned long npages, int nreaders, int nwriters )
+{
+	return kdata_ctrl_off_desc( nreaders, nwriters ) + sizeof(struct kdata_shared_desc) * npages;
+}
+
+static inline unsigned long kdata_data_sz( unsigned long npages )
+{
+	return KRING_PAGE_SIZE * npages;
+}
 
 struct kdata_control
 {
@@ -111,6 +206,16 @@ struct kdata_control
 	struct kdata_shared_desc *descriptor;
 };
 
+/* Point the control struct into a mapped control region. */
+static inline void kdata_control_map( struct kdata_control *control, void *ctrl, int nreaders, int nwriters )
+{
+	char *base = (char*)ctrl;
+	control->head = (struct kdata_shared_head*)( base + KDATA_CTRL_OFF_HEAD );
+	control->writer = (struct kdata_shared_writer*)( base + kdata_ctrl_off_writer() );
+	control->reader = (struct kdata_shared_reader*)( base + kdata_ctrl_off_reader( nwriters ) );
+	control->descriptor = (struct kdata_shared_desc*)( base + kdata_ctrl_off_desc( nreaders, nwriters ) );
+}
+
 struct kdata_packet
 {
 	char dir;
@@ -157,6 +262,8 @@ int kring_open( struct kring_user *u, enum KRING_TYPE type, const char *ringset,
 int kdata_write_decrypted( struct kring_user *u, long id, int type, const char *remoteHost, char *data, int len );
 int kdata_write_plain( struct kring_user *u, char *data, int len );
 int kdata_read_wait( struct kring_user *u );
+int kring_stats( struct kring_user *u, int ring, struct kdata_ring_stats *stats );
+int kring_set_wake( struct kring_user *u, int batch, int timeout_ms );
 
 static inline int kdata_packet_max_data(void)
 {
@@ -244,26 +351,42 @@ static inline int kdata_avail( struct kring_user *u )
 	}
 }
 
-static inline kdata_off_t kdata_next( kdata_off_t off )
+static inline kdata_off_t kdata_next( struct kdata_control *control, kdata_off_t off )
 {
 	off += 1;
-	if ( off >= KDATA_NPAGES )
+	if ( off >= control->head->npages )
 		off = 0;
 	return off;
 }
 
-static inline kdata_off_t kdata_prev( kdata_off_t off )
+static inline kdata_off_t kdata_prev( struct kdata_control *control, kdata_off_t off )
 {
 	if ( off == 0 )
-		return KDATA_NPAGES - 1;
+		return control->head->npages - 1;
 	return off - 1;
 }
 
+/* Distance of a read head behind the write head, in pages. */
+static inline unsigned long kdata_lag( struct kdata_control *control, kdata_off_t rhead )
+{
+	kdata_off_t whead = control->head->whead;
+	if ( whead >= rhead )
+		return whead - rhead;
+	return control->head->npages - rhead + whead;
+}
+
+static inline void kdata_update_lag_hwm( struct kdata_control *control, int reader_id, kdata_off_t rhead )
+{
+	unsigned long lag = kdata_lag( control, rhead );
+	if ( lag > control->reader[reader_id].lag_hwm )
+		control->reader[reader_id].lag_hwm = lag;
+}
+
 static inline kdata_off_t kdata_advance_rhead( struct kdata_control *control, int reader_id, kdata_off_t rhead )
 {
 	kdata_desc_t desc;
 	while ( 1 ) {
-		rhead = kdata_next( rhead );
+		rhead = kdata_next( control, rhead );
 
 		/* reserve next. */
 		desc = kdata_read_desc( control, rhead );
@@ -309,7 +432,8 @@ again:
 	if ( before != desc )
 		goto again;
 	
-	__sync_add_and_fetch( &control->reader->consumed, 1 );
+	/* Private to the reader, no atomic needed. */
+	control->reader[reader_id].consumed += 1;
 }
 
 static inline int kdata_select_ctrl( struct kring_user *u )
@@ -345,6 +469,8 @@ static inline void *kdata_next_generic( struct kring_user *u )
 	/* Indicate we have entered. */
 	kdata_control(u->control)[ctrl].reader[u->reader_id].entered = 1;
 
+	kdata_update_lag_hwm( &kdata_control(u->control)[ctrl], u->reader_id, rhead );
+
 	return kdata_page_data( u, ctrl, rhead );
 }
 
@@ -387,14 +513,14 @@ static inline void kdata_next_plain( struct kring_user *u, struct kdata_plain *p
 	plain->bytes = (unsigned char*)( h + 1 );
 }
 
-static inline unsigned long kdata_find_write_loc( struct kdata_control *control )
+static inline unsigned long kdata_find_write_loc( struct kdata_control *control, int writer_id )
 {
 	int id;
 	kdata_desc_t desc = 0;
 	kdata_off_t whead = control->head->whead;
 	while ( 1 ) {
 		/* Move to the next slot. */
-		whead = kdata_next( whead );
+		whead = kdata_next( control, whead );
 
 retry:
 		/* Read the descriptor. */
@@ -405,7 +531,7 @@ retry:
 			kdata_desc_t before;
 
 			/* register skips. */
-			for ( id = 0; id < KDATA_READERS; id++ ) {
+			for ( id = 0; id < control->head->nreaders; id++ ) {
 				if ( desc & KDATA_DSC_READER_BIT( id ) ) {
 					/* reader id present. */
 					control->reader[id].skips += 1;
@@ -414,14 +540,17 @@ retry:
 
 			/* Mark as skipped. If a reader got in before us, retry. */
 			before = kdata_write_back( control, whead, desc, desc | KDATA_DSC_SKIPPED );
-			if ( before != desc )
+			if ( before != desc ) {
+				control->writer[writer_id].retries += 1;
 				goto retry;
+			}
 
 			/* After registering the skip, go on to look for another block. */
 		}
 		else if ( desc & KDATA_DSC_WRITER_OWNED ) {
 			/* A different writer has the block. Go forward to find another
 			 * block. */
+			control->writer[writer_id].retries += 1;
 		}
 		else {
 			/* Available. */
@@ -429,8 +558,10 @@ retry:
 
 			/* Okay. Attempt to claim with an atomic write back. */
 			kdata_desc_t before = kdata_write_back( control, whead, desc, newval );
-			if ( before != desc )
+			if ( before != desc ) {
+				control->writer[writer_id].retries += 1;
 				goto retry;
+			}
 
 			/* Write back okay. No reader claimed. We can use. */
 			return whead;
@@ -445,7 +576,7 @@ static inline void *kdata_write_FIRST( struct kring_user *u )
 	kdata_off_t whead;
 
 	/* Find the place to write to, skipping ahead as necessary. */
-	whead = kdata_find_write_loc( kdata_control(u->control) );
+	whead = kdata_find_write_loc( kdata_control(u->control), u->writer_id );
 
 	/* Reserve the space. */
 	kdata_control(u->control)->head->wresv = whead;
@@ -491,7 +622,7 @@ again:
 	 * inactive then it's resv will be left behind and not affect this
 	 * compuation. */
 	highest = 0;
-	for ( w = 0; w < KDATA_WRITERS; w++ ) {
+	for ( w = 0; w < kdata_control(u->control)->head->nwriters; w++ ) {
 		if ( kdata_control(u->control)->writer[w].wresv > highest )
 			highest = kdata_control(u->control)->writer[w].wresv;
 	}
@@ -519,13 +650,13 @@ retry:
 	/* Order of these two matters. Cannot look for the limit first. */
 
 	/* First pass, find the highest write head. */
-	for ( w = 0; w < KDATA_WRITERS; w++ ) {
+	for ( w = 0; w < kdata_control(u->control)->head->nwriters; w++ ) {
 		if ( kdata_control(u->control)->writer[w].whead > whead )
 			whead = kdata_control(u->control)->writer[w].whead;
 	}
 
 	/* Second pass. Find the lowest barrier. */
-	for ( w = 0; w < KDATA_WRITERS; w++ ) {
+	for ( w = 0; w < kdata_control(u->control)->head->nwriters; w++ ) {
 		if ( kdata_control(u->control)->writer[w].wbar != 0 ) {
 			if ( kdata_control(u->control)->writer[w].wbar < wbar )
 				wbar = kdata_control(u->control)->writer[w].wbar;
@@ -542,6 +673,80 @@ retry:
 		goto retry;
 }
 
+/* Initialize a freshly zeroed control region. */
+static inline void kdata_control_init( struct kdata_control *control,
+		unsigned long npages, int nreaders, int nwriters )
+{
+	/* Record the geometry for user space and the inline ring operations. */
+	control->head->version = KDATA_CTRL_VERSION;
+	control->head->npages = npages;
+	control->head->nreaders = nreaders;
+	control->head->nwriters = nwriters;
+	control->head->wake_batch = 1;
+	control->head->wake_timeout = 0;
+
+	control->head->whead = control->head->wresv = kdata_prev( control, 0 );
+}
+
+/*
+ * Wakeup protocol. The reader advertises it is about to sleep, then checks for
+ * data once more before sleeping. The writer publishes, then checks for
+ * waiting readers. The full barriers on both sides guarantee one of them sees
+ * the other.
+ */
+
+static inline void kdata_reader_waiting( struct kdata_control *control, int reader_id, int waiting )
+{
+	control->reader[reader_id].waiting = waiting;
+	__sync_synchronize();
+}
+
+/* Returns non-zero if the writer should issue a wakeup. */
+static inline int kdata_wake_needed( struct kdata_control *control )
+{
+	int id, wake = 0;
+	unsigned int batch;
+
+	__sync_synchronize();
+
+	batch = control->head->wake_batch;
+	for ( id = 0; id < control->head->nreaders; id++ ) {
+		if ( control->reader[id].waiting ) {
+			/* Let it sleep until there is a batch worth reading. */
+			if ( batch > 1 && kdata_lag( control, control->reader[id].rhead ) < batch )
+				continue;
+
+			/* Claim the wakeup. Only one writer issues it. */
+			if ( __sync_bool_compare_and_swap( &control->reader[id].waiting, 1, 0 ) )
+				wake = 1;
+		}
+	}
+
+	return wake;
+}
+
+static inline void kdata_ring_stats( struct kdata_control *control, struct kdata_ring_stats *stats )
+{
+	int id;
+
+	stats->npages = control->head->npages;
+	stats->nreaders = control->head->nreaders;
+	stats->nwriters = control->head->nwriters;
+	stats->produced = control->head->produced;
+
+	for ( id = 0; id < stats->nreaders; id++ ) {
+		stats->reader[id].consumed = control->reader[id].consumed;
+		stats->reader[id].skips = control->reader[id].skips;
+		stats->reader[id].lag = kdata_lag( control, control->reader[id].rhead );
+		stats->reader[id].lag_hwm = control->reader[id].lag_hwm;
+	}
+
+	for ( id = 0; id < stats->nwriters; id++ ) {
+		stats->writer[id].retries = control->writer[id].retries;
+		stats->writer[id].wakeups = control->writer[id].wakeups;
+	}
+}
+
 static inline int kdata_prep_enter( struct kdata_control *control, int reader_id )
 {
 	/* Init the read head. */
@@ -552,6 +757,8 @@ static inline int kdata_prep_enter( struct kdata_control *control, int reader_id
 	control->reader[reader_id].skips = 0;
 	control->reader[reader_id].entered = 0;
 	control->reader[reader_id].consumed = control->head->produced;
+	control->reader[reader_id].lag_hwm = 0;
+	control->reader[reader_id].waiting = 0;
 
 	return 0;
 }
@@ -56,6 +56,7 @@ struct kring_user
 	int nrings;
 	int writer_id;
 	int reader_id;
+	enum KRING_TYPE type;
 	enum KRING_MODE mode;
 
 	/* If reading from multiple rings then this can be an array. */
@@ -68,6 +69,10 @@ struct kring_user
 
 	struct kring_page_desc *pd;
 
+	/* Shared memory backend, user space only. Null when using the kernel
+	 * module. */
+	struct kring_shm_head *shm;
+
 	int krerr;
 	int _errno;
 	char *errstr;
@@ -11,6 +11,8 @@
 #define KRING_ERR_WRITER_ID  -5
 #define KRING_ERR_RING_N     -6
 #define KRING_ERR_ENTER      -7
+#define KRING_ERR_SHM        -8
+#define KRING_ERR_VERSION    -9
 
 struct kring_addr
 {
@@ -21,4 +23,47 @@ struct kring_addr
 
 int kctrl_map_enter( struct kring_user *u, int ring_id, int ctrl );
 
+/*
+ * Shared memory backend. Ringsets whose names begin with '/' are POSIX shared
+ * memory segments instead of kernel ringsets. The segment holds the same
+ * control and data regions the kernel module exports, so the same reader and
+ * writer code runs between threads or processes without kring.ko. Wakeups use
+ * a futex in the segment in place of recv/send on the socket.
+ */
+
+#define KRING_SHM_MAGIC   0x6b727368
+#define KRING_SHM_VERSION 1
+
+struct kring_shm_head
+{
+	unsigned int magic;
+	unsigned int version;
+
+	int type;
+	int nrings;
+	unsigned long npages;
+	int readers;
+	int writers;
+
+	/* Per-ring region sizes, page aligned. */
+	unsigned long ctrl_sz;
+	unsigned long data_sz;
+
+	/* Futex word, advanced on every notify. */
+	int wake_seq;
+
+	/* Allocated reader and writer ids, one bit per id, per ring. */
+	unsigned int reader_alloc[KDATA_MAX_RINGS_PER_SET];
+	unsigned int writer_alloc[KDATA_MAX_RINGS_PER_SET];
+};
+
+#define KRING_SHM_HEAD_SZ \
+	( ( sizeof(struct kring_shm_head) + KRING_PAGE_SIZE - 1 ) & ~( KRING_PAGE_SIZE - 1 ) )
+
+int kring_shm_create( const char *ringset, enum KRING_TYPE type, int nrings,
+		long npages, int readers, int writers );
+int kring_shm_unlink( const char *ringset );
+
+int kring_close( struct kring_user *u );
+
 #endif
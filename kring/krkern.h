@@ -10,6 +10,8 @@
 #include <linux/socket.h>
 #include <linux/skbuff.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <net/sock.h>
 #include <asm/cacheflush.h>
 
@@ -32,8 +34,8 @@ struct kring_ring
 	int num_readers;
 	int num_writers;
 
-	struct kring_ring_reader reader[KDATA_READERS];
-	struct kring_ring_writer writer[KDATA_WRITERS];
+	struct kring_ring_reader reader[KDATA_MAX_READERS];
+	struct kring_ring_writer writer[KDATA_MAX_WRITERS_PER_RING];
 
 	void *ctrl;
 	struct kring_page_desc *pd;
@@ -55,22 +57,22 @@ struct kring_sock
 
 struct kring_params
 {
-	const int npages;
-
-	const int ctrl_sz;
-
-	const int ctrl_off_head;
-	const int ctrl_off_writer;
-	const int ctrl_off_reader;
-	const int ctrl_off_desc;
-
-	const int data_sz;
-
+	/* Geometry used when none is given. */
+	const long npages;
 	const int readers;
 	const int writers;
 
-	void (*init_control)( struct kring_ring *ring );
+	/* Limits on the geometry. */
+	const long min_npages;
+	const long max_npages;
+	const int max_readers;
+	const int max_writers;
+
+	unsigned long (*ctrl_sz)( long npages, int readers, int writers );
+	void (*map_control)( struct kring_control *control, void *ctrl, int readers, int writers );
+	void (*init_control)( struct kring_ringset *r, struct kring_ring *ring );
 	int (*wait)( struct kring_sock *krs );
+	unsigned int (*poll)( struct kring_sock *krs );
 	void (*notify)( struct kring_sock *krs );
 	void (*destruct)( struct kring_sock *krs );
 };
@@ -83,6 +85,14 @@ struct kring_ringset
 	int nrings;
 	struct kring_params *params;
 
+	/* Geometry of every ring in the set. */
+	long npages;
+	int readers;
+	int writers;
+
+	/* Sysfs directory, data ringsets only. */
+	struct ringset *kobj;
+
 	struct kring_ringset *next;
 };
 
@@ -99,12 +109,17 @@ struct kring_kern
 	int ring_id;
 	int writer_id;
 	struct kring_user user;
+
+	/* Command readers, work scheduled when a writer notifies. */
+	wait_queue_t watch;
+	struct work_struct *work;
 };
 
 int kring_kopen( struct kring_kern *kdata, enum KRING_TYPE type, const char *ringset, int ring_id, enum KRING_MODE mode );
 int kring_kclose( struct kring_kern *kdata );
 
 void kdata_kwrite( struct kring_kern *kdata, int dir, const struct sk_buff *skb );
+void kdata_kwrite_snap( struct kring_kern *kdata, int dir, const struct sk_buff *skb, int snaplen );
 int kdata_kavail( struct kring_kern *kdata );
 void kdata_knext_plain( struct kring_kern *kdata, struct kdata_plain *plain );
 
@@ -115,7 +130,9 @@ void kdata_knext_plain( struct kring_kern *kdata, struct kdata_plain *plain );
 #define KCTRL_CONTROL(p) ((struct kctrl_control*) &((p)._control_))
 
 int kctrl_kavail( struct kring_kern *kring );
-void kctrl_knext_plain( struct kring_kern *kring, struct kctrl_plain *plain );
+int kctrl_knext_plain( struct kring_kern *kring, struct kctrl_plain *plain );
+void kctrl_kwatch( struct kring_kern *kring, struct work_struct *work );
+void kctrl_kunwatch( struct kring_kern *kring );
 
 
 struct kring_ringset *kring_find_ring( const char *name );
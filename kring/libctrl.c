@@ -43,6 +43,12 @@ char *kctrl_error( struct kring_user *u, int err )
 		case KRING_ERR_ENTER:
 			prefix = "exception in ring entry";
 			break;
+		case KRING_ERR_SHM:
+			prefix = "shared memory ring open failed";
+			break;
+		case KRING_ERR_VERSION:
+			prefix = "ring control layout version mismatch";
+			break;
 	}
 
 	/* start with the prefix. Always there (see above). */
@@ -90,10 +96,7 @@ int kctrl_map_enter( struct kring_user *u, int ring_id, int ctrl )
 		return -1;
 	}
 
-	u->control->head = r + KCTRL_CTRL_OFF_HEAD;
-	u->control->writer = r + KCTRL_CTRL_OFF_WRITER;
-	u->control->reader = r + KCTRL_CTRL_OFF_READER;
-	u->control->descriptor = r + KCTRL_CTRL_OFF_DESC;
+	kctrl_control_map( kctrl_control( u->control ), r );
 
 	r = mmap( 0, KCTRL_DATA_SZ, PROT_READ | PROT_WRITE,
 			MAP_SHARED, u->socket,
@@ -109,19 +112,6 @@ int kctrl_map_enter( struct kring_user *u, int ring_id, int ctrl )
 	return 0;
 }
 
-void kctrl_lock( int *mutex, unsigned long long *spins )
-{
-	while ( __sync_lock_test_and_set( mutex, 1 ) ) {
-		/* If builtin returns 1 we did not flip it and therefore did not acquire the lock. */
-		__sync_add_and_fetch( spins, 1 );
-	}
-}
-
-void kctrl_unlock( int *mutex )
-{
-	__sync_lock_release( mutex, 0 );
-}
-
 /*
  * NOTE: when open for writing we always are writing to a specific ring id. No
  * need to iterate over control and data or dereference control/data pointers.
@@ -154,7 +144,7 @@ int kctrl_write_decrypted( struct kring_user *u, long id, int type, const char *
 	kctrl_write_SECOND( u );
 
 	/* Wake up here. */
-	send( u->socket, buf, 1, 0 );
+	kring_notify( u );
 
 #endif
 	return 0;
@@ -168,7 +158,6 @@ int kctrl_write_plain( struct kring_user *u, char *data, int len )
 {
 	struct kctrl_plain_header *h;
 	unsigned char *bytes;
-	char buf[1];
 
 	if ( len > kctrl_plain_max_data()  )
 		len = kctrl_plain_max_data();
@@ -178,7 +167,7 @@ int kctrl_write_plain( struct kring_user *u, char *data, int len )
 		if ( h != 0 )
 			break;
 
-		recv( u->socket, buf, 1, 1 );
+		kring_wait( u );
 	}
 
 	h->len = len;
@@ -188,26 +177,52 @@ int kctrl_write_plain( struct kring_user *u, char *data, int len )
 
 	kctrl_write_SECOND( u );
 
+	/* Kernel readers drain commands when woken, they do not poll. */
+	kring_notify( u );
+
 	return 0;
 }   
 
+int kctrl_write_cmd( struct kring_user *u, const struct kctrl_cmd *cmd )
+{
+	struct kctrl_cmd c = *cmd;
+
+	c.version = KCTRL_CMD_VERSION;
+	return kctrl_write_plain( u, (char*)&c, sizeof(c) );
+}
+
+/* Fills in an address from IPv4 or IPv6 text. Returns -1 if it is neither. */
+int kctrl_parse_addr( struct kctrl_addr *addr, const char *ip )
+{
+	memset( addr, 0, sizeof(struct kctrl_addr) );
+
+	if ( inet_pton( AF_INET, ip, &addr->a.ip4 ) == 1 ) {
+		addr->family = KCTRL_ADDR_IP4;
+		return 0;
+	}
+
+	if ( inet_pton( AF_INET6, ip, addr->a.ip6 ) == 1 ) {
+		addr->family = KCTRL_ADDR_IP6;
+		return 0;
+	}
+
+	return -1;
+}
+
 int kctrl_read_wait( struct kring_user *u )
 {
-	char buf[1];
-	int ret = recv( u->socket, buf, 1, 1 ); 
-	if ( ret == -1 && errno == EINTR )
-		ret = 0;
-	return ret;
+	return kring_wait( u );
 }
 
-void kctrl_next_packet( struct kring_user *u, struct kctrl_packet *packet )
+int kctrl_next_packet( struct kring_user *u, struct kctrl_packet *packet )
 {
 	struct kctrl_packet_header *h;
-	char buf[1];
 
 	h = (struct kctrl_packet_header*) kctrl_next_generic( u );
+	if ( h == 0 )
+		return 0;
 
-	send( u->socket, buf, 1, 0 );
+	kring_notify( u );
 
 	packet->len = h->len;
 	packet->caplen = 
@@ -216,35 +231,40 @@ void kctrl_next_packet( struct kring_user *u, struct kctrl_packet *packet )
 			kctrl_packet_max_data();
 	packet->dir = h->dir;
 	packet->bytes = (unsigned char*)( h + 1 );
+	return 1;
 }
 
-void kctrl_next_decrypted( struct kring_user *u, struct kctrl_decrypted *decrypted )
+int kctrl_next_decrypted( struct kring_user *u, struct kctrl_decrypted *decrypted )
 {
 	struct kctrl_decrypted_header *h;
-	char buf[1];
 
 	h = (struct kctrl_decrypted_header*) kctrl_next_generic( u );
+	if ( h == 0 )
+		return 0;
 
-	send( u->socket, buf, 1, 0 );
+	kring_notify( u );
 
 	decrypted->len = h->len;
 	decrypted->id = h->id;
 	decrypted->type = h->type;
 	decrypted->host = h->host;
 	decrypted->bytes = (unsigned char*)( h + 1 );
+	return 1;
 }
 
-void kctrl_next_plain( struct kring_user *u, struct kctrl_plain *plain )
+int kctrl_next_plain( struct kring_user *u, struct kctrl_plain *plain )
 {
 	struct kctrl_plain_header *h;
-	char buf[1];
 
 	h = (struct kctrl_plain_header*) kctrl_next_generic( u );
+	if ( h == 0 )
+		return 0;
 
-	send( u->socket, buf, 1, 0 );
+	kring_notify( u );
 
 	plain->len = h->len;
 	plain->bytes = (unsigned char*)( h + 1 );
+	return 1;
 }
 
 
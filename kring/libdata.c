@@ -41,6 +41,12 @@ char *kdata_error( struct kring_user *u, int err )
 		case KRING_ERR_ENTER:
 			prefix = "exception in ring entry";
 			break;
+		case KRING_ERR_SHM:
+			prefix = "shared memory ring open failed";
+			break;
+		case KRING_ERR_VERSION:
+			prefix = "ring control layout version mismatch";
+			break;
 	}
 
 	/* start with the prefix. Always there (see above). */
@@ -79,8 +85,13 @@ static int kdata_map_enter( struct kring_user *u, int ring_id, int ctrl )
 {
 	int res;
 	void *r;
+	struct kdata_shared_head *head;
+	unsigned long npages;
+	int nreaders, nwriters;
 
-	r = mmap( 0, KDATA_CTRL_SZ, PROT_READ | PROT_WRITE,
+	/* Map just the head first to retrieve the ring geometry, which determines
+	 * the size of the regions. */
+	r = mmap( 0, KRING_PAGE_SIZE, PROT_READ,
 			MAP_SHARED, u->socket,
 			cons_pgoff( ring_id, KRING_PGOFF_CTRL ) );
 
@@ -89,12 +100,31 @@ static int kdata_map_enter( struct kring_user *u, int ring_id, int ctrl )
 		return -1;
 	}
 
-	u->control[ctrl].head = r + KDATA_CTRL_OFF_HEAD;
-	u->control[ctrl].writer = r + KDATA_CTRL_OFF_WRITER;
-	u->control[ctrl].reader = r + KDATA_CTRL_OFF_READER;
-	u->control[ctrl].descriptor = r + KDATA_CTRL_OFF_DESC;
+	head = (struct kdata_shared_head*)r;
+	if ( head->version != KDATA_CTRL_VERSION ) {
+		munmap( r, KRING_PAGE_SIZE );
+		kdata_func_error( KRING_ERR_VERSION, 0 );
+		return -1;
+	}
+
+	npages = head->npages;
+	nreaders = head->nreaders;
+	nwriters = head->nwriters;
 
-	r = mmap( 0, KDATA_DATA_SZ, PROT_READ | PROT_WRITE,
+	munmap( r, KRING_PAGE_SIZE );
+
+	r = mmap( 0, kdata_ctrl_sz( npages, nreaders, nwriters ), PROT_READ | PROT_WRITE,
+			MAP_SHARED, u->socket,
+			cons_pgoff( ring_id, KRING_PGOFF_CTRL ) );
+
+	if ( r == MAP_FAILED ) {
+		kdata_func_error( KRING_ERR_MMAP, errno );
+		return -1;
+	}
+
+	kdata_control_map( &kdata_control(u->control)[ctrl], r, nreaders, nwriters );
+
+	r = mmap( 0, kdata_data_sz( npages ), PROT_READ | PROT_WRITE,
 			MAP_SHARED, u->socket,
 			cons_pgoff( ring_id, KRING_PGOFF_DATA ) );
 
@@ -123,6 +153,10 @@ int kring_open( struct kring_user *u, enum KRING_TYPE type, const char *ringset,
 	socklen_t idlen = sizeof(reader_id);
 	struct kring_addr addr;
 
+	/* Shared memory ringsets are named like POSIX shm objects. */
+	if ( ringset[0] == '/' )
+		return kring_shm_open( u, type, ringset, proto, ring_id, mode );
+
 	memset( u, 0, sizeof(struct kring_user) );
 
 	u->socket = socket( KDATA, SOCK_RAW, htons(ETH_P_ALL) );
@@ -132,6 +166,7 @@ int kring_open( struct kring_user *u, enum KRING_TYPE type, const char *ringset,
 	}
 
 	u->ring_id = ring_id;
+	u->type = type;
 	u->mode = mode;
 
 	kring_copy_name( addr.name, ringset );
@@ -223,7 +258,6 @@ int kdata_write_decrypted( struct kring_user *u, long id, int type, const char *
 {
 	struct kdata_decrypted_header *h;
 	unsigned char *bytes;
-	char buf[1];
 
 	if ( len > kdata_decrypted_max_data()  )
 		len = kdata_decrypted_max_data();
@@ -245,8 +279,12 @@ int kdata_write_decrypted( struct kring_user *u, long id, int type, const char *
 
 	kdata_write_SECOND( u );
 
-	/* Wake up here. */
-	send( u->socket, buf, 1, 0 );
+	/* Count it as the kernel writer does, readers seed from this. */
+	__sync_add_and_fetch( &kdata_control(u->control)->head->produced, 1 );
+
+	/* Wake up here, if anyone is waiting. */
+	if ( kdata_wake_needed( kdata_control(u->control) ) )
+		kring_notify( u );
 
 	return 0;
 }   
@@ -259,7 +297,6 @@ int kdata_write_plain( struct kring_user *u, char *data, int len )
 {
 	struct kdata_plain_header *h;
 	unsigned char *bytes;
-	char buf[1];
 
 	if ( len > kdata_plain_max_data()  )
 		len = kdata_plain_max_data();
@@ -273,17 +310,47 @@ int kdata_write_plain( struct kring_user *u, char *data, int len )
 
 	kdata_write_SECOND( u );
 
-	/* Wake up here. */
-	send( u->socket, buf, 1, 0 );
+	/* Count it as the kernel writer does, readers seed from this. */
+	__sync_add_and_fetch( &kdata_control(u->control)->head->produced, 1 );
+
+	/* Wake up here, if anyone is waiting. */
+	if ( kdata_wake_needed( kdata_control(u->control) ) )
+		kring_notify( u );
 
 	return 0;
 }   
 
 int kdata_read_wait( struct kring_user *u )
 {
-	char buf[1];
-	int ret = recv( u->socket, buf, 1, 1 ); 
-	if ( ret == -1 && errno == EINTR )
-		ret = 0;
-	return ret;
+	return kring_wait( u );
+}
+
+/* Set the wakeup coalescing parameters on every ring of the ringset that is
+ * mapped. For kernel ringsets the wake sysfs attribute is the usual way. */
+int kring_set_wake( struct kring_user *u, int batch, int timeout_ms )
+{
+	int ring, nmapped = u->ring_id == KDATA_RING_ID_ALL ? u->nrings : 1;
+
+	if ( u->type != KRING_DATA || batch < 1 || timeout_ms < 0 || ( batch > 1 && timeout_ms == 0 ) )
+		return -1;
+
+	for ( ring = 0; ring < nmapped; ring++ ) {
+		kdata_control(u->control)[ring].head->wake_batch = batch;
+		kdata_control(u->control)[ring].head->wake_timeout = timeout_ms;
+	}
+
+	return 0;
+}
+
+/* Ring is an index into the rings this user has mapped. When opened on all
+ * rings it is the ring id, otherwise it must be zero. */
+int kring_stats( struct kring_user *u, int ring, struct kdata_ring_stats *stats )
+{
+	int nmapped = u->ring_id == KDATA_RING_ID_ALL ? u->nrings : 1;
+
+	if ( u->type != KRING_DATA || ring < 0 || ring >= nmapped )
+		return -1;
+
+	kdata_ring_stats( &kdata_control(u->control)[ring], stats );
+	return 0;
 }
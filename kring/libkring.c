@@ -1,5 +1,10 @@
 #include "kring.h"
+#include "libkring.h"
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
 #include <string.h>
 
 void kring_copy_name( char *dest, const char *src )
@@ -8,3 +13,39 @@ void kring_copy_name( char *dest, const char *src )
 	dest[KRING_NLEN-1] = 0;
 }
 
+int kring_wait( struct kring_user *u )
+{
+	char buf[1];
+	int ret;
+
+	if ( u->shm != 0 )
+		return kring_shm_wait( u );
+
+	ret = recv( u->socket, buf, 1, 1 ); 
+	if ( ret == -1 && errno == EINTR )
+		ret = 0;
+	return ret;
+}
+
+void kring_notify( struct kring_user *u )
+{
+	char buf[1] = { 0 };
+
+	if ( u->type == KRING_DATA && u->mode == KRING_WRITE )
+		kdata_control(u->control)->writer[u->writer_id].wakeups += 1;
+
+	if ( u->shm != 0 )
+		kring_shm_notify( u );
+	else
+		send( u->socket, buf, 1, 0 );
+}
+
+/* With the kernel backend the module releases ids when the socket goes away.
+ * The ring mappings stay until the process exits. */
+int kring_close( struct kring_user *u )
+{
+	if ( u->shm != 0 )
+		return kring_shm_close( u );
+
+	return close( u->socket );
+}
@@ -3,4 +3,14 @@
 
 void kring_copy_name( char *dest, const char *src );
 
+/* Wakeups, dispatched to the socket or the shared memory futex. */
+int kring_wait( struct kring_user *u );
+void kring_notify( struct kring_user *u );
+
+int kring_shm_open( struct kring_user *u, enum KRING_TYPE type, const char *ringset,
+		enum KRING_PROTO proto, int ring_id, enum KRING_MODE mode );
+int kring_shm_close( struct kring_user *u );
+int kring_shm_wait( struct kring_user *u );
+void kring_shm_notify( struct kring_user *u );
+
 #endif
@@ -0,0 +1,466 @@
+#include "kring.h"
+#include "libkring.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Shared memory ringsets. The segment is a head page followed by the control
+ * and data regions of each ring, laid out exactly as the kernel module maps
+ * them. Id allocation, which the kernel does at bind time, is done with
+ * atomic bitmaps in the head.
+ */
+
+static unsigned long kring_shm_align( unsigned long sz )
+{
+	return ( sz + KRING_PAGE_SIZE - 1 ) & ~( (unsigned long) KRING_PAGE_SIZE - 1 );
+}
+
+static unsigned long kring_shm_size( struct kring_shm_head *shm )
+{
+	return KRING_SHM_HEAD_SZ + shm->nrings * ( shm->ctrl_sz + shm->data_sz );
+}
+
+static char *kring_shm_ring( struct kring_shm_head *shm, int ring_id )
+{
+	return (char*)shm + KRING_SHM_HEAD_SZ + ring_id * ( shm->ctrl_sz + shm->data_sz );
+}
+
+static int futex( int *uaddr, int op, int val, const struct timespec *timeout )
+{
+	return syscall( SYS_futex, uaddr, op, val, timeout, 0, 0 );
+}
+
+static int kring_shm_validate_name( const char *ringset )
+{
+	if ( ringset[0] != '/' || strlen( ringset ) >= KRING_NLEN || strchr( ringset + 1, '/' ) != 0 )
+		return -1;
+	return 0;
+}
+
+int kring_shm_create( const char *ringset, enum KRING_TYPE type, int nrings,
+		long npages, int readers, int writers )
+{
+	struct kring_shm_head head, *shm;
+	int fd, i;
+
+	if ( kring_shm_validate_name( ringset ) < 0 )
+		goto err_inval;
+
+	memset( &head, 0, sizeof(head) );
+
+	if ( type == KRING_DATA ) {
+		/* Zero selects the default, as with the kernel's add_data. */
+		if ( npages == 0 )
+			npages = KDATA_NPAGES;
+		if ( readers == 0 )
+			readers = KDATA_READERS;
+		if ( writers == 0 )
+			writers = KDATA_WRITERS;
+
+		if ( nrings < 1 || nrings > KDATA_MAX_RINGS_PER_SET )
+			goto err_inval;
+		if ( npages < KDATA_MIN_NPAGES || npages > KDATA_MAX_NPAGES )
+			goto err_inval;
+		if ( readers < 1 || readers > KDATA_MAX_READERS )
+			goto err_inval;
+		if ( writers < 1 || writers > KDATA_MAX_WRITERS_PER_RING )
+			goto err_inval;
+		if ( npages < readers + writers + 2 )
+			goto err_inval;
+
+		head.ctrl_sz = kring_shm_align( kdata_ctrl_sz( npages, readers, writers ) );
+	}
+	else if ( type == KRING_CTRL ) {
+		/* Command rings have a fixed geometry. */
+		nrings = 1;
+		npages = KCTRL_NPAGES;
+		readers = KCTRL_READERS;
+		writers = KCTRL_WRITERS;
+
+		head.ctrl_sz = kring_shm_align( KCTRL_CTRL_SZ );
+	}
+	else {
+		goto err_inval;
+	}
+
+	head.version = KRING_SHM_VERSION;
+	head.type = type;
+	head.nrings = nrings;
+	head.npages = npages;
+	head.readers = readers;
+	head.writers = writers;
+	head.data_sz = KRING_PAGE_SIZE * npages;
+
+	fd = shm_open( ringset, O_RDWR | O_CREAT | O_EXCL, 0600 );
+	if ( fd < 0 )
+		return -1;
+
+	/* Extending gives us zeroed memory. */
+	if ( ftruncate( fd, kring_shm_size( &head ) ) < 0 )
+		goto err_unlink;
+
+	shm = (struct kring_shm_head*) mmap( 0, kring_shm_size( &head ),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if ( shm == MAP_FAILED )
+		goto err_unlink;
+
+	close( fd );
+
+	memcpy( shm, &head, sizeof(head) );
+
+	for ( i = 0; i < nrings; i++ ) {
+		if ( type == KRING_DATA ) {
+			struct kdata_control control;
+			kdata_control_map( &control, kring_shm_ring( shm, i ), readers, writers );
+			kdata_control_init( &control, npages, readers, writers );
+		}
+		else {
+			struct kctrl_control control;
+			kctrl_control_map( &control, kring_shm_ring( shm, i ) );
+			kctrl_control_init( &control );
+		}
+	}
+
+	/* Openers check the magic, so it goes in last. */
+	__sync_synchronize();
+	shm->magic = KRING_SHM_MAGIC;
+
+	munmap( shm, kring_shm_size( &head ) );
+	return 0;
+
+err_unlink:
+	close( fd );
+	shm_unlink( ringset );
+	return -1;
+err_inval:
+	errno = EINVAL;
+	return -1;
+}
+
+int kring_shm_unlink( const char *ringset )
+{
+	return shm_unlink( ringset );
+}
+
+static int kring_shm_alloc_id( unsigned int *alloc, int max )
+{
+	int id;
+
+again:
+	for ( id = 0; id < max; id++ ) {
+		if ( !( *alloc & ( 1u << id ) ) )
+			break;
+	}
+
+	if ( id == max )
+		return -1;
+
+	/* Lost a race for the id? */
+	if ( __sync_fetch_and_or( alloc, 1u << id ) & ( 1u << id ) )
+		goto again;
+
+	return id;
+}
+
+static int kring_shm_alloc_reader_all( struct kring_shm_head *shm )
+{
+	int id, i;
+	unsigned int bit;
+
+again:
+	/* Search for a single reader id that is free across all the rings. */
+	for ( id = 0; id < shm->readers; id++ ) {
+		bit = 1u << id;
+		for ( i = 0; i < shm->nrings; i++ ) {
+			if ( shm->reader_alloc[i] & bit )
+				goto next_id;
+		}
+
+		/* Claim it on every ring, backing out if we lose a race. */
+		for ( i = 0; i < shm->nrings; i++ ) {
+			if ( __sync_fetch_and_or( &shm->reader_alloc[i], bit ) & bit ) {
+				while ( --i >= 0 )
+					__sync_fetch_and_and( &shm->reader_alloc[i], ~bit );
+				goto again;
+			}
+		}
+
+		return id;
+
+		next_id: {}
+	}
+
+	return -1;
+}
+
+static void kring_shm_release_ids( struct kring_user *u )
+{
+	struct kring_shm_head *shm = u->shm;
+	int i;
+
+	if ( u->writer_id >= 0 )
+		__sync_fetch_and_and( &shm->writer_alloc[u->ring_id], ~( 1u << u->writer_id ) );
+
+	if ( u->reader_id >= 0 ) {
+		if ( u->ring_id != KRING_RING_ID_ALL )
+			__sync_fetch_and_and( &shm->reader_alloc[u->ring_id], ~( 1u << u->reader_id ) );
+		else {
+			for ( i = 0; i < shm->nrings; i++ )
+				__sync_fetch_and_and( &shm->reader_alloc[i], ~( 1u << u->reader_id ) );
+		}
+	}
+}
+
+int kring_shm_open( struct kring_user *u, enum KRING_TYPE type, const char *ringset,
+		enum KRING_PROTO proto, int ring_id, enum KRING_MODE mode )
+{
+	struct kring_shm_head *shm;
+	struct stat st;
+	int ctrl, to_alloc, res;
+	void *r;
+
+	memset( u, 0, sizeof(struct kring_user) );
+	u->reader_id = -1;
+	u->writer_id = -1;
+
+	/* The descriptor stays open. It is non-negative, which selects the mapped
+	 * data pages in the inline ring operations. */
+	u->socket = shm_open( ringset, O_RDWR, 0 );
+	if ( u->socket < 0 ) {
+		kdata_func_error( KRING_ERR_SHM, errno );
+		goto err_return;
+	}
+
+	if ( fstat( u->socket, &st ) < 0 || st.st_size < (off_t)KRING_SHM_HEAD_SZ ) {
+		kdata_func_error( KRING_ERR_SHM, EINVAL );
+		goto err_close;
+	}
+
+	r = mmap( 0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, u->socket, 0 );
+	if ( r == MAP_FAILED ) {
+		kdata_func_error( KRING_ERR_MMAP, errno );
+		goto err_close;
+	}
+
+	shm = (struct kring_shm_head*)r;
+	if ( shm->magic != KRING_SHM_MAGIC || shm->version != KRING_SHM_VERSION ||
+			shm->type != type || (unsigned long)st.st_size < kring_shm_size( shm ) )
+	{
+		kdata_func_error( KRING_ERR_SHM, EINVAL );
+		goto err_unmap;
+	}
+
+	if ( type == KRING_DATA && ( (struct kdata_shared_head*)kring_shm_ring( shm, 0 ) )->version != KDATA_CTRL_VERSION ) {
+		kdata_func_error( KRING_ERR_VERSION, 0 );
+		goto err_unmap;
+	}
+
+	/* Same checks the kernel makes at bind time. */
+	if ( ring_id != KRING_RING_ID_ALL && ( ring_id < 0 || ring_id >= shm->nrings ) ) {
+		kdata_func_error( KRING_ERR_BIND, EINVAL );
+		goto err_unmap;
+	}
+
+	if ( ( mode == KRING_WRITE || type == KRING_CTRL ) && ring_id == KRING_RING_ID_ALL ) {
+		kdata_func_error( KRING_ERR_BIND, EINVAL );
+		goto err_unmap;
+	}
+
+	u->shm = shm;
+	u->ring_id = ring_id;
+	u->type = type;
+	u->mode = mode;
+	u->nrings = shm->nrings;
+
+	if ( mode == KRING_WRITE ) {
+		u->writer_id = kring_shm_alloc_id( &shm->writer_alloc[ring_id], shm->writers );
+		if ( u->writer_id < 0 ) {
+			kdata_func_error( KRING_ERR_WRITER_ID, EBUSY );
+			goto err_unmap;
+		}
+	}
+	else {
+		if ( ring_id != KRING_RING_ID_ALL )
+			u->reader_id = kring_shm_alloc_id( &shm->reader_alloc[ring_id], shm->readers );
+		else
+			u->reader_id = kring_shm_alloc_reader_all( shm );
+
+		if ( u->reader_id < 0 ) {
+			kdata_func_error( KRING_ERR_READER_ID, EBUSY );
+			goto err_unmap;
+		}
+	}
+
+	to_alloc = 1;
+	if ( ring_id == KRING_RING_ID_ALL )
+		to_alloc = shm->nrings;
+
+	u->control = (struct kring_control*)malloc( sizeof( struct kdata_control ) * to_alloc );
+	memset( u->control, 0, sizeof( struct kdata_control ) * to_alloc );
+
+	u->data = (struct kring_data*)malloc( sizeof( struct kring_data ) * to_alloc );
+	memset( u->data, 0, sizeof( struct kring_data ) * to_alloc );
+
+	u->pd = 0;
+
+	for ( ctrl = 0; ctrl < to_alloc; ctrl++ ) {
+		char *ring = kring_shm_ring( shm, ring_id == KRING_RING_ID_ALL ? ctrl : ring_id );
+
+		if ( type == KRING_DATA )
+			kdata_control_map( &kdata_control(u->control)[ctrl], ring, shm->readers, shm->writers );
+		else
+			kctrl_control_map( &kctrl_control(u->control)[ctrl], ring );
+
+		u->data[ctrl].page = (struct kring_page*)( ring + shm->ctrl_sz );
+
+		if ( type == KRING_DATA && mode == KRING_READ ) {
+			res = kdata_prep_enter( &kdata_control(u->control)[ctrl], u->reader_id );
+			if ( res < 0 ) {
+				kdata_func_error( KRING_ERR_ENTER, 0 );
+				goto err_release;
+			}
+		}
+	}
+
+	return 0;
+
+err_release:
+	kring_shm_release_ids( u );
+	free( u->control );
+	free( u->data );
+	u->shm = 0;
+err_unmap:
+	munmap( r, st.st_size );
+err_close:
+	close( u->socket );
+err_return:
+	return u->krerr;
+}
+
+int kring_shm_close( struct kring_user *u )
+{
+	struct kring_shm_head *shm = u->shm;
+	int ctrl, to_alloc;
+
+	/* Give back any page a reader still holds, as the kernel does when the
+	 * socket is destroyed. */
+	if ( shm->type == KRING_DATA && u->mode == KRING_READ ) {
+		to_alloc = u->ring_id == KRING_RING_ID_ALL ? u->nrings : 1;
+		for ( ctrl = 0; ctrl < to_alloc; ctrl++ ) {
+			struct kdata_control *control = &kdata_control(u->control)[ctrl];
+			if ( control->reader[u->reader_id].entered ) {
+				kdata_off_t prev = control->reader[u->reader_id].rhead;
+				kdata_reader_release( u->reader_id, control, prev );
+			}
+		}
+	}
+	else if ( shm->type == KRING_CTRL && u->mode == KRING_READ ) {
+		kctrl_reader_release( kctrl_control(u->control), u->reader_id );
+		kring_shm_notify( u );
+	}
+
+	kring_shm_release_ids( u );
+
+	free( u->control );
+	free( u->data );
+	u->control = 0;
+	u->data = 0;
+
+	munmap( shm, kring_shm_size( shm ) );
+	u->shm = 0;
+
+	return close( u->socket );
+}
+
+/* Mirrors the conditions the kernel wait functions sleep on. */
+static int kring_shm_ready( struct kring_user *u )
+{
+	if ( u->shm->type == KRING_DATA ) {
+		if ( u->mode == KRING_WRITE )
+			return 1;
+		return kdata_avail( u );
+	}
+
+	/* Command rings: readers wait for commands, writers for free buffers. */
+	if ( u->mode == KRING_READ )
+		return kctrl_avail( u );
+
+	return kctrl_free_avail( kctrl_control(u->control) );
+}
+
+static void kring_shm_waiting( struct kring_user *u, int waiting )
+{
+	int ctrl, nmapped = u->ring_id == KRING_RING_ID_ALL ? u->nrings : 1;
+
+	for ( ctrl = 0; ctrl < nmapped; ctrl++ )
+		kdata_reader_waiting( &kdata_control(u->control)[ctrl], u->reader_id, waiting );
+}
+
+int kring_shm_wait( struct kring_user *u )
+{
+	sigset_t set, oldset;
+	struct timespec ts, *timeout = 0;
+	int seq, ret, reader = u->shm->type == KRING_DATA && u->mode == KRING_READ;
+
+	/* Data writers only wake readers that advertise they are waiting. */
+	if ( reader ) {
+		struct kdata_shared_head *head = kdata_control(u->control)->head;
+
+		kring_shm_waiting( u, 1 );
+
+		/* Writers hold off until a batch is ready, so bound the sleep. */
+		if ( head->wake_batch > 1 ) {
+			ts.tv_sec = head->wake_timeout / 1000;
+			ts.tv_nsec = ( head->wake_timeout % 1000 ) * 1000000;
+			timeout = &ts;
+		}
+	}
+
+	/* Sample the sequence before testing, so a notify between the test and
+	 * the futex call makes the wait return immediately. */
+	seq = u->shm->wake_seq;
+	__sync_synchronize();
+
+	if ( kring_shm_ready( u ) ) {
+		if ( reader )
+			kring_shm_waiting( u, 0 );
+		return 0;
+	}
+
+	/* Allow the user sigs while we sleep, as the kernel's recvmsg does, so
+	 * genf inter-thread messages interrupt the wait. */
+	sigemptyset( &set );
+	sigaddset( &set, SIGUSR1 );
+	sigaddset( &set, SIGUSR2 );
+	pthread_sigmask( SIG_UNBLOCK, &set, &oldset );
+
+	ret = futex( &u->shm->wake_seq, FUTEX_WAIT, seq, timeout );
+
+	pthread_sigmask( SIG_SETMASK, &oldset, 0 );
+
+	if ( reader )
+		kring_shm_waiting( u, 0 );
+
+	if ( ret < 0 && ( errno == EINTR || errno == EAGAIN || errno == ETIMEDOUT ) )
+		ret = 0;
+
+	return ret;
+}
+
+void kring_shm_notify( struct kring_user *u )
+{
+	__sync_add_and_fetch( &u->shm->wake_seq, 1 );
+	futex( &u->shm->wake_seq, FUTEX_WAKE, INT_MAX, 0 );
+}
@@ -2,11 +2,22 @@
 #define _KRING_MODULE_H
 
 int kring_init( void );
-int kring_exit( void );
+void kring_exit( void );
 
 struct kring
 {
 	struct kobject kobj;
 };
 
+struct kring_ringset;
+
+/* Per-ringset directory. */
+struct ringset
+{
+	struct kobject kobj;
+	struct kring_ringset *ringset;
+};
+
+extern struct kring *root_obj;
+
 #endif
@@ -93,8 +93,16 @@ int kring_ioctl( struct socket *sock, unsigned int cmd, unsigned long arg )
 
 unsigned int kring_poll( struct file *file, struct socket *sock, poll_table *wait )
 {
-	printk( "kring_poll\n" );
-	return 0;
+	struct kring_sock *krs = kring_sk( sock->sk );
+	struct kring_ringset *r = krs->ringset;
+
+	/* Ensure bound. */
+	if ( r == 0 )
+		return POLLERR;
+
+	poll_wait( file, &r->waitqueue, wait );
+
+	return (*r->params->poll)( krs );
 }
 
 int kring_setsockopt( struct socket *sock, int level, int optname, char __user * optval, unsigned int optlen )
@@ -159,8 +167,8 @@ int kring_sock_mmap( struct file *file, struct socket *sock, struct vm_area_stru
 	
 	decon_pgoff( vma->vm_pgoff, &ring_id, &region );
 
-	if ( ring_id > r->nrings ) {
-		printk( "kdata mmap: error: rid > r->nrings\n" );
+	if ( ring_id >= r->nrings ) {
+		printk( "kdata mmap: error: rid >= r->nrings\n" );
 		return -EINVAL;
 	}
 
@@ -172,10 +180,16 @@ int kring_sock_mmap( struct file *file, struct socket *sock, struct vm_area_stru
 		}
 
 		case KRING_PGOFF_DATA: {
-			int i;
+			long i;
 			unsigned long uaddr = vma->vm_start;
+
+			if ( vma->vm_end - vma->vm_start > r->npages * PAGE_SIZE ) {
+				printk( "kdata mmap: error: mapping exceeds ring size\n" );
+				return -EINVAL;
+			}
+
 			printk( "mapping data region %lu of ring %p-%lu\n", uaddr, r, ring_id );
-			for ( i = 0; i < r->params->npages; i++ ) {
+			for ( i = 0; i < r->npages && uaddr < vma->vm_end; i++ ) {
 				vm_insert_page( vma, uaddr, r->ring[ring_id].pd[i].p );
 				uaddr += PAGE_SIZE;
 			}
@@ -235,12 +249,12 @@ int kring_allocate_writer_on_ring( struct kring_ringset *ringset, struct kring_r
 again:
 
 	/* Search for a writer id that is free on the ring requested. */
-	for ( writer_id = 0; writer_id < ringset->params->writers; writer_id++ ) {
+	for ( writer_id = 0; writer_id < ringset->writers; writer_id++ ) {
 		if ( !ring->writer[writer_id].allocated )
 			break;
 	}
 
-	if ( writer_id == ringset->params->writers ) {
+	if ( writer_id == ringset->writers ) {
 		/* No valid id found */
 		return -EINVAL;
 	}
@@ -263,12 +277,12 @@ int kring_allocate_reader_on_ring( struct kring_ringset *ringset, struct kring_r
 again:
 
 	/* Search for a reader id that is free on the ring requested. */
-	for ( reader_id = 0; reader_id < ringset->params->readers; reader_id++ ) {
+	for ( reader_id = 0; reader_id < ringset->readers; reader_id++ ) {
 		if ( !ring->reader[reader_id].allocated )
 			break;
 	}
 
-	if ( reader_id == ringset->params->readers ) {
+	if ( reader_id == ringset->readers ) {
 		/* No valid id found */
 		return -EINVAL;
 	}
@@ -288,7 +302,7 @@ int kring_allocate_reader_all_rings( struct kring_ringset *ringset )
 	int i, reader_id;
 
 	/* Search for a single reader id that is free across all the rings requested. */
-	for ( reader_id = 0; reader_id < ringset->params->readers; reader_id++ ) {
+	for ( reader_id = 0; reader_id < ringset->readers; reader_id++ ) {
 		for ( i = 0; i < ringset->nrings; i++ ) {
 			if ( ringset->ring[i].reader[reader_id].allocated )
 				goto next_id;
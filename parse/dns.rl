@@ -112,7 +112,8 @@ enum RR
 				break;
 			else {
 				unsigned int off = s - packet_start;
-				names[n++] = off;
+				if ( n < 32 )
+					names[n++] = off;
 				s += 1 + sl;
 			}
 
@@ -290,6 +291,15 @@ enum RR
 					(uint)addr[12] << ':' << (uint)addr[13] << ':' << (uint)addr[14] << ':' << (uint)addr[15] << std::dec );
 
 			ctx->vpt.push( Node::DnsRrAAAA );
+
+			ctx->vpt.push( Node::DnsName );
+			ctx->vpt.setText( namebuf1 );
+			ctx->vpt.pop( Node::DnsName );
+
+			ctx->vpt.push( Node::DnsAddr );
+			ctx->vpt.setData( addr, 16 );
+			ctx->vpt.pop( Node::DnsAddr );
+
 			ctx->vpt.pop( Node::DnsRrAAAA );
 
 			fbreak;
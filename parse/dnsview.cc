@@ -0,0 +1,148 @@
+#include "parse.h"
+
+#include <string.h>
+
+/* Compression pointers followed before a name is considered looping. */
+#define DNS_MAX_HOPS 16
+
+static inline uint16_t rd16( const unsigned char *p )
+{
+	return ( (uint16_t)p[0] << 8 ) | p[1];
+}
+
+static inline uint32_t rd32( const unsigned char *p )
+{
+	return ( (uint32_t)p[0] << 24 ) | ( (uint32_t)p[1] << 16 ) |
+			( (uint32_t)p[2] << 8 ) | p[3];
+}
+
+/* Returns the first byte after the name, or null if it runs off the end. */
+const unsigned char *DnsView::skipName( const unsigned char *p ) const
+{
+	while ( p < end ) {
+		if ( *p == 0 )
+			return p + 1;
+		else if ( ( *p & 0xc0 ) == 0xc0 )
+			return p + 2 <= end ? p + 2 : 0;
+		else if ( *p > 63 )
+			return 0;
+
+		p += 1 + *p;
+	}
+	return 0;
+}
+
+bool DnsView::decode( const unsigned char *data, int length )
+{
+	start = data;
+	end = data + length;
+	nrec = 0;
+	truncated = false;
+	scratchLen = 0;
+
+	if ( length < 12 )
+		return false;
+
+	id = rd16( data );
+	flags = rd16( data + 2 );
+	for ( int s = 0; s < 4; s++ )
+		count[s] = rd16( data + 4 + s * 2 );
+
+	const unsigned char *p = data + 12;
+	for ( int s = 0; s < 4; s++ ) {
+		for ( int i = 0; i < count[s]; i++ ) {
+			const unsigned char *owner = p;
+
+			p = skipName( p );
+			if ( p == 0 )
+				return false;
+
+			DnsRecord r;
+			r.section = s;
+			r.nameOff = owner - start;
+
+			if ( s == 0 ) {
+				/* Question: type and class only. */
+				if ( p + 4 > end )
+					return false;
+
+				r.type = rd16( p );
+				r.klass = rd16( p + 2 );
+				r.ttl = 0;
+				r.rdata = 0;
+				r.rdlen = 0;
+				p += 4;
+			}
+			else {
+				if ( p + 10 > end )
+					return false;
+
+				r.type = rd16( p );
+				r.klass = rd16( p + 2 );
+				r.ttl = rd32( p + 4 );
+				r.rdlen = rd16( p + 8 );
+				r.rdata = p + 10;
+				p += 10 + r.rdlen;
+
+				if ( p > end )
+					return false;
+			}
+
+			if ( nrec < maxRecords )
+				rec[nrec++] = r;
+			else
+				truncated = true;
+		}
+	}
+
+	return true;
+}
+
+const char *DnsView::name( int off, int *len )
+{
+	char *out = scratch + scratchLen;
+	int avail = scratchSize - scratchLen;
+	int dlen = 0, hops = 0;
+	const unsigned char *p = start + off;
+
+	while ( true ) {
+		if ( p >= end )
+			return 0;
+
+		if ( *p == 0 )
+			break;
+		else if ( ( *p & 0xc0 ) == 0xc0 ) {
+			if ( p + 2 > end )
+				return 0;
+
+			/* Pointers must go backwards, which rules out loops. The hop
+			 * limit bounds the work. */
+			int target = ( ( p[0] & 0x3f ) << 8 ) | p[1];
+			if ( target >= p - start || ++hops > DNS_MAX_HOPS )
+				return 0;
+
+			p = start + target;
+		}
+		else if ( *p > 63 )
+			return 0;
+		else {
+			int pl = *p;
+			if ( p + 1 + pl > end || dlen + pl + 2 > avail )
+				return 0;
+
+			if ( dlen > 0 )
+				out[dlen++] = '.';
+			memcpy( out + dlen, p + 1, pl );
+			dlen += pl;
+			p += 1 + pl;
+		}
+	}
+
+	if ( dlen + 1 > avail )
+		return 0;
+
+	out[dlen] = 0;
+	scratchLen += dlen + 1;
+	*len = dlen;
+	return out;
+}
@@ -9,6 +9,7 @@
 #include <iostream>
 
 struct Conn;
+struct IpAddr;
 
 struct FmtEthProto
 {
@@ -38,6 +39,14 @@ struct FmtIpAddrHost
 	uint32_t addr;
 };
 
+/* Either family, as held in the connection keys. */
+struct FmtIpAddr
+{
+	FmtIpAddr( const IpAddr &addr )
+		: addr(addr) {}
+	const IpAddr &addr;
+};
+
 struct FmtIpPortNet
 {
 	FmtIpPortNet( uint16_t port )
@@ -64,6 +73,7 @@ std::ostream &operator<<( std::ostream &out, const FmtEthProto &fmt );
 std::ostream &operator<<( std::ostream &out, const FmtIpProtocol &fmt );
 std::ostream &operator<<( std::ostream &out, const FmtIpAddrNet &fmt );
 std::ostream &operator<<( std::ostream &out, const FmtIpAddrHost &fmt );
+std::ostream &operator<<( std::ostream &out, const FmtIpAddr &fmt );
 std::ostream &operator<<( std::ostream &out, const FmtIpPortNet &fmt );
 std::ostream &operator<<( std::ostream &out, const FmtIpPortHost &fmt );
 std::ostream &operator<<( std::ostream &out, const FmtConnection &fmt );
@@ -2,21 +2,36 @@
 #include "fmt.h"
 #include "packet.h"
 #include "itq_gen.h"
+#include "pattern.h"
 
 #include <linux/if_ether.h>
 #include <linux/ip.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
+#include <netinet/ip6.h>
 #include <arpa/inet.h>
 
+#define VLAN_TAG_LEN 4
+
+/* Bound on IPv6 extension headers walked before giving up on a packet. */
+#define IP6_EXT_MAX 8
+
 Handler::Handler( NetpConfigure *netpConfigure )
 :
 	netpConfigure(netpConfigure),
 	pcap(0),
 	datalink(0),
 	continuation(false),
-	udpCtx( netpConfigure )
+	snapLimited(false),
+	udpCtx( netpConfigure ),
+	dnsPatterns(false)
 {
+	/* Patterns are registered by the context constructor. */
+	for ( int i = 0; i < udpCtx.vpt.patRoots.length(); i++ ) {
+		Node::Type type = udpCtx.vpt.patRoots[i]->type;
+		if ( type >= Node::DnsPacket && type <= Node::DnsAddr )
+			dnsPatterns = true;
+	}
 }
 
 void Handler::handler( Packet::Dir dir, const struct pcap_pkthdr *h, const u_char *bytes )
@@ -30,6 +45,7 @@ void Handler::handler( Packet::Dir dir, const struct pcap_pkthdr *h, const u_cha
 		packet->data = (u_char*)bytes;
 		packet->dlen = h->len;
 		packet->caplen = h->caplen;
+		packet->truncated = false;
 
 		flowEstabState( packet );
 	}
@@ -44,59 +60,152 @@ void Handler::handler( Packet::Dir dir, const struct pcap_pkthdr *h, const u_cha
 
 		log_debug( DBG_ETH, "eh proto: " << FmtEthProto( packet->eh->h_proto ) );
 
-		if ( packet->eh->h_proto == htons( ETH_P_IP ) ) {
-
-			if ( dir != Packet::UnknownDir )
-				packet->dir = dir;
-			else {
-				bool sprot = srcProtected( packet );
-				bool dprot = dstProtected( packet );
-
-				if ( sprot && !dprot )
-					packet->dir = Packet::Egress;
-				else if ( !sprot && dprot )
-					packet->dir = Packet::Ingress;
-				else {
-					/* Drop anything not strictly egress or ingress. */
-					return;
-				}
-			}
-
-			/* IP header and header length. */
-			packet->ih = (struct iphdr*)(bytes + sizeof(struct ethhdr));
-			const int ihlen = packet->ih->ihl * 4;
-
-			log_debug( DBG_IP, "ip protocol: " << FmtIpProtocol( packet->ih->protocol ) << " " <<
-					FmtIpAddrNet(packet->ih->saddr) << " -> " << FmtIpAddrNet(packet->ih->daddr) );
-
-			if ( packet->ih->protocol == IPPROTO_TCP ) {
-				/* TCP header and header length. */
-				packet->tcp.th = (struct tcphdr*)( (u_char*)packet->ih + ihlen );
-				const int thlen = packet->tcp.th->doff * 4;
-
-				/* TCP data and data length. */
-				packet->data = (u_char*)packet->tcp.th + thlen;
-				packet->dlen = ntohs(packet->ih->tot_len) - thlen - ihlen;
-				packet->caplen = h->caplen - thlen - ihlen - sizeof(struct ethhdr);
-
-				tcp( packet );
-			}
-			else if ( packet->ih->protocol == IPPROTO_UDP ) {
-				/* TCP header and header length. */
-				packet->uh = (struct udphdr*)( (u_char*)packet->ih + ihlen );
-				const int uhlen = sizeof( struct udphdr );
-
-				/* TCP data and data length. */
-				packet->data = (u_char*)packet->uh + uhlen;
-				packet->dlen = ntohs(packet->ih->tot_len) - uhlen - ihlen;
-				packet->caplen = h->caplen - uhlen - ihlen - sizeof(struct ethhdr);
-
-				udpCtx.vpt.packet = packet;
-				udp( packet );
-				udpCtx.vpt.packet = 0;;
-			}
+		/* Step over 802.1Q and 802.1ad (QinQ) tags. */
+		uint16_t proto = packet->eh->h_proto;
+		int l2len = sizeof(struct ethhdr);
+		for ( int tags = 0; tags < 2 && ( proto == htons( ETH_P_8021Q ) ||
+				proto == htons( ETH_P_8021AD ) ); tags++ )
+		{
+			if ( (int)h->caplen < l2len + VLAN_TAG_LEN )
+				return;
+
+			proto = *(const uint16_t*)( bytes + l2len + 2 );
+			l2len += VLAN_TAG_LEN;
 		}
+
+		/* Given by the capture, or worked out from the addresses. */
+		packet->dir = dir;
+
+		if ( proto == htons( ETH_P_IP ) )
+			ip4( packet, h, l2len );
+		else if ( proto == htons( ETH_P_IPV6 ) )
+			ip6( packet, h, l2len );
 	}
 }
 
+/* Sets the packet direction from which ends are protected. False for
+ * anything not strictly egress or ingress, which is dropped. */
+bool Handler::classify( Packet *packet, bool sprot, bool dprot )
+{
+	if ( sprot && !dprot )
+		packet->dir = Packet::Egress;
+	else if ( !sprot && dprot )
+		packet->dir = Packet::Ingress;
+	else
+		return false;
+
+	return true;
+}
 
+bool Handler::ip4( Packet *packet, const struct pcap_pkthdr *h, int l2len )
+{
+	/* IP header and header length. */
+	packet->ih = (struct iphdr*)(packet->bytes + l2len);
+	packet->i6h = 0;
+	const int ihlen = packet->ih->ihl * 4;
+
+	if ( packet->dir == Packet::UnknownDir && !classify( packet,
+			protectedNets.lookup4( packet->ih->saddr ),
+			protectedNets.lookup4( packet->ih->daddr ) ) )
+		return false;
+
+	packet->saddr.setV4( packet->ih->saddr );
+	packet->daddr.setV4( packet->ih->daddr );
+
+	log_debug( DBG_IP, "ip protocol: " << FmtIpProtocol( packet->ih->protocol ) << " " <<
+			FmtIpAddrNet(packet->ih->saddr) << " -> " << FmtIpAddrNet(packet->ih->daddr) );
+
+	transport( packet, h, packet->ih->protocol, (u_char*)packet->ih + ihlen,
+			ntohs(packet->ih->tot_len) - ihlen );
+	return true;
+}
+
+bool Handler::ip6( Packet *packet, const struct pcap_pkthdr *h, int l2len )
+{
+	const u_char *end = packet->bytes + h->caplen;
+
+	packet->ih = 0;
+	packet->i6h = (struct ip6_hdr*)(packet->bytes + l2len);
+	if ( (const u_char*)( packet->i6h + 1 ) > end )
+		return false;
+
+	if ( packet->dir == Packet::UnknownDir && !classify( packet,
+			protectedNets.lookup6( packet->i6h->ip6_src.s6_addr ),
+			protectedNets.lookup6( packet->i6h->ip6_dst.s6_addr ) ) )
+		return false;
+
+	packet->saddr.setV6( packet->i6h->ip6_src.s6_addr );
+	packet->daddr.setV6( packet->i6h->ip6_dst.s6_addr );
+
+	/* Walk extension headers to the transport header. */
+	int proto = packet->i6h->ip6_nxt;
+	u_char *l4 = (u_char*)( packet->i6h + 1 );
+	int l4len = ntohs( packet->i6h->ip6_plen );
+
+	for ( int ext = 0; ext < IP6_EXT_MAX; ext++ ) {
+		if ( proto != IPPROTO_HOPOPTS && proto != IPPROTO_ROUTING &&
+				proto != IPPROTO_DSTOPTS && proto != IPPROTO_FRAGMENT )
+			break;
+
+		if ( l4 + sizeof(struct ip6_ext) > end )
+			return false;
+
+		struct ip6_ext *e = (struct ip6_ext*)l4;
+		int elen = ( e->ip6e_len + 1 ) * 8;
+
+		if ( proto == IPPROTO_FRAGMENT ) {
+			/* Later fragments have no transport header. */
+			struct ip6_frag *f = (struct ip6_frag*)l4;
+			if ( l4 + sizeof(struct ip6_frag) > end ||
+					( f->ip6f_offlg & IP6F_OFF_MASK ) != 0 )
+				return false;
+			elen = sizeof(struct ip6_frag);
+		}
+
+		proto = e->ip6e_nxt;
+		l4 += elen;
+		l4len -= elen;
+	}
+
+	log_debug( DBG_IP, "ip6 next header: " << FmtIpProtocol( proto ) << " " <<
+			FmtIpAddr(packet->saddr) << " -> " << FmtIpAddr(packet->daddr) );
+
+	transport( packet, h, proto, l4, l4len );
+	return true;
+}
+
+/* L4len is the transport header and data according to the IP header. */
+void Handler::transport( Packet *packet, const struct pcap_pkthdr *h, int proto,
+		u_char *l4, int l4len )
+{
+	const int hdrlen = l4 - packet->bytes;
+
+	if ( proto == IPPROTO_TCP ) {
+		/* TCP header and header length. */
+		packet->tcp.th = (struct tcphdr*)l4;
+		const int thlen = packet->tcp.th->doff * 4;
+
+		/* TCP data and data length. */
+		packet->data = l4 + thlen;
+		packet->dlen = l4len - thlen;
+		packet->caplen = h->caplen - thlen - hdrlen;
+		packet->truncated = ( snapLimited || h->len == h->caplen ) &&
+				packet->caplen < packet->dlen;
+
+		tcp( packet );
+	}
+	else if ( proto == IPPROTO_UDP ) {
+		/* UDP header and header length. */
+		packet->uh = (struct udphdr*)l4;
+		const int uhlen = sizeof( struct udphdr );
+
+		/* UDP data and data length. */
+		packet->data = l4 + uhlen;
+		packet->dlen = l4len - uhlen;
+		packet->caplen = h->caplen - uhlen - hdrlen;
+
+		udpCtx.vpt.packet = packet;
+		udp( packet );
+		udpCtx.vpt.packet = 0;;
+	}
+}
@@ -0,0 +1,119 @@
+#include "parse.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+LookupSet::LookupSet()
+:
+	entries(0),
+	nentries(0),
+	allocEntries(0),
+	slots(0),
+	nslots(0),
+	arena(0),
+	arenaLen(0),
+	arenaAlloc(0)
+{
+	rehash( 64 );
+}
+
+LookupSet::~LookupSet()
+{
+	free( entries );
+	free( slots );
+	free( arena );
+}
+
+/* FNV-1a. */
+uint32_t LookupSet::hash( const char *name, int len )
+{
+	uint32_t h = 2166136261u;
+	for ( int i = 0; i < len; i++ ) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void LookupSet::rehash( long size )
+{
+	free( slots );
+	slots = (long*) malloc( sizeof(long) * size );
+	nslots = size;
+
+	for ( long i = 0; i < nslots; i++ )
+		slots[i] = -1;
+
+	for ( long id = 0; id < nentries; id++ ) {
+		long s = entries[id].hash & ( nslots - 1 );
+		while ( slots[s] >= 0 )
+			s = ( s + 1 ) & ( nslots - 1 );
+		slots[s] = id;
+	}
+}
+
+long LookupSet::find( const char *name, int len ) const
+{
+	uint32_t h = hash( name, len );
+	long s = h & ( nslots - 1 );
+
+	while ( slots[s] >= 0 ) {
+		const Entry *e = &entries[slots[s]];
+		if ( e->hash == h && e->len == len &&
+				memcmp( arena + e->off, name, len ) == 0 )
+			return slots[s];
+		s = ( s + 1 ) & ( nslots - 1 );
+	}
+
+	return -1;
+}
+
+long LookupSet::add( const char *name, int len, long root )
+{
+	long id = find( name, len );
+	if ( id >= 0 )
+		return id;
+
+	/* Keep the table at most half full. */
+	if ( ( nentries + 1 ) * 2 > nslots )
+		rehash( nslots * 2 );
+
+	if ( nentries == allocEntries ) {
+		allocEntries = allocEntries == 0 ? 64 : allocEntries * 2;
+		entries = (Entry*) realloc( entries, sizeof(Entry) * allocEntries );
+	}
+
+	if ( arenaLen + len + 1 > arenaAlloc ) {
+		while ( arenaLen + len + 1 > arenaAlloc )
+			arenaAlloc = arenaAlloc == 0 ? 4096 : arenaAlloc * 2;
+		arena = (char*) realloc( arena, arenaAlloc );
+	}
+
+	id = nentries++;
+	Entry *e = &entries[id];
+	e->hash = hash( name, len );
+	e->off = arenaLen;
+	e->len = len;
+	e->root = root < 0 ? id : root;
+
+	memcpy( arena + arenaLen, name, len );
+	arena[arenaLen + len] = 0;
+	arenaLen += len + 1;
+
+	long s = e->hash & ( nslots - 1 );
+	while ( slots[s] >= 0 )
+		s = ( s + 1 ) & ( nslots - 1 );
+	slots[s] = id;
+
+	return id;
+}
+
+long LookupSet::insert( const char *name )
+{
+	return add( name, strlen( name ), -1 );
+}
+
+long LookupSet::alias( const char *name, int len, long target )
+{
+	return add( name, len, entries[target].root );
+}
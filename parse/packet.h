@@ -2,11 +2,62 @@
 #define _PACKET_H
 
 #include <pcap.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
 
 struct Half;
 struct Conn;
 struct Handler;
 
+/*
+ * IPv4 or IPv6 address, network byte order. IPv4 is held v4-mapped
+ * (::ffff:a.b.c.d) so the address always sits in the last word. Compare looks
+ * at that word first, which is enough to tell most IPv4 keys apart.
+ */
+struct IpAddr
+{
+	union {
+		uint8_t b[16];
+		uint32_t w[4];
+	};
+
+	void setV4( uint32_t addr )
+	{
+		w[0] = 0;
+		w[1] = 0;
+		w[2] = htonl( 0xffff );
+		w[3] = addr;
+	}
+
+	void setV6( const uint8_t *addr )
+	{
+		memcpy( b, addr, 16 );
+	}
+
+	bool isV4() const
+	{
+		return w[0] == 0 && w[1] == 0 && w[2] == htonl( 0xffff );
+	}
+};
+
+inline int cmpIpAddr( const IpAddr &a1, const IpAddr &a2 )
+{
+	if ( a1.w[3] != a2.w[3] )
+		return a1.w[3] < a2.w[3] ? -1 : 1;
+	for ( int i = 0; i < 3; i++ ) {
+		if ( a1.w[i] != a2.w[i] )
+			return a1.w[i] < a2.w[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+struct CmpIpAddr
+{
+	static int compare( const IpAddr &a1, const IpAddr &a2 )
+		{ return cmpIpAddr( a1, a2 ); }
+};
+
 struct PackTcp
 {
 	struct tcphdr *th;
@@ -22,7 +73,13 @@ struct Packet
 	const u_char *bytes;
 
 	struct ethhdr *eh;
+
+	/* One of these is set, the other is zero. */
 	struct iphdr *ih;
+	struct ip6_hdr *i6h;
+
+	/* Addresses from whichever IP header is present. */
+	IpAddr saddr, daddr;
 
 	/* Packet is either ingress or egress, all other packets are dropped.
 	 * Therefore Unknown is not used for the packet. Connections, however, can
@@ -38,6 +95,10 @@ struct Packet
 	u_char *data;
 	int dlen;
 	int caplen;
+
+	/* Capture cut the frame short (snap length). The rest is not coming in a
+	 * continuation. */
+	bool truncated;
 };
 
 inline Packet::Dir reverse( Packet::Dir dir )
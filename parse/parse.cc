@@ -39,6 +39,17 @@ std::ostream &operator<<( std::ostream &out, const FmtIpAddrHost &fmt )
 	return out;
 }
 
+std::ostream &operator<<( std::ostream &out, const FmtIpAddr &fmt )
+{
+	char buf[INET6_ADDRSTRLEN];
+	if ( fmt.addr.isV4() )
+		inet_ntop( AF_INET, &fmt.addr.w[3], buf, sizeof(buf) );
+	else
+		inet_ntop( AF_INET6, fmt.addr.b, buf, sizeof(buf) );
+	out << buf;
+	return out;
+}
+
 std::ostream &operator<<( std::ostream &out, const FmtIpPortNet &fmt )
 {
 	out << std::dec << (uint32_t) ntohs(fmt.port);
@@ -55,8 +66,8 @@ std::ostream &operator<<( std::ostream &out, const FmtIpPortHost &fmt )
 std::ostream &operator<<( std::ostream &out, const FmtConnection &fmt )
 {
 	out <<
-		FmtIpAddrHost(fmt.connection->h1.addr1) << ':' << FmtIpPortHost(fmt.connection->h1.port1) << " -> " <<
-		FmtIpAddrHost(fmt.connection->h1.addr2) << ':' << FmtIpPortHost(fmt.connection->h1.port2);
+		FmtIpAddr(fmt.connection->h1.addr1) << ':' << FmtIpPortHost(fmt.connection->h1.port1) << " -> " <<
+		FmtIpAddr(fmt.connection->h1.addr2) << ':' << FmtIpPortHost(fmt.connection->h1.port2);
 
 	return out;
 }
@@ -24,6 +24,7 @@
 #include <genf/thread.h>
 
 #include "packet.h"
+#include "prefix.h"
 #include "json.h"
 
 struct Conn;
@@ -32,6 +33,7 @@ struct Half;
 struct Consumer;
 struct VPT;
 struct Context;
+struct DnsView;
 
 typedef unsigned char wire_t;
 
@@ -238,6 +240,10 @@ struct NetpConfigure
 
 	virtual void configureContext( Context *ctx ) = 0;
 
+	/* Every decoded DNS message. Runs whether or not DNS patterns are
+	 * registered. */
+	virtual void dnsMessage( Packet *packet, DnsView *view ) {}
+
 	ItWriter *passthruWriter;
 
 	/* Debugging only: stash connection data and if there is an error in
@@ -379,7 +385,7 @@ struct Half
 	};
 
 	Half( NetpConfigure *netpConfigure, Conn *connection,
-			uint32_t addr1, uint32_t addr2, uint16_t port1, uint16_t port2 )
+			const IpAddr &addr1, const IpAddr &addr2, uint16_t port1, uint16_t port2 )
 	:
 		ctx( netpConfigure ),
 		connection(connection),
@@ -392,7 +398,7 @@ struct Half
 
 	void swapDir()
 	{
-		uint32_t tAddr = addr1;
+		IpAddr tAddr = addr1;
 		uint16_t tPort = port1;
 		
 		addr1 = addr2;
@@ -406,7 +412,7 @@ struct Half
 
 	Conn *connection;
 
-	uint32_t addr1, addr2;
+	IpAddr addr1, addr2;
 	uint16_t port1, port2;
 
 	State state;
@@ -422,7 +428,7 @@ struct Half
 struct Conn 
 {
 	Conn( NetpConfigure *netpConfigure,
-			uint32_t addr1, uint32_t addr2, uint16_t port1, uint16_t port2 )
+			const IpAddr &addr1, const IpAddr &addr2, uint16_t port1, uint16_t port2 )
 	:
 		h1( netpConfigure, this, addr1, addr2, port1, port2 ),
 		h2( netpConfigure, this, addr2, addr1, port2, port1 ),
@@ -478,13 +484,16 @@ struct CmpHalf
 {
 	static int compare( const Half *h1, const Half *h2 )
 	{
-		if ( h1->addr1 < h2->addr1 )
+		/* The low words hold the whole IPv4 address, so for IPv4 this
+		 * decides as early as the 32 bit compare did. The rest of the
+		 * IPv6 address is only looked at when everything else matches. */
+		if ( h1->addr1.w[3] < h2->addr1.w[3] )
 			return -1;
-		else if ( h1->addr1 > h2->addr1 )
+		else if ( h1->addr1.w[3] > h2->addr1.w[3] )
 			return 1;
-		else if ( h1->addr2 < h2->addr2 )
+		else if ( h1->addr2.w[3] < h2->addr2.w[3] )
 			return -1;
-		else if ( h1->addr2 > h2->addr2 )
+		else if ( h1->addr2.w[3] > h2->addr2.w[3] )
 			return 1;
 		else if ( h1->port1 < h2->port1 )
 			return -1;
@@ -494,7 +503,11 @@ struct CmpHalf
 			return -1;
 		else if ( h1->port2 > h2->port2 )
 			return 1;
-		return 0;
+
+		int r = memcmp( h1->addr1.w, h2->addr1.w, 12 );
+		if ( r != 0 )
+			return r;
+		return memcmp( h1->addr2.w, h2->addr2.w, 12 );
 	}
 };
 
@@ -585,15 +598,67 @@ typedef AvlSetEl< Half* > HalfDictEl;
 typedef AvlMap< long, Decrypted* > DecrDict;
 typedef AvlMapEl< long, Decrypted* > DecrDictEl;
 
+/*
+ * Host names whose answers are redirected to the proxy, interned to ids.
+ * Open addressing on a hash of the name, with the names stored once in an
+ * arena. Lookups do not allocate. A CNAME of a target is added as an alias
+ * whose root is the configured name it came from.
+ */
 struct LookupSet
-:
-	public AvlSet<const char *, CmpStr>
 {
+	LookupSet();
+	~LookupSet();
+
+	/* Adds a configured name, which is copied. Returns its id. */
+	long insert( const char *name );
+
+	/* Adds name as an alias of the entry with id target. */
+	long alias( const char *name, int len, long target );
+
+	/* Id of the name, or -1. */
+	long find( const char *name, int len ) const;
+	long find( const char *name ) const
+		{ return find( name, strlen( name ) ); }
+
+	const char *name( long id ) const
+		{ return arena + entries[id].off; }
+
+	/* The configured name an alias chain started from. */
+	const char *rootName( long id ) const
+		{ return name( entries[id].root ); }
+
+	long length() const
+		{ return nentries; }
+
+private:
+	struct Entry
+	{
+		uint32_t hash;
+		long off;
+		int len;
+		long root;
+	};
+
+	Entry *entries;
+	long nentries;
+	long allocEntries;
+
+	/* Entry ids, -1 for empty. Size is a power of two. */
+	long *slots;
+	long nslots;
+
+	char *arena;
+	long arenaLen;
+	long arenaAlloc;
+
+	static uint32_t hash( const char *name, int len );
+	long add( const char *name, int len, long root );
+	void rehash( long size );
 };
 
 struct IpSet
 :
-	public AvlSet<uint32_t>
+	public AvlSet<IpAddr, CmpIpAddr>
 {
 };
 
@@ -942,6 +1007,62 @@ struct DnsParser
 	int data( Context *ctx, Packet *packet, const wire_t *data, int length );
 };
 
+/* One question or resource record. The owner name is an offset into the
+ * packet, still compressed. */
+struct DnsRecord
+{
+	uint8_t section;
+	uint16_t type;
+	uint16_t klass;
+	uint32_t ttl;
+	uint16_t nameOff;
+
+	/* Zero for questions. */
+	const unsigned char *rdata;
+	uint16_t rdlen;
+};
+
+/*
+ * Flat view of a DNS message. Decoding walks the header and records and fills
+ * a fixed array, without building nodes or allocating. Names are expanded on
+ * demand into a scratch buffer that is reset with each packet.
+ */
+struct DnsView
+{
+	static const int maxRecords = 64;
+	static const int scratchSize = 4096;
+
+	enum { TypeA = 1, TypeCname = 5, TypeAAAA = 28 };
+
+	bool decode( const unsigned char *data, int length );
+
+	/* Dotted name at off, from the scratch buffer. Null if it is malformed or
+	 * the scratch is full. */
+	const char *name( int off, int *len );
+
+	int offset( const unsigned char *ptr ) const
+		{ return ptr - start; }
+
+	uint16_t id;
+	uint16_t flags;
+	uint16_t count[4];
+
+	DnsRecord rec[maxRecords];
+	int nrec;
+
+	/* More records than maxRecords. The rest are not in rec. */
+	bool truncated;
+
+private:
+	const unsigned char *start;
+	const unsigned char *end;
+
+	char scratch[scratchSize];
+	int scratchLen;
+
+	const unsigned char *skipName( const unsigned char *p ) const;
+};
+
 struct Handler
 {
 	Handler( NetpConfigure *netpConfigure );
@@ -951,20 +1072,34 @@ struct Handler
 	pcap_t *pcap;
 	int datalink;
 
-	bpf_program srcProtectedBpf;
-	bpf_program dstProtectedBpf;
+	/* Networks on the protected side. A packet's direction comes from which
+	 * of its addresses fall inside. */
+	PrefixSet protectedNets;
 
 	HalfDict halfDict;
 	DecrDict decrDict;
 
 	bool continuation;
 	Packet contPacket;
+
+	/* Frames are cut at a snap length, the rest never arrives. Only kring
+	 * records carry the rest of a frame in the next record. */
+	bool snapLimited;
 	Packet decrPacket;
 
 	Context udpCtx;
 
-	bool srcProtected( Packet *packet );
-	bool dstProtected( Packet *packet );
+	/* Reused for every DNS packet. The parser builds the node tree, which
+	 * only happens if a DNS pattern is registered on udpCtx. */
+	DnsView dnsView;
+	DnsParser dnsParser;
+	bool dnsPatterns;
+
+	bool classify( Packet *packet, bool sprot, bool dprot );
+	bool ip4( Packet *packet, const struct pcap_pkthdr *h, int l2len );
+	bool ip6( Packet *packet, const struct pcap_pkthdr *h, int l2len );
+	void transport( Packet *packet, const struct pcap_pkthdr *h, int proto,
+			u_char *l4, int l4len );
 
 	void payload( Packet *packet );
 	void flow( Packet *packet );
@@ -0,0 +1,175 @@
+#include "prefix.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#define PREFIX_ROOT 65536
+
+PrefixSet::PrefixSet()
+:
+	count(0)
+{
+	memset( &t4, 0, sizeof(t4) );
+	memset( &t6, 0, sizeof(t6) );
+}
+
+PrefixSet::~PrefixSet()
+{
+	clear();
+}
+
+void PrefixSet::freeTable( Table *t )
+{
+	free( t->root );
+	free( t->tbl8 );
+	memset( t, 0, sizeof(Table) );
+}
+
+void PrefixSet::clear()
+{
+	freeTable( &t4 );
+	freeTable( &t6 );
+	count = 0;
+}
+
+/* Returns the new table's index. May move tbl8. */
+long PrefixSet::newChild( Table *t, uint32_t fill )
+{
+	if ( t->ntbl8 == t->alloc ) {
+		t->alloc = t->alloc == 0 ? 16 : t->alloc * 2;
+		t->tbl8 = (uint32_t*) realloc( t->tbl8, sizeof(uint32_t) * 256 * t->alloc );
+	}
+
+	long child = t->ntbl8++;
+	for ( int i = 0; i < 256; i++ )
+		t->tbl8[child * 256 + i] = fill;
+	return child;
+}
+
+void PrefixSet::insert( Table *t, const uint8_t *addr, int plen )
+{
+	if ( t->root == 0 )
+		t->root = (uint32_t*) calloc( PREFIX_ROOT, sizeof(uint32_t) );
+
+	/* Whole range covered at the root. A shorter prefix replaces any child
+	 * table below it, which is left unused. */
+	uint32_t idx = ( addr[0] << 8 ) | addr[1];
+	if ( plen <= 16 ) {
+		uint32_t span = 1 << ( 16 - plen );
+		uint32_t start = idx & ~( span - 1 );
+		for ( uint32_t i = 0; i < span; i++ )
+			t->root[start + i] = Hit;
+		return;
+	}
+
+	/* Offsets rather than pointers, newChild can move tbl8. */
+	bool atRoot = true;
+	long off = idx;
+	int depth = 16;
+
+	for ( int b = 2; ; b++ ) {
+		uint32_t e = atRoot ? t->root[off] : t->tbl8[off];
+		if ( e == Hit )
+			return;
+
+		if ( e == Miss ) {
+			long child = newChild( t, Miss );
+			e = Child + child;
+			if ( atRoot )
+				t->root[off] = e;
+			else
+				t->tbl8[off] = e;
+		}
+
+		long base = ( e - Child ) * 256;
+		if ( plen <= depth + 8 ) {
+			uint32_t span = 1 << ( depth + 8 - plen );
+			uint32_t start = addr[b] & ~( span - 1 );
+			for ( uint32_t i = 0; i < span; i++ )
+				t->tbl8[base + start + i] = Hit;
+			return;
+		}
+
+		atRoot = false;
+		off = base + addr[b];
+		depth += 8;
+	}
+}
+
+bool PrefixSet::parse( const char *net, uint8_t *addr, int *plen, bool *v6 )
+{
+	char buf[64];
+	const char *slash = strchr( net, '/' );
+	size_t len = slash != 0 ? (size_t)( slash - net ) : strlen( net );
+
+	if ( len >= sizeof(buf) )
+		return false;
+
+	memcpy( buf, net, len );
+	buf[len] = 0;
+
+	memset( addr, 0, 16 );
+	if ( inet_pton( AF_INET, buf, addr ) == 1 )
+		*v6 = false;
+	else if ( inet_pton( AF_INET6, buf, addr ) == 1 )
+		*v6 = true;
+	else
+		return false;
+
+	int max = *v6 ? 128 : 32;
+	*plen = max;
+	if ( slash != 0 ) {
+		char *end;
+		long l = strtol( slash + 1, &end, 10 );
+		if ( *end != 0 || end == slash + 1 || l < 0 || l > max )
+			return false;
+		*plen = l;
+	}
+
+	return true;
+}
+
+bool PrefixSet::load( const char *list )
+{
+	PrefixSet next;
+	const char *p = list;
+
+	while ( *p != 0 ) {
+		while ( *p == ',' || isspace( *p ) )
+			p++;
+
+		const char *start = p;
+		while ( *p != 0 && *p != ',' && !isspace( *p ) )
+			p++;
+
+		if ( p == start )
+			break;
+
+		char net[64];
+		if ( (size_t)( p - start ) >= sizeof(net) )
+			return false;
+		memcpy( net, start, p - start );
+		net[p - start] = 0;
+
+		uint8_t addr[16];
+		int plen;
+		bool v6;
+		if ( !parse( net, addr, &plen, &v6 ) )
+			return false;
+
+		insert( v6 ? &next.t6 : &next.t4, addr, plen );
+		next.count += 1;
+	}
+
+	/* Take the new tables. */
+	clear();
+	t4 = next.t4;
+	t6 = next.t6;
+	count = next.count;
+	memset( &next.t4, 0, sizeof(Table) );
+	memset( &next.t6, 0, sizeof(Table) );
+
+	return true;
+}
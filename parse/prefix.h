@@ -0,0 +1,76 @@
+#ifndef _PREFIX_H
+#define _PREFIX_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+
+/*
+ * A set of IPv4 and IPv6 networks, answering whether an address falls in
+ * any of them. Multibit trie with 16 bits at the root and 8 bits per level
+ * below, with covering prefixes pushed down into child tables. An IPv4
+ * prefix of /16 or shorter resolves with a single array read, longer ones
+ * with at most three.
+ */
+struct PrefixSet
+{
+	PrefixSet();
+	~PrefixSet();
+
+	/* Replaces the set with a comma or whitespace separated list of
+	 * networks. On a parse error returns false and leaves the set as it
+	 * was. */
+	bool load( const char *list );
+
+	void clear();
+
+	/* Network byte order. */
+	bool lookup4( uint32_t addr ) const
+	{
+		if ( t4.root == 0 )
+			return false;
+
+		uint32_t h = ntohl( addr );
+		uint32_t e = t4.root[h >> 16];
+		if ( e >= Child ) {
+			e = t4.tbl8[( e - Child ) * 256 + ( ( h >> 8 ) & 0xff )];
+			if ( e >= Child )
+				e = t4.tbl8[( e - Child ) * 256 + ( h & 0xff )];
+		}
+		return e == Hit;
+	}
+
+	bool lookup6( const uint8_t *addr ) const
+	{
+		if ( t6.root == 0 )
+			return false;
+
+		uint32_t e = t6.root[( addr[0] << 8 ) | addr[1]];
+		for ( int b = 2; e >= Child && b < 16; b++ )
+			e = t6.tbl8[( e - Child ) * 256 + addr[b]];
+		return e == Hit;
+	}
+
+	/* Number of networks loaded. */
+	int count;
+
+private:
+	/* Entries are Miss, Hit, or Child plus the index of a 256 entry table. */
+	enum { Miss = 0, Hit = 1, Child = 2 };
+
+	struct Table
+	{
+		uint32_t *root;
+		uint32_t *tbl8;
+		long ntbl8;
+		long alloc;
+	};
+
+	Table t4, t6;
+
+	static void freeTable( Table *t );
+	static long newChild( Table *t, uint32_t fill );
+	static void insert( Table *t, const uint8_t *addr, int plen );
+	static bool parse( const char *net, uint8_t *addr, int *plen, bool *v6 );
+};
+
+#endif
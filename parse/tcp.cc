@@ -5,20 +5,6 @@
 #include <linux/tcp.h>
 #include <ctype.h>
 
-bool Handler::srcProtected( Packet *packet )
-{
-	int filterRes = pcap_offline_filter( &srcProtectedBpf,
-			packet->ph, packet->bytes );
-	return filterRes != 0;
-}
-
-bool Handler::dstProtected( Packet *packet )
-{
-	int filterRes = pcap_offline_filter( &dstProtectedBpf,
-			packet->ph, packet->bytes );
-	return filterRes != 0;
-}
-
 void Handler::createConnection( Packet *packet, Half &key )
 {
 	switch ( synAckBits( packet ) ) {
@@ -255,7 +241,7 @@ void Handler::flowEstabState( Packet *packet )
 
 	flowData( packet );
 
-	if ( packet->caplen < packet->dlen ) {
+	if ( packet->caplen < packet->dlen && !packet->truncated ) {
 		continuation = true;
 		contPacket = *packet;
 
@@ -305,7 +291,7 @@ void Handler::tcp( Packet *packet )
 		FmtIpPortNet(packet->tcp.th->source) << " dest port: " << FmtIpPortNet(packet->tcp.th->dest) );
 
 	Half key( netpConfigure, 0,
-			packet->ih->saddr, packet->ih->daddr,
+			packet->saddr, packet->daddr,
 			packet->tcp.th->source, packet->tcp.th->dest );
 	
 	HalfDictEl *halfEl = halfDict.find( &key );
@@ -320,8 +306,8 @@ void Handler::tcp( Packet *packet )
 	}
 	else {
 		log_debug( DBG_TCP, "new connection: " <<
-				FmtIpAddrNet(packet->ih->saddr) << ':' << FmtIpPortNet(packet->tcp.th->source) << " -> " <<
-				FmtIpAddrNet(packet->ih->daddr) << ':' << FmtIpPortNet(packet->tcp.th->dest) );
+				FmtIpAddr(packet->saddr) << ':' << FmtIpPortNet(packet->tcp.th->source) << " -> " <<
+				FmtIpAddr(packet->daddr) << ':' << FmtIpPortNet(packet->tcp.th->dest) );
 
 		createConnection( packet, key );
 	}
@@ -34,7 +34,12 @@ void Handler::udp( Packet *packet )
 			FmtIpPortNet(packet->uh->source) << " dest port: " << FmtIpPortNet(packet->uh->dest) );
 	
 	if ( ntohs(packet->uh->source) == 53 || ntohs(packet->uh->dest) == 53 ) {
-		DnsParser dnsParser;
-		dnsParser.data( &udpCtx, packet, packet->data, packet->dlen );
+		int length = packet->dlen < packet->caplen ? packet->dlen : packet->caplen;
+
+		if ( dnsView.decode( packet->data, length ) )
+			netpConfigure->dnsMessage( packet, &dnsView );
+
+		if ( dnsPatterns )
+			dnsParser.data( &udpCtx, packet, packet->data, length );
 	}
 }
@@ -4,51 +4,65 @@
 #include <linux/kobject.h>
 #include <linux/if_ether.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/tcp.h>
+#include <linux/udp.h>
 #include <linux/etherdevice.h>
 #include <linux/inet.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/if_vlan.h>
 #include <net/route.h>
+#include <net/ipv6.h>
 #include <linux/etherdevice.h>
 
 #include <kring/krkern.h>
 
 #include "module.h"
 #include "attribute.h"
-#include "avl.h"
 #include "config.h"
 
-struct connection
+/*
+ * Blocked flows and redirect IPs are looked up for every TCP frame. Both are
+ * RCU hash tables. Updates come from sysfs and the command work, serialized by
+ * update_lock. Entries with a TTL expire and are reclaimed by the gc work.
+ */
+
+#define BLOCK_HASH_BITS 15
+#define SHUTTLE_GC_INTERVAL ( 10 * HZ )
+
+/* One entry per flow. Key ordered so both directions find it. */
+struct block_flow
 {
-	uint32_t addr1, addr2;
+	struct hlist_node node;
+
+	__be32 addr1, addr2;
 	uint16_t port1, port2;
 
-	struct avl_el el;
+	/* Jiffies, zero for no expiry. */
+	unsigned long expires;
+
+	/* Approximate, updated without atomics from every cpu. */
+	unsigned long hits;
+
+	struct rcu_head rcu;
 };
 
-static inline int conn_compare( struct connection *el1, struct connection *el2 )
-{
-	if ( el1->addr1 < el2->addr1 )
-		return -1;
-	else if ( el1->addr1 > el2->addr1 )
-		return 1;
-	else if ( el1->addr2 < el2->addr2 )
-		return -1;
-	else if ( el1->addr2 > el2->addr2 )
-		return 1;
-	else if ( el1->port1 < el2->port1 )
-		return -1;
-	else if ( el1->port1 > el2->port1 )
-		return 1;
-	else if ( el1->port2 < el2->port2 )
-		return -1;
-	else if ( el1->port2 > el2->port2 )
-		return 1;
-	return 0;
-}
+static DEFINE_HASHTABLE( block_table, BLOCK_HASH_BITS );
+static unsigned long block_entries;
+static unsigned long block_expired;
+static u32 block_seed;
 
-avl_declare( conn, connection )
+/* Serializes updates to the block and redirect tables from sysfs and from
+ * command rings. */
+static DEFINE_MUTEX( update_lock );
 
-struct avl_tree block = { 0, 0, 0, 0 };
+static void shuttle_gc( struct work_struct *work );
+static DECLARE_DELAYED_WORK( gc_work, shuttle_gc );
 
 struct shuttle_dev_priv
 {
@@ -63,14 +77,115 @@ static inline struct link *get_link( const struct net_device *dev )
 	return rcu_dereference( dev->rx_handler_data );
 }
 
+static inline bool entry_expired( unsigned long expires )
+{
+	return expires != 0 && time_after( jiffies, expires );
+}
+
+/* TTL in seconds. Never lands on zero, which means no expiry. */
+static inline unsigned long entry_expires( unsigned int ttl )
+{
+	return ttl == 0 ? 0 : ( jiffies + ttl * HZ ) | 1;
+}
+
+static inline u32 redirect_hash( __be32 ip )
+{
+	return jhash_1word( ip, block_seed );
+}
+
+static struct redirect_ip *redirect_find( struct link *l, __be32 ip )
+{
+	struct redirect_ip *r;
+
+	hash_for_each_possible_rcu( l->redirect, r, node, redirect_hash( ip ) ) {
+		if ( r->ip == ip )
+			return r;
+	}
+	return 0;
+}
+
 bool in_ip_list( struct link *l, __be32 ip )
 {
-	int i;
-	for ( i = 0; i < l->nips; i++ ) {
-		if ( l->ips[i] == ip )
-			return true;
+	struct redirect_ip *r;
+	bool found = false;
+
+	rcu_read_lock();
+	r = redirect_find( l, ip );
+	if ( r != 0 && !entry_expired( r->expires ) ) {
+		r->hits += 1;
+		found = true;
 	}
-	return false;
+	rcu_read_unlock();
+
+	return found;
+}
+
+static inline u32 redirect6_hash( const struct in6_addr *ip )
+{
+	return jhash2( ip->s6_addr32, 4, block_seed );
+}
+
+static struct redirect_ip6 *redirect6_find( struct link *l, const struct in6_addr *ip )
+{
+	struct redirect_ip6 *r;
+
+	hash_for_each_possible_rcu( l->redirect6, r, node, redirect6_hash( ip ) ) {
+		if ( ipv6_addr_equal( &r->ip, ip ) )
+			return r;
+	}
+	return 0;
+}
+
+bool in_ip6_list( struct link *l, const struct in6_addr *ip )
+{
+	struct redirect_ip6 *r;
+	bool found = false;
+
+	/* Common case, no IPv6 redirects configured. */
+	if ( l->nredirect6 == 0 )
+		return false;
+
+	rcu_read_lock();
+	r = redirect6_find( l, ip );
+	if ( r != 0 && !entry_expired( r->expires ) ) {
+		r->hits += 1;
+		found = true;
+	}
+	rcu_read_unlock();
+
+	return found;
+}
+
+/* Ports in host byte order. Orders the endpoints so a flow has one key. */
+static inline void flow_key( struct block_flow *k, __be32 ip1, uint16_t port1,
+		__be32 ip2, uint16_t port2 )
+{
+	if ( ip1 < ip2 || ( ip1 == ip2 && port1 <= port2 ) ) {
+		k->addr1 = ip1; k->port1 = port1;
+		k->addr2 = ip2; k->port2 = port2;
+	}
+	else {
+		k->addr1 = ip2; k->port1 = port2;
+		k->addr2 = ip1; k->port2 = port1;
+	}
+}
+
+static inline u32 flow_hash( const struct block_flow *k )
+{
+	return jhash_3words( k->addr1, k->addr2,
+			( (u32)k->port1 << 16 ) | k->port2, block_seed );
+}
+
+static struct block_flow *flow_find( const struct block_flow *k )
+{
+	struct block_flow *f;
+
+	hash_for_each_possible_rcu( block_table, f, node, flow_hash( k ) ) {
+		if ( f->addr1 == k->addr1 && f->addr2 == k->addr2 &&
+				f->port1 == k->port1 && f->port2 == k->port2 )
+			return f;
+	}
+	return 0;
 }
 
 int block_conn( struct sk_buff *skb )
@@ -78,41 +193,157 @@ int block_conn( struct sk_buff *skb )
 	struct iphdr *ih = ip_hdr(skb);
 	const int ihlen = ip_hdr(skb)->ihl * 4;
 	struct tcphdr *th = (struct tcphdr*) ( ( (char*)ih) + ihlen );
+	struct block_flow k, *f;
+	int blocked = 0;
 
-	struct connection c;
-
-	c.addr1 = (ih->saddr);
-	c.addr2 = (ih->daddr);
+	/* Nothing blocked is the common case. */
+	if ( block_entries == 0 )
+		return 0;
 
-	c.port1 = ntohs(th->source);
-	c.port2 = ntohs(th->dest);
+	flow_key( &k, ih->saddr, ntohs(th->source), ih->daddr, ntohs(th->dest) );
 
-	// printk( "block? %u %u %hu %hu\n", c.addr1, c.addr2, c.port1, c.port2 );
+	rcu_read_lock();
+	f = flow_find( &k );
+	if ( f != 0 && !entry_expired( f->expires ) ) {
+		f->hits += 1;
+		blocked = 1;
+	}
+	rcu_read_unlock();
 
-	return conn_find( &block, &c ) != 0;
+	return blocked;
 }
 
-static void parse_kring_command( struct link *link, unsigned char *bytes, int len )
+/* Expects skb->data at the ethernet header. */
+static bool capture_match( struct capture_policy *cp, const struct sk_buff *skb )
 {
-	if ( bytes[0] == 'b' ) {
-		char cmd;
-		char ip1[32];
-		long port1;
-		char ip2[32];
-		long port2 ;
+	const struct ethhdr *eh = (const struct ethhdr*)skb->data;
+	__be16 _tag[2];
+	const __be16 *tag;
+	__be16 proto = eh->h_proto;
+	struct iphdr _ih;
+	const struct iphdr *ih;
+	struct ipv6hdr _i6h;
+	const struct ipv6hdr *i6h;
+	__be16 _ports[2];
+	const __be16 *ports;
+	__be16 frag_off;
+	u8 _flags;
+	const u8 *flags;
+	u8 nexthdr;
+	unsigned int cls, off = ETH_HLEN;
+	int thoff, tags;
+
+	/* Default policy, nothing to look at. */
+	if ( cp->protos == CAPTURE_ALL )
+		return true;
+
+	/* Step over 802.1Q and 802.1ad (QinQ) tags, as the handler does. */
+	for ( tags = 0; tags < 2 && ( proto == htons( ETH_P_8021Q ) ||
+			proto == htons( ETH_P_8021AD ) ); tags++ )
+	{
+		tag = skb_header_pointer( skb, off, sizeof(_tag), _tag );
+		if ( tag == 0 )
+			return false;
+
+		proto = tag[1];
+		off += VLAN_HLEN;
+	}
+
+	if ( proto == htons( ETH_P_ARP ) )
+		return cp->protos & CAPTURE_ARP;
 
-		int scanned = sscanf( bytes, "%c %s %ld %s %ld", &cmd, ip1, &port1, ip2, &port2  );
-		if ( scanned == 5 )
-			link_block_store( link, ip1, port1, ip2, port2 );
+	if ( proto == htons( ETH_P_IP ) ) {
+		ih = skb_header_pointer( skb, off, sizeof(_ih), &_ih );
+		if ( ih == 0 )
+			return false;
+
+		nexthdr = ih->protocol;
+		frag_off = ih->frag_off & htons( IP_OFFSET );
+		thoff = off + ih->ihl * 4;
+
+		if ( nexthdr == IPPROTO_ICMP )
+			return cp->protos & CAPTURE_ICMP;
 	}
-	else if ( bytes[0] == 'p' ) {
-		char cmd;
-		char ip[32];
+	else if ( proto == htons( ETH_P_IPV6 ) ) {
+		i6h = skb_header_pointer( skb, off, sizeof(_i6h), &_i6h );
+		if ( i6h == 0 )
+			return false;
+
+		/* Extension headers to the transport header. */
+		nexthdr = i6h->nexthdr;
+		thoff = ipv6_skip_exthdr( skb, off + sizeof(_i6h), &nexthdr, &frag_off );
+		if ( thoff < 0 )
+			return cp->protos & CAPTURE_OTHER;
+
+		frag_off &= htons( IP6_OFFSET );
 
-		int scanned = sscanf( bytes, "%c %s", &cmd, ip  );
-		if ( scanned == 2 )
-			link_ip_add_store( link, ip );
+		if ( nexthdr == IPPROTO_ICMPV6 )
+			return cp->protos & CAPTURE_ICMP;
 	}
+	else {
+		return cp->protos & CAPTURE_OTHER;
+	}
+
+	switch ( nexthdr ) {
+		case IPPROTO_TCP:
+			cls = CAPTURE_TCP;
+			break;
+		case IPPROTO_UDP:
+			cls = CAPTURE_UDP;
+			break;
+		default:
+			return cp->protos & CAPTURE_OTHER;
+	}
+
+	if ( cp->protos & cls )
+		return true;
+
+	/* Later fragments have no ports. */
+	if ( frag_off != 0 )
+		return false;
+
+	ports = skb_header_pointer( skb, thoff, sizeof(_ports), _ports );
+	if ( ports == 0 )
+		return false;
+
+	if ( test_bit( ntohs( ports[0] ), cp->ports ) || test_bit( ntohs( ports[1] ), cp->ports ) )
+		return true;
+
+	if ( cls == CAPTURE_TCP && ( cp->protos & CAPTURE_TCP_CTRL ) ) {
+		/* Byte 13 of the TCP header holds the flags. */
+		flags = skb_header_pointer( skb, thoff + 13, 1, &_flags );
+		if ( flags != 0 && ( *flags & ( TCPHDR_SYN | TCPHDR_FIN | TCPHDR_RST ) ) )
+			return true;
+	}
+
+	return false;
+}
+
+/* Mirror a forwarded frame to the data ring if the link's policy wants it. */
+static void link_capture( struct link *link, int dir, const struct sk_buff *skb )
+{
+	struct capture_policy *cp = &link->capture;
+
+	if ( !capture_match( cp, skb ) ) {
+		cp->dropped += 1;
+		return;
+	}
+
+	cp->matched += 1;
+	kdata_kwrite_snap( &link->kring, dir, skb, cp->snaplen );
+}
+
+/* Hand an inside frame up to the proxy's netdev. */
+static void redirect_up( struct link *link, struct sk_buff *skb )
+{
+	skb->dev = link->dev;
+	skb->pkt_type = PACKET_HOST;
+
+	skb_push( skb, ETH_HLEN );
+	link_capture( link, KDATA_DIR_INSIDE, skb );
+	skb_pull( skb, ETH_HLEN );
+
+	netif_receive_skb( skb );
 }
 
 rx_handler_result_t shuttle_handle_frame( struct sk_buff **pskb )
@@ -125,14 +356,6 @@ rx_handler_result_t shuttle_handle_frame( struct sk_buff **pskb )
 		return RX_HANDLER_CONSUMED;
 	}
 
-	if ( kctrl_kavail( &link->cmd ) ) {
-		struct kctrl_plain plain;
-
-		kctrl_knext_plain( &link->cmd, &plain );
-		printk( "kring command: %s\n", plain.bytes );
-		parse_kring_command( link, plain.bytes, plain.len );
-	}
-
 	if ( skb->dev == link->inside ) {
 		if ( eth_hdr(skb)->h_proto == htons( ETH_P_ARP ) ) {
 			struct sk_buff *up = skb_clone( skb, GFP_ATOMIC );
@@ -157,22 +380,19 @@ rx_handler_result_t shuttle_handle_frame( struct sk_buff **pskb )
 
 				if ( th->dest == htons( 443 ) && ( in_ip_list( link, ip_hdr(skb)->daddr ) ) ) {
 					// printk( "inline.ko: ssl traffic\n" );
-					skb->dev = link->dev;
-					skb->pkt_type = PACKET_HOST;
-					
-					skb_push( skb, ETH_HLEN );
-					kdata_kwrite( &link->kring, KDATA_DIR_INSIDE, skb );
-					skb_pull( skb, ETH_HLEN );
-
-					netif_receive_skb( skb );
+					redirect_up( link, skb );
 					return RX_HANDLER_CONSUMED;
 				}
 			}
 		}
 
+		/* IPv6 is not redirected. The proxy has no IPv6 listener or TPROXY
+		 * rule, so it passes through. The IPv6 redirect table is kept for
+		 * when it does. */
+
 		skb->dev = link->outside;
 		skb_push( skb, ETH_HLEN );
-		kdata_kwrite( &link->kring, KDATA_DIR_INSIDE, skb );
+		link_capture( link, KDATA_DIR_INSIDE, skb );
 		dev_queue_xmit( skb );
 	}
 	else if ( skb->dev == link->outside ) {
@@ -187,7 +407,7 @@ rx_handler_result_t shuttle_handle_frame( struct sk_buff **pskb )
 
 		skb->dev = link->inside;
 		skb_push( skb, ETH_HLEN );
-		kdata_kwrite( &link->kring, KDATA_DIR_OUTSIDE, skb );
+		link_capture( link, KDATA_DIR_OUTSIDE, skb );
 		dev_queue_xmit( skb );
 	}
 	else {
@@ -265,49 +485,384 @@ ssize_t link_port_del_store(
 	return 0;
 }
 
+static void link_ip_add( struct link *link, __be32 ip, unsigned int ttl )
+{
+	struct redirect_ip *r;
+
+	mutex_lock( &update_lock );
+
+	r = redirect_find( link, ip );
+	if ( r != 0 ) {
+		/* Refresh. */
+		r->expires = entry_expires( ttl );
+	}
+	else {
+		r = kzalloc( sizeof(struct redirect_ip), GFP_KERNEL );
+		if ( r != 0 ) {
+			r->ip = ip;
+			r->expires = entry_expires( ttl );
+			hash_add_rcu( link->redirect, &r->node, redirect_hash( ip ) );
+			link->nredirect += 1;
+		}
+	}
+
+	mutex_unlock( &update_lock );
+}
+
+static void link_ip_del( struct link *link, __be32 ip )
+{
+	struct redirect_ip *r;
+
+	mutex_lock( &update_lock );
+
+	r = redirect_find( link, ip );
+	if ( r != 0 ) {
+		hash_del_rcu( &r->node );
+		kfree_rcu( r, rcu );
+		link->nredirect -= 1;
+	}
+
+	mutex_unlock( &update_lock );
+}
+
+static void link_ip6_add( struct link *link, const struct in6_addr *ip, unsigned int ttl )
+{
+	struct redirect_ip6 *r;
+
+	mutex_lock( &update_lock );
+
+	r = redirect6_find( link, ip );
+	if ( r != 0 ) {
+		r->expires = entry_expires( ttl );
+	}
+	else {
+		r = kzalloc( sizeof(struct redirect_ip6), GFP_KERNEL );
+		if ( r != 0 ) {
+			r->ip = *ip;
+			r->expires = entry_expires( ttl );
+			hash_add_rcu( link->redirect6, &r->node, redirect6_hash( ip ) );
+			link->nredirect6 += 1;
+		}
+	}
+
+	mutex_unlock( &update_lock );
+}
+
+static void link_ip6_del( struct link *link, const struct in6_addr *ip )
+{
+	struct redirect_ip6 *r;
+
+	mutex_lock( &update_lock );
+
+	r = redirect6_find( link, ip );
+	if ( r != 0 ) {
+		hash_del_rcu( &r->node );
+		kfree_rcu( r, rcu );
+		link->nredirect6 -= 1;
+	}
+
+	mutex_unlock( &update_lock );
+}
+
+/* Ports in host byte order. */
+static void link_block( struct link *link, __be32 ip1, uint16_t port1,
+		__be32 ip2, uint16_t port2, bool blocked, unsigned int ttl )
+{
+	struct block_flow k, *f;
+
+	flow_key( &k, ip1, port1, ip2, port2 );
+
+	mutex_lock( &update_lock );
+
+	f = flow_find( &k );
+	if ( !blocked ) {
+		if ( f != 0 ) {
+			hash_del_rcu( &f->node );
+			kfree_rcu( f, rcu );
+			block_entries -= 1;
+		}
+	}
+	else if ( f != 0 ) {
+		/* Refresh. */
+		f->expires = entry_expires( ttl );
+	}
+	else {
+		f = kzalloc( sizeof(struct block_flow), GFP_KERNEL );
+		if ( f != 0 ) {
+			f->addr1 = k.addr1;
+			f->addr2 = k.addr2;
+			f->port1 = k.port1;
+			f->port2 = k.port2;
+			f->expires = entry_expires( ttl );
+			hash_add_rcu( block_table, &f->node, flow_hash( &k ) );
+			block_entries += 1;
+		}
+	}
+
+	mutex_unlock( &update_lock );
+}
+
+/* Drop everything in a link's redirect tables. Caller holds update_lock. */
+static void link_redirect_free( struct link *link )
+{
+	struct redirect_ip *r;
+	struct redirect_ip6 *r6;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe( link->redirect, bkt, tmp, r, node ) {
+		hash_del_rcu( &r->node );
+		kfree_rcu( r, rcu );
+	}
+	link->nredirect = 0;
+
+	hash_for_each_safe( link->redirect6, bkt, tmp, r6, node ) {
+		hash_del_rcu( &r6->node );
+		kfree_rcu( r6, rcu );
+	}
+	link->nredirect6 = 0;
+}
+
+static void shuttle_gc( struct work_struct *work )
+{
+	struct block_flow *f;
+	struct redirect_ip *r;
+	struct redirect_ip6 *r6;
+	struct hlist_node *tmp;
+	struct list_head *h;
+	int bkt;
+
+	mutex_lock( &update_lock );
+
+	hash_for_each_safe( block_table, bkt, tmp, f, node ) {
+		if ( entry_expired( f->expires ) ) {
+			hash_del_rcu( &f->node );
+			kfree_rcu( f, rcu );
+			block_entries -= 1;
+			block_expired += 1;
+		}
+	}
+
+	list_for_each( h, &link_list ) {
+		struct link *link = container_of( h, struct link, link_list );
+		hash_for_each_safe( link->redirect, bkt, tmp, r, node ) {
+			if ( entry_expired( r->expires ) ) {
+				hash_del_rcu( &r->node );
+				kfree_rcu( r, rcu );
+				link->nredirect -= 1;
+				link->redirect_expired += 1;
+			}
+		}
+		hash_for_each_safe( link->redirect6, bkt, tmp, r6, node ) {
+			if ( entry_expired( r6->expires ) ) {
+				hash_del_rcu( &r6->node );
+				kfree_rcu( r6, rcu );
+				link->nredirect6 -= 1;
+				link->redirect_expired += 1;
+			}
+		}
+	}
+
+	mutex_unlock( &update_lock );
+
+	schedule_delayed_work( &gc_work, SHUTTLE_GC_INTERVAL );
+}
+
+static void shuttle_command( struct link *link, const unsigned char *bytes, int len )
+{
+	const struct kctrl_cmd *cmd = (const struct kctrl_cmd*)bytes;
+
+	if ( len != sizeof(struct kctrl_cmd) || cmd->version != KCTRL_CMD_VERSION ) {
+		printk_ratelimited( "shuttle: %s: bad command, len %d\n", link->name, len );
+		return;
+	}
+
+	/* IPv6 redirects have their own table. */
+	if ( cmd->addr1.family == KCTRL_ADDR_IP6 ) {
+		if ( cmd->type == KCTRL_CMD_IP_ADD )
+			link_ip6_add( link, (const struct in6_addr*)cmd->addr1.a.ip6, cmd->ttl );
+		else if ( cmd->type == KCTRL_CMD_IP_DEL )
+			link_ip6_del( link, (const struct in6_addr*)cmd->addr1.a.ip6 );
+		else
+			printk_ratelimited( "shuttle: %s: ignoring IPv6 block command\n", link->name );
+		return;
+	}
+
+	/* The block table is IPv4 only. */
+	if ( cmd->addr1.family != KCTRL_ADDR_IP4 ||
+			( ( cmd->type == KCTRL_CMD_BLOCK || cmd->type == KCTRL_CMD_UNBLOCK ) &&
+			cmd->addr2.family != KCTRL_ADDR_IP4 ) )
+	{
+		printk_ratelimited( "shuttle: %s: ignoring non-IPv4 command\n", link->name );
+		return;
+	}
+
+	switch ( cmd->type ) {
+		case KCTRL_CMD_BLOCK:
+		case KCTRL_CMD_UNBLOCK:
+			link_block( link, cmd->addr1.a.ip4, ntohs( cmd->port1 ),
+					cmd->addr2.a.ip4, ntohs( cmd->port2 ),
+					cmd->type == KCTRL_CMD_BLOCK, cmd->ttl );
+			break;
+		case KCTRL_CMD_IP_ADD:
+			link_ip_add( link, cmd->addr1.a.ip4, cmd->ttl );
+			break;
+		case KCTRL_CMD_IP_DEL:
+			link_ip_del( link, cmd->addr1.a.ip4 );
+			break;
+		default:
+			printk_ratelimited( "shuttle: %s: unknown command %hu\n", link->name, cmd->type );
+			break;
+	}
+}
+
+/* Runs when the command ring is notified. Takes everything pending, so
+ * commands are applied in batches and never from the packet path. */
+static void shuttle_cmd_work( struct work_struct *work )
+{
+	struct link *link = container_of( work, struct link, cmd_work );
+	struct kctrl_plain plain;
+
+	while ( kctrl_knext_plain( &link->cmd, &plain ) )
+		shuttle_command( link, plain.bytes, plain.len );
+}
+
 ssize_t link_ip_add_store( struct link *obj, const char *ip )
 {
-	if ( obj->nips < LINK_IPS ) {
-		obj->ips[obj->nips++] = in_aton( ip );
+	struct in6_addr ip6;
+
+	if ( strchr( ip, ':' ) != 0 ) {
+		if ( !in6_pton( ip, -1, ip6.s6_addr, -1, 0 ) )
+			return -EINVAL;
+		link_ip6_add( obj, &ip6, 0 );
+	}
+	else {
+		link_ip_add( obj, in_aton( ip ), 0 );
 	}
+	return 0;
+}
+
+ssize_t link_ip_del_store( struct link *obj, const char *ip )
+{
+	struct in6_addr ip6;
 
+	if ( strchr( ip, ':' ) != 0 ) {
+		if ( !in6_pton( ip, -1, ip6.s6_addr, -1, 0 ) )
+			return -EINVAL;
+		link_ip6_del( obj, &ip6 );
+	}
+	else {
+		link_ip_del( obj, in_aton( ip ) );
+	}
 	return 0;
 }
 
 ssize_t link_block_store( struct link *obj, const char *ip1, long port1, const char *ip2, long port2 )
 {
-	uint32_t bip1 = in_aton( ip1 );
-	uint32_t bip2 = in_aton( ip2 );
-
-	struct connection c1, c2, *pc1, *pc2, *r;
+	link_block( obj, in_aton( ip1 ), port1, in_aton( ip2 ), port2, true, 0 );
+	return 0;
+}
 
-	c1.addr1 = c2.addr2 = bip1;
-	c1.addr2 = c2.addr1 = bip2;
+ssize_t link_unblock_store( struct link *obj, const char *ip1, long port1, const char *ip2, long port2 )
+{
+	link_block( obj, in_aton( ip1 ), port1, in_aton( ip2 ), port2, false, 0 );
+	return 0;
+}
 
-	c1.port1 = c2.port2 = port1;
-	c1.port2 = c2.port1 = port2;
+/* Protos is a comma separated list of tcp, udp, icmp, arp, other, ctrl, all
+ * and none. */
+ssize_t link_capture_store( struct link *obj, const char *protos, long snaplen )
+{
+	static const struct { const char *name; unsigned int bits; } names[] = {
+		{ "tcp", CAPTURE_TCP },
+		{ "udp", CAPTURE_UDP },
+		{ "icmp", CAPTURE_ICMP },
+		{ "arp", CAPTURE_ARP },
+		{ "other", CAPTURE_OTHER },
+		{ "ctrl", CAPTURE_TCP_CTRL },
+		{ "all", CAPTURE_ALL },
+		{ "none", 0 },
+	};
+	unsigned int bits = 0;
+	const char *p = protos;
+	int i, len;
+
+	if ( snaplen < 0 )
+		return -EINVAL;
 
-	r = conn_find( &block, &c1 );
-	printk( "conn find result: %p\n", r );
+	while ( *p != 0 ) {
+		len = strcspn( p, "," );
+		for ( i = 0; i < ARRAY_SIZE( names ); i++ ) {
+			if ( strlen( names[i].name ) == len && strncmp( p, names[i].name, len ) == 0 )
+				break;
+		}
+		if ( i == ARRAY_SIZE( names ) )
+			return -EINVAL;
 
-	if ( r == 0 ) {
-		pc1 = kmalloc( sizeof(struct connection), GFP_KERNEL );
-		pc2 = kmalloc( sizeof(struct connection), GFP_KERNEL );
+		bits |= names[i].bits;
+		p += len;
+		if ( *p == ',' )
+			p += 1;
+	}
 
-		*pc1 = c1;
-		*pc2 = c2;
+	obj->capture.snaplen = snaplen;
+	obj->capture.protos = bits;
+	return 0;
+}
 
-		printk( "inserting into block %u %u %hu %hu\n", c1.addr1, c1.addr2, c1.port1, c1.port2 );
+ssize_t link_capture_port_store( struct link *obj, long port )
+{
+	if ( port < 0 || port >= CAPTURE_PORTS )
+		return -EINVAL;
 
-		conn_insert( &block, pc1, 0 );
-		conn_insert( &block, pc2, 0 );
+	set_bit( port, obj->capture.ports );
+	return 0;
+}
 
-		r = conn_find( &block, &c1 );
-		printk( "after insert find result: %p\n", r );
-	}
+ssize_t link_capture_port_del_store( struct link *obj, long port )
+{
+	if ( port < 0 || port >= CAPTURE_PORTS )
+		return -EINVAL;
 
+	clear_bit( port, obj->capture.ports );
 	return 0;
-};
+}
+
+ssize_t link_stats_show( struct link *obj, char *buf )
+{
+	struct redirect_ip *r;
+	struct redirect_ip6 *r6;
+	unsigned long hits = 0;
+	int bkt;
+
+	rcu_read_lock();
+	hash_for_each_rcu( obj->redirect, bkt, r, node )
+		hits += r->hits;
+	hash_for_each_rcu( obj->redirect6, bkt, r6, node )
+		hits += r6->hits;
+	rcu_read_unlock();
+
+	return scnprintf( buf, PAGE_SIZE,
+			"redirect %lu redirect6 %lu hits %lu expired %lu\n"
+			"capture matched %lu dropped %lu\n",
+			obj->nredirect, obj->nredirect6, hits, obj->redirect_expired,
+			obj->capture.matched, obj->capture.dropped );
+}
+
+ssize_t shuttle_stats_show( struct shuttle *obj, char *buf )
+{
+	struct block_flow *f;
+	unsigned long hits = 0;
+	int bkt;
+
+	rcu_read_lock();
+	hash_for_each_rcu( block_table, bkt, f, node )
+		hits += f->hits;
+	rcu_read_unlock();
+
+	return scnprintf( buf, PAGE_SIZE, "block %lu hits %lu expired %lu\n",
+			block_entries, hits, block_expired );
+}
 
 ssize_t shuttle_add_store( struct shuttle *obj, const char *name, const char *ctrl, const char *ring )
 {
@@ -315,7 +870,15 @@ ssize_t shuttle_add_store( struct shuttle *obj, const char *name, const char *ct
 
 	struct link *link = 0;
 	create_link( &link, name, &root_obj->kobj );
+	hash_init( link->redirect );
+	hash_init( link->redirect6 );
+
+	/* Mirror everything until a policy is set. */
+	link->capture.protos = CAPTURE_ALL;
+
+	mutex_lock( &update_lock );
 	list_add_tail( &link->link_list, &link_list );
+	mutex_unlock( &update_lock );
 	strcpy( link->name, name );
 	create_netdev( link, name );
 
@@ -323,9 +886,13 @@ ssize_t shuttle_add_store( struct shuttle *obj, const char *name, const char *ct
 	if ( err < 0 )
 		printk( "shuttle: failed to open data ring %s\n", ring );
 
+	INIT_WORK( &link->cmd_work, shuttle_cmd_work );
+
 	err = kring_kopen( &link->cmd, KRING_CTRL, ctrl, 0, KRING_READ );
 	if ( err < 0 )
 		printk( "shuttle: failed to open control ring %s\n", ctrl );
+	else
+		kctrl_kwatch( &link->cmd, &link->cmd_work );
 
 	return 0;
 }
@@ -358,7 +925,11 @@ ssize_t shuttle_del_store( struct shuttle *obj, const char *name )
 		unregister_netdevice_queue( link->dev, NULL );
 		rtnl_unlock();
 
+		mutex_lock( &update_lock );
 		list_del( &link->link_list );
+		link_redirect_free( link );
+		mutex_unlock( &update_lock );
+
 		kobject_put( &link->kobj );
 	}
 
@@ -407,7 +978,7 @@ netdev_tx_t shuttle_dev_xmit( struct sk_buff *skb, struct net_device *dev )
 
 	/* Probably need to find the right mac address now. */
 	skb->dev = priv->link->inside;
-	kdata_kwrite( &priv->link->kring, KDATA_DIR_OUTSIDE, skb );
+	link_capture( priv->link, KDATA_DIR_OUTSIDE, skb );
 	dev_queue_xmit( skb );
 
 	return NETDEV_TX_OK;
@@ -554,10 +1125,29 @@ int shuttle_init(void)
 
 	INIT_LIST_HEAD( &link_list );
 
+	get_random_bytes( &block_seed, sizeof(block_seed) );
+	schedule_delayed_work( &gc_work, SHUTTLE_GC_INTERVAL );
+
 	return 0;
 }
 
 void shuttle_exit(void)
 {
+	struct block_flow *f;
+	struct hlist_node *tmp;
+	int bkt;
+
+	cancel_delayed_work_sync( &gc_work );
 	unregister_netdevice_notifier( &shuttle_device_notifier );
+
+	mutex_lock( &update_lock );
+	hash_for_each_safe( block_table, bkt, tmp, f, node ) {
+		hash_del_rcu( &f->node );
+		kfree_rcu( f, rcu );
+	}
+	block_entries = 0;
+	mutex_unlock( &update_lock );
+
+	/* Wait for the kfree_rcu callbacks before the module text goes. */
+	rcu_barrier();
 }
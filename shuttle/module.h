@@ -2,6 +2,8 @@
 #define _SHUTTLE_MODULE_H
 
 #include <linux/kobject.h>
+#include <linux/hashtable.h>
+#include <linux/in6.h>
 #include <kring/krkern.h>
 
 /* Root object. */
@@ -10,7 +12,63 @@ struct shuttle
 	struct kobject kobj;
 };
 
-#define LINK_IPS 256
+#define REDIRECT_HASH_BITS 8
+
+/* Frame classes for the capture policy. */
+#define CAPTURE_TCP      0x01
+#define CAPTURE_UDP      0x02
+#define CAPTURE_ICMP     0x04
+#define CAPTURE_ARP      0x08
+#define CAPTURE_OTHER    0x10
+#define CAPTURE_TCP_CTRL 0x20
+#define CAPTURE_ALL      0x1f
+
+#define CAPTURE_PORTS 65536
+
+/*
+ * Which forwarded frames are mirrored to the data ring. A frame is written if
+ * its class is in protos, if it is TCP or UDP with either port in the port
+ * set, or if it is a TCP SYN, FIN or RST and protos has CAPTURE_TCP_CTRL.
+ */
+struct capture_policy
+{
+	unsigned int protos;
+
+	/* Bytes of each frame written, zero for whole frames. */
+	int snaplen;
+
+	DECLARE_BITMAP( ports, CAPTURE_PORTS );
+
+	/* Approximate. */
+	unsigned long matched;
+	unsigned long dropped;
+};
+
+/* Destination IP whose port 443 traffic goes up to the proxy. */
+struct redirect_ip
+{
+	struct hlist_node node;
+	__be32 ip;
+
+	/* Jiffies, zero for no expiry. */
+	unsigned long expires;
+
+	/* Approximate. */
+	unsigned long hits;
+
+	struct rcu_head rcu;
+};
+
+/* IPv6 destinations, kept in their own table so the IPv4 lookup stays a one
+ * word compare. */
+struct redirect_ip6
+{
+	struct hlist_node node;
+	struct in6_addr ip;
+	unsigned long expires;
+	unsigned long hits;
+	struct rcu_head rcu;
+};
 
 /* Passtrhough link. */
 struct link
@@ -20,12 +78,21 @@ struct link
 	struct net_device *inside, *outside;
 	struct net_device *dev;
 
-	__be32 ips[LINK_IPS];
-	int nips;
+	DECLARE_HASHTABLE( redirect, REDIRECT_HASH_BITS );
+	unsigned long nredirect;
+	unsigned long redirect_expired;
+
+	DECLARE_HASHTABLE( redirect6, REDIRECT_HASH_BITS );
+	unsigned long nredirect6;
 
 	struct kring_kern kring;
 	struct kring_kern cmd;
 
+	struct capture_policy capture;
+
+	/* Drains the command ring. */
+	struct work_struct cmd_work;
+
 	struct list_head link_list;
 
 };
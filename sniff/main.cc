@@ -6,10 +6,64 @@
 
 #include <unistd.h>
 #include <signal.h>
+#include <fstream>
+#include <sstream>
 #include <parse/module.h>
 
 extern const char *_PIDFILE;
 
+#define PROTECT_DEFAULT "10.0.0.0/8,172.16.0.0/12,192.168.0.0/16,fc00::/7"
+
+/* The protected networks from the file, the option, or the private ranges. */
+bool MainThread::readProtected( std::string &prefixes )
+{
+	if ( protectFile != 0 ) {
+		std::ifstream in( protectFile );
+		if ( !in.is_open() ) {
+			log_ERROR( "could not open protected networks file: " << protectFile );
+			return false;
+		}
+
+		std::stringstream ss;
+		ss << in.rdbuf();
+		prefixes = ss.str();
+	}
+	else if ( protect != 0 )
+		prefixes = protect;
+	else
+		prefixes = PROTECT_DEFAULT;
+
+	return true;
+}
+
+/* SIGHUP reloads the protected networks file. */
+void MainThread::handleSignal( int sig )
+{
+	if ( sig != SIGHUP || protectFile == 0 ) {
+		MainBase::handleSignal( sig );
+		return;
+	}
+
+	log_message( "received SIGHUP, reloading " << protectFile );
+
+	std::string prefixes;
+	if ( !readProtected( prefixes ) )
+		return;
+
+	/* Check it here so a bad file is reported once. */
+	PrefixSet check;
+	if ( !check.load( prefixes.c_str() ) ) {
+		log_ERROR( "failed to parse protected networks, keeping current set" );
+		return;
+	}
+
+	for ( int i = 0; i < nsniff; i++ ) {
+		Message::Protected *msg = sendsToSniff[i]->openProtected();
+		msg->set_prefixes( sendsToSniff[i]->writer, prefixes.c_str() );
+		sendsToSniff[i]->send();
+	}
+}
+
 
 int MainThread::main()
 {
@@ -22,34 +76,58 @@ int MainThread::main()
 
 	tlsStartup();
 
-	SniffThread *sniffNet = new SniffThread( "r0", SniffThread::Net );
-	SniffThread *sniffDecrypt = new SniffThread( "r1", SniffThread::Decrypted );
-
-	sniffNet->compileBpf();
-	sniffDecrypt->compileBpf();
-
-	create( sniffNet );
-	create( sniffDecrypt );
+	/* Replay a file, or with an interface capture with AF_PACKET on threads
+	 * sharing a fanout group. Otherwise read the shuttle's packet and
+	 * decrypted rings. */
+	if ( pcapReplay != 0 ) {
+		nsniff = 1;
+		sniff = new SniffThread*[nsniff];
+		sniff[0] = new SniffThread( pcapReplay, SniffThread::Replay );
+	}
+	else if ( iface != 0 ) {
+		nsniff = threads > 0 ? threads : 1;
+		sniff = new SniffThread*[nsniff];
+		for ( int i = 0; i < nsniff; i++ ) {
+			sniff[i] = new SniffThread( iface, SniffThread::AfPacket );
+			sniff[i]->fanoutId = getpid() & 0xffff;
+		}
+	}
+	else {
+		nsniff = 2;
+		sniff = new SniffThread*[nsniff];
+		sniff[0] = new SniffThread( "r0", SniffThread::Net );
+		sniff[1] = new SniffThread( "r1", SniffThread::Decrypted );
+	}
+
+	std::string prefixes;
+	if ( !readProtected( prefixes ) )
+		log_FATAL( "no protected networks" );
+
+	for ( int i = 0; i < nsniff; i++ ) {
+		if ( !sniff[i]->loadProtected( prefixes.c_str() ) )
+			log_FATAL( "bad protected networks" );
+		create( sniff[i] );
+	}
 
 	ServiceThread *service = new ServiceThread;
 	create( service );
 
 	/* Main sending to sniff and service. */
-	SendsToSniff *sendsToSniffNet = registerSendsToSniff( sniffNet );
-	SendsToSniff *sendsToSniffDecrypt = registerSendsToSniff( sniffDecrypt );
+	sendsToSniff = new SendsToSniff*[nsniff];
+	for ( int i = 0; i < nsniff; i++ )
+		sendsToSniff[i] = registerSendsToSniff( sniff[i] );
 	SendsToService *sendsToService = registerSendsToService( service );
 
 	/* Sniff sending to service. */
-	sniffNet->sendsPassthru = sniffNet->registerSendsPassthru( service );
-	sniffDecrypt->sendsPassthru = sniffDecrypt->registerSendsPassthru( service );
+	for ( int i = 0; i < nsniff; i++ )
+		sniff[i]->sendsPassthru = sniff[i]->registerSendsPassthru( service );
 
 	signalLoop();
 
-	sendsToSniffNet->openShutdown();
-	sendsToSniffNet->send();
-
-	sendsToSniffDecrypt->openShutdown();
-	sendsToSniffDecrypt->send();
+	for ( int i = 0; i < nsniff; i++ ) {
+		sendsToSniff[i]->openShutdown();
+		sendsToSniff[i]->send();
+	}
 
 	sendsToService->openShutdown();
 	sendsToService->send();
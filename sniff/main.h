@@ -6,10 +6,24 @@
 
 #define PARSE_REPORT 1
 
+#include <string>
+
+struct SniffThread;
+
 struct MainThread
 	: public MainGen
 {
+	MainThread()
+		: nsniff(0), sniff(0), sendsToSniff(0) {}
+
 	int main();
+	void handleSignal( int sig );
+
+	bool readProtected( std::string &prefixes );
+
+	int nsniff;
+	SniffThread **sniff;
+	SendsToSniff **sendsToSniff;
 };
 
 #endif
@@ -0,0 +1,510 @@
+#include "sniff.h"
+#include "main.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <netinet/ip6.h>
+#include <arpa/inet.h>
+
+/*
+ * Replays pcap and pcapng files through the Handler. The file is mapped and
+ * frames are handed to the handler in place, so the replay itself costs little
+ * more than walking the records.
+ */
+
+#define PCAP_MAGIC_US    0xa1b2c3d4
+#define PCAP_MAGIC_NS    0xa1b23c4d
+#define PCAPNG_SHB       0x0a0d0d0a
+#define PCAPNG_IDB       0x00000001
+#define PCAPNG_SPB       0x00000003
+#define PCAPNG_EPB       0x00000006
+#define PCAPNG_BOM       0x1a2b3c4d
+
+#define PCAPNG_MAX_IFACES 64
+
+/* Log2 nanosecond buckets for handler latency. */
+#define REPLAY_LAT_BUCKETS 40
+
+/* How often the replay loop checks for messages. */
+#define REPLAY_POLL_INTERVAL 1024
+
+struct PcapFile
+{
+	PcapFile()
+		: data(0), size(0), pos(0), ng(false), swap(false), nsec(false),
+			linktype(0), nifaces(0) {}
+
+	~PcapFile()
+	{
+		if ( data != 0 )
+			munmap( (void*)data, size );
+	}
+
+	bool open( const char *fn );
+	void rewind();
+	bool next( struct pcap_pkthdr *hdr, const u_char **bytes );
+
+	uint32_t u32( const u_char *p )
+	{
+		uint32_t v;
+		memcpy( &v, p, 4 );
+		return swap ? __builtin_bswap32( v ) : v;
+	}
+
+	uint16_t u16( const u_char *p )
+	{
+		uint16_t v;
+		memcpy( &v, p, 2 );
+		return swap ? __builtin_bswap16( v ) : v;
+	}
+
+	bool nextPcap( struct pcap_pkthdr *hdr, const u_char **bytes );
+	bool nextPcapng( struct pcap_pkthdr *hdr, const u_char **bytes );
+	void readShb( const u_char *block );
+	void readIdb( const u_char *block, uint32_t len );
+
+	const u_char *data;
+	size_t size;
+	size_t pos;
+	size_t first;
+
+	bool ng;
+	bool swap;
+
+	/* Classic pcap. */
+	bool nsec;
+	int linktype;
+
+	/* Pcapng, per interface. */
+	int nifaces;
+	int ifLinktype[PCAPNG_MAX_IFACES];
+	uint64_t ifUnitsPerSec[PCAPNG_MAX_IFACES];
+};
+
+bool PcapFile::open( const char *fn )
+{
+	int fd = ::open( fn, O_RDONLY );
+	if ( fd < 0 ) {
+		log_ERROR( "replay: could not open " << fn << ": " << strerror( errno ) );
+		return false;
+	}
+
+	struct stat st;
+	if ( fstat( fd, &st ) < 0 || st.st_size < 24 ) {
+		log_ERROR( "replay: " << fn << " is too short to be a capture" );
+		::close( fd );
+		return false;
+	}
+
+	size = st.st_size;
+	data = (const u_char*) mmap( 0, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	::close( fd );
+
+	if ( data == MAP_FAILED ) {
+		data = 0;
+		log_ERROR( "replay: mmap of " << fn << " failed: " << strerror( errno ) );
+		return false;
+	}
+
+	madvise( (void*)data, size, MADV_SEQUENTIAL | MADV_WILLNEED );
+
+	uint32_t magic;
+	memcpy( &magic, data, 4 );
+
+	if ( magic == PCAPNG_SHB ) {
+		ng = true;
+		first = 0;
+	}
+	else if ( magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS ) {
+		nsec = magic == PCAP_MAGIC_NS;
+	}
+	else if ( magic == __builtin_bswap32( PCAP_MAGIC_US ) || magic == __builtin_bswap32( PCAP_MAGIC_NS ) ) {
+		swap = true;
+		nsec = magic == __builtin_bswap32( PCAP_MAGIC_NS );
+	}
+	else {
+		log_ERROR( "replay: " << fn << " is not a pcap or pcapng file" );
+		return false;
+	}
+
+	if ( !ng ) {
+		linktype = u32( data + 20 );
+		first = 24;
+	}
+
+	rewind();
+	return true;
+}
+
+void PcapFile::rewind()
+{
+	pos = first;
+	nifaces = 0;
+}
+
+bool PcapFile::next( struct pcap_pkthdr *hdr, const u_char **bytes )
+{
+	return ng ? nextPcapng( hdr, bytes ) : nextPcap( hdr, bytes );
+}
+
+bool PcapFile::nextPcap( struct pcap_pkthdr *hdr, const u_char **bytes )
+{
+	while ( pos + 16 <= size ) {
+		const u_char *rec = data + pos;
+		uint32_t caplen = u32( rec + 8 );
+
+		if ( pos + 16 + caplen > size )
+			break;
+
+		pos += 16 + caplen;
+
+		/* Ethernet only. */
+		if ( linktype != DLT_EN10MB )
+			continue;
+
+		hdr->ts.tv_sec = u32( rec );
+		hdr->ts.tv_usec = nsec ? u32( rec + 4 ) / 1000 : u32( rec + 4 );
+		hdr->caplen = caplen;
+		hdr->len = u32( rec + 12 );
+		*bytes = rec + 16;
+		return true;
+	}
+	return false;
+}
+
+void PcapFile::readShb( const u_char *block )
+{
+	uint32_t bom;
+	memcpy( &bom, block + 8, 4 );
+	swap = bom != PCAPNG_BOM;
+
+	/* Interface ids are per section. */
+	nifaces = 0;
+}
+
+void PcapFile::readIdb( const u_char *block, uint32_t len )
+{
+	if ( nifaces == PCAPNG_MAX_IFACES )
+		return;
+
+	int iface = nifaces++;
+	ifLinktype[iface] = u16( block + 8 );
+	ifUnitsPerSec[iface] = 1000000;
+
+	/* Options, looking for if_tsresol. */
+	const u_char *opt = block + 16, *end = block + len - 4;
+	while ( opt + 4 <= end ) {
+		uint16_t code = u16( opt );
+		uint16_t olen = u16( opt + 2 );
+		if ( code == 0 )
+			break;
+
+		if ( code == 9 && olen == 1 ) {
+			uint8_t res = opt[4];
+			uint64_t units = 1;
+			if ( res & 0x80 ) {
+				for ( int i = 0; i < ( res & 0x7f ) && i < 63; i++ )
+					units *= 2;
+			}
+			else {
+				for ( int i = 0; i < res && i < 19; i++ )
+					units *= 10;
+			}
+			ifUnitsPerSec[iface] = units;
+		}
+
+		opt += 4 + ( ( olen + 3 ) & ~3 );
+	}
+}
+
+bool PcapFile::nextPcapng( struct pcap_pkthdr *hdr, const u_char **bytes )
+{
+	while ( pos + 12 <= size ) {
+		const u_char *block = data + pos;
+		uint32_t type;
+		memcpy( &type, block, 4 );
+
+		/* The section header sets the byte order, so read it first. */
+		if ( type == PCAPNG_SHB )
+			readShb( block );
+
+		uint32_t len = u32( block + 4 );
+		if ( len < 12 || pos + len > size )
+			break;
+
+		pos += len;
+
+		if ( type == PCAPNG_IDB ) {
+			readIdb( block, len );
+		}
+		else if ( type == PCAPNG_EPB && len >= 32 ) {
+			uint32_t iface = u32( block + 8 );
+			if ( (int)iface >= nifaces || ifLinktype[iface] != DLT_EN10MB )
+				continue;
+
+			uint64_t ts = ( (uint64_t)u32( block + 12 ) << 32 ) | u32( block + 16 );
+			uint64_t units = ifUnitsPerSec[iface];
+
+			hdr->ts.tv_sec = ts / units;
+			hdr->ts.tv_usec = ( ts % units ) * 1000000 / units;
+			hdr->caplen = u32( block + 20 );
+			hdr->len = u32( block + 24 );
+			if ( 28 + hdr->caplen > len )
+				continue;
+
+			*bytes = block + 28;
+			return true;
+		}
+		else if ( type == PCAPNG_SPB && len >= 16 ) {
+			if ( nifaces == 0 || ifLinktype[0] != DLT_EN10MB )
+				continue;
+
+			/* No timestamp. Captured length is whatever fits. */
+			hdr->ts.tv_sec = 0;
+			hdr->ts.tv_usec = 0;
+			hdr->len = u32( block + 8 );
+			hdr->caplen = hdr->len < len - 16 ? hdr->len : len - 16;
+			*bytes = block + 12;
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline uint64_t replayNow()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void replaySleepUntil( uint64_t ns )
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0 ) == EINTR )
+		;
+}
+
+/* Which part of the pipeline a frame exercises. */
+enum ReplayStage
+{
+	StageTcp = 0,
+	StageUdp,
+	StageOther,
+	StageCount
+};
+
+static const char *stageNames[StageCount] = { "tcp", "udp", "other" };
+
+static ReplayStage replayStage( const struct pcap_pkthdr *hdr, const u_char *bytes )
+{
+	if ( hdr->caplen < sizeof(struct ethhdr) + sizeof(struct iphdr) )
+		return StageOther;
+
+	const struct ethhdr *eh = (const struct ethhdr*)bytes;
+	int protocol;
+	if ( eh->h_proto == htons( ETH_P_IP ) ) {
+		const struct iphdr *ih = (const struct iphdr*)( bytes + sizeof(struct ethhdr) );
+		protocol = ih->protocol;
+	}
+	else if ( eh->h_proto == htons( ETH_P_IPV6 ) &&
+			hdr->caplen >= sizeof(struct ethhdr) + sizeof(struct ip6_hdr) )
+	{
+		/* Extension headers count as other. */
+		const struct ip6_hdr *i6h = (const struct ip6_hdr*)( bytes + sizeof(struct ethhdr) );
+		protocol = i6h->ip6_nxt;
+	}
+	else {
+		return StageOther;
+	}
+
+	if ( protocol == IPPROTO_TCP )
+		return StageTcp;
+	if ( protocol == IPPROTO_UDP )
+		return StageUdp;
+	return StageOther;
+}
+
+struct ReplayStats
+{
+	ReplayStats()
+	{
+		memset( this, 0, sizeof(*this) );
+	}
+
+	void record( ReplayStage stage, unsigned long len, uint64_t ns )
+	{
+		packets[stage] += 1;
+		bytes[stage] += len;
+		time[stage] += ns;
+
+		int b = ns == 0 ? 0 : 64 - __builtin_clzll( ns );
+		if ( b >= REPLAY_LAT_BUCKETS )
+			b = REPLAY_LAT_BUCKETS - 1;
+		lat[b] += 1;
+
+		if ( ns > maxLat )
+			maxLat = ns;
+	}
+
+	/* Upper bound of the bucket holding the given fraction of samples. */
+	uint64_t percentile( double p, unsigned long total )
+	{
+		unsigned long want = (unsigned long)( p * total ), seen = 0;
+		for ( int b = 0; b < REPLAY_LAT_BUCKETS; b++ ) {
+			seen += lat[b];
+			if ( seen > want )
+				return b == 0 ? 0 : ( 1ULL << b < maxLat ? 1ULL << b : maxLat );
+		}
+		return maxLat;
+	}
+
+	unsigned long packets[StageCount];
+	unsigned long bytes[StageCount];
+	uint64_t time[StageCount];
+	unsigned long lat[REPLAY_LAT_BUCKETS];
+	uint64_t maxLat;
+
+	/* Frames the capture cut at its snap length. */
+	unsigned long snapped;
+};
+
+/*
+ * Pacing is "fast" (default), "orig" for the capture's own timing, or a
+ * number of packets per second.
+ */
+int SniffThread::sniffReplay()
+{
+	PcapFile file;
+	ReplayStats stats;
+
+	handler.pcap = pcap_open_dead( DLT_EN10MB, 1024 );
+	handler.datalink = DLT_EN10MB;
+
+	/* A short caplen is the file's snap length, not a kring record with a
+	 * continuation to come. */
+	handler.snapLimited = true;
+
+	if ( !file.open( ring ) ) {
+		kill( getpid(), SIGTERM );
+		return 1;
+	}
+
+	const char *rate = MainThread::replayRate != 0 ? MainThread::replayRate : "fast";
+	bool orig = strcmp( rate, "orig" ) == 0;
+	double pps = 0;
+	if ( !orig && strcmp( rate, "fast" ) != 0 ) {
+		pps = strtod( rate, 0 );
+		if ( pps <= 0 )
+			log_FATAL( "replay: rate must be fast, orig or packets per second: " << rate );
+	}
+
+	long loops = MainThread::replayLoops > 0 ? MainThread::replayLoops : 1;
+
+	log_message( "replaying " << ring << " " << loops << " times, rate " << rate );
+
+	loopBegin();
+
+	uint64_t start = replayNow(), loopStart = start, sent = 0;
+	bool stopped = false;
+
+	for ( long l = 0; l < loops && !stopped; l++ ) {
+		struct pcap_pkthdr hdr;
+		const u_char *bytes;
+		uint64_t firstTs = 0, lastTs = 0;
+		bool haveFirst = false;
+
+		file.rewind();
+		while ( file.next( &hdr, &bytes ) ) {
+			uint64_t ts = (uint64_t)hdr.ts.tv_sec * 1000000000ULL + hdr.ts.tv_usec * 1000ULL;
+
+			if ( orig ) {
+				if ( !haveFirst ) {
+					firstTs = ts;
+					haveFirst = true;
+				}
+				if ( ts > firstTs )
+					replaySleepUntil( loopStart + ( ts - firstTs ) );
+				lastTs = ts;
+			}
+			else if ( pps > 0 ) {
+				replaySleepUntil( start + (uint64_t)( sent * 1e9 / pps ) );
+			}
+
+			ReplayStage stage = replayStage( &hdr, bytes );
+			if ( hdr.caplen < hdr.len )
+				stats.snapped += 1;
+
+			uint64_t before = replayNow();
+			handler.handler( Packet::UnknownDir, &hdr, bytes );
+			stats.record( stage, hdr.caplen, replayNow() - before );
+
+			sent += 1;
+
+			if ( sent % REPLAY_POLL_INTERVAL == 0 ) {
+				poll();
+				if ( !loopContinue() ) {
+					stopped = true;
+					break;
+				}
+			}
+		}
+
+		/* Next loop starts where this one's timing left off. */
+		loopStart += lastTs - firstTs;
+	}
+
+	uint64_t elapsed = replayNow() - start;
+	double secs = elapsed / 1e9;
+
+	unsigned long totalPackets = 0, totalBytes = 0;
+	uint64_t totalTime = 0;
+	for ( int s = 0; s < StageCount; s++ ) {
+		totalPackets += stats.packets[s];
+		totalBytes += stats.bytes[s];
+		totalTime += stats.time[s];
+	}
+
+	log_message( "replay: " << totalPackets << " packets " << totalBytes << " bytes in " <<
+			secs << "s: " << ( totalPackets / secs ) << " pps " <<
+			( totalBytes * 8 / secs / 1e6 ) << " Mbps, handler busy " <<
+			( 100.0 * totalTime / elapsed ) << "%" );
+
+	if ( stats.snapped > 0 )
+		log_message( "replay: " << stats.snapped << " frames cut at the snap length" );
+
+	for ( int s = 0; s < StageCount; s++ ) {
+		if ( stats.packets[s] == 0 )
+			continue;
+
+		log_message( "replay: " << stageNames[s] << ": " << stats.packets[s] << " packets " <<
+				( stats.packets[s] * 1e9 / stats.time[s] ) << " pps in handler, " <<
+				( stats.bytes[s] * 8 / ( stats.time[s] / 1e9 ) / 1e6 ) << " Mbps, avg " <<
+				( stats.time[s] / stats.packets[s] ) << " ns" );
+	}
+
+	log_message( "replay: handler latency p50 <=" << stats.percentile( 0.5, totalPackets ) <<
+			" ns p90 <=" << stats.percentile( 0.9, totalPackets ) <<
+			" ns p99 <=" << stats.percentile( 0.99, totalPackets ) <<
+			" ns max " << stats.maxLat << " ns" );
+
+	pcap_close( handler.pcap );
+
+	/* Nothing else to do. Ends the main signal loop, which shuts us down. */
+	if ( !stopped )
+		kill( getpid(), SIGTERM );
+
+	return 0;
+}
@@ -5,12 +5,24 @@
 #include "itq_gen.h"
 
 #include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <net/if.h>
+#include <arpa/inet.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
 #include <kring/kring.h>
 #include <aapl/vector.h>
-#include <sstream>
-#include <parse/pattern.h>
 
+/*
+ * Answers for target names are matched on the binary address against interned
+ * name ids. Nothing is formatted or allocated per answer. Text is produced
+ * only for logging and for the redirect notification.
+ */
 struct MatchDnsAnswer
 {
 	MatchDnsAnswer( SniffThread *sniffThread )
@@ -24,182 +36,108 @@ struct MatchDnsAnswer
 	LookupSet lookupSet;
 	IpSet ipsAdded;
 
-	int answerCname( const char *name, const char *cname )
+	void answerCname( const char *name, int nlen, const char *cname, int clen )
 	{
-		if ( lookupSet.find( name ) ) {
-			if ( !lookupSet.find( cname ) ) {
-				char *dup = strdup( cname );
-				log_debug( DBG_PAT_DNS, "CNAME lookup set add: " << cname );
-				lookupSet.insert( dup );
-			}
+		long id = lookupSet.find( name, nlen );
+		if ( id >= 0 && lookupSet.find( cname, clen ) < 0 ) {
+			lookupSet.alias( cname, clen, id );
+			log_debug( DBG_PAT_DNS, "CNAME lookup set add: " << cname <<
+					" for " << lookupSet.rootName( id ) );
 		}
-
-		return 0;
 	}
 
-	int answerA( const char *name, const unsigned char *addr )
+	void answer( const char *name, int nlen, const IpAddr &ip )
 	{
-		if ( lookupSet.find( name ) ) {
-			char toa[16];
-			sprintf( toa, "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3] );
-
-			log_debug( DBG_PAT_DNS, "TARGET: " << name << " -> " << toa );
-		
-			uint32_t ip = 
-					(uint32_t)addr[0] <<  0 |
-					(uint32_t)addr[1] <<  8 |
-					(uint32_t)addr[2] << 16 |
-					(uint32_t)addr[3] << 24;
-
-			if ( ! ipsAdded.find( ip ) ) {
-				ipsAdded.insert( ip );
-
-				log_debug( DBG_PAT_DNS, "TARGET: " << name << " -> " << toa );
-				sniffThread->matchedDns( 0, toa );
-			}
-		}
-
-		return 0;
-	}
-};
-
-struct MatchDnsAnswer1
-:
-	public OnMatch
-{
-	MatchDnsAnswer1( MatchDnsAnswer *mda )
-	:
-		mda(mda)
-	{}
-
-	MatchDnsAnswer *mda;
+		long id = lookupSet.find( name, nlen );
+		if ( id >= 0 && ! ipsAdded.find( ip ) ) {
+			ipsAdded.insert( ip );
 
-	virtual MatchResult match( VPT *vpt, Node *node )
-	{
-		Node *rra = node; //findChild( node, Node::DnsRrA );
-		if ( rra != 0 ) {
-			Node *name = findChild( rra, Node::DnsName );
-			Node *value = findChild( rra, Node::DnsAddr );
-
-			if ( name != 0 && value != 0 && value->data != 0 ) {
-				char toa[16] = "";
-				sprintf( toa, "%u.%u.%u.%u",
-						value->data[0], value->data[1], value->data[2], value->data[3] );
-		
-				uint32_t ip = 
-						(uint32_t)value->data[0] <<  0 |
-						(uint32_t)value->data[1] <<  8 |
-						(uint32_t)value->data[2] << 16 |
-						(uint32_t)value->data[3] << 24;
-
-				log_debug( DBG_PAT_DNS, "A target check: " << name->text <<
-						" -> " << toa << " (" << ip << ")" );
-
-				mda->answerA( name->text.c_str(), value->data );
-			}
+			log_debug( DBG_PAT_DNS, "TARGET: " << name << " (" <<
+					lookupSet.rootName( id ) << ") -> " << FmtIpAddr( ip ) );
+			sniffThread->matchedDns( ip );
 		}
-		return MatchFinished;
 	}
 };
 
-struct MatchDnsAnswer2
-:
-	public OnMatch
+/* Answer section records straight from the flat view. No node tree is built
+ * for DNS unless a module registers a DNS pattern. */
+void SniffThread::dnsMessage( Packet *packet, DnsView *view )
 {
-	MatchDnsAnswer2( MatchDnsAnswer *mda )
-	:
-		mda(mda)
-	{}
-
-	MatchDnsAnswer *mda;
-
-	virtual MatchResult match( VPT *vpt, Node *node )
-	{
-		Node *rra = node; //findChild( node, Node::DnsRrCname );
-		if ( rra != 0 ) {
-			Node *name = findChild( rra, Node::DnsName );
-			Node *value = name->next;
-
-			if ( name != 0 && value != 0 ) {
-				log_debug( DBG_PAT_DNS, "CNAME target check: " << name->text << " -> " << value->text );
-
-				mda->answerCname( name->text.c_str(), value->text.c_str() );
-			}
+	if ( dnsAnswer == 0 )
+		dnsAnswer = new MatchDnsAnswer( this );
+
+	for ( int i = 0; i < view->nrec; i++ ) {
+		const DnsRecord *r = &view->rec[i];
+		if ( r->section != 1 )
+			continue;
+
+		if ( r->type != DnsView::TypeA && r->type != DnsView::TypeAAAA &&
+				r->type != DnsView::TypeCname )
+			continue;
+
+		int nlen;
+		const char *name = view->name( r->nameOff, &nlen );
+		if ( name == 0 )
+			continue;
+
+		if ( r->type == DnsView::TypeA && r->rdlen == 4 ) {
+			uint32_t addr;
+			memcpy( &addr, r->rdata, 4 );
+
+			IpAddr ip;
+			ip.setV4( addr );
+			dnsAnswer->answer( name, nlen, ip );
+		}
+		else if ( r->type == DnsView::TypeAAAA && r->rdlen == 16 ) {
+			IpAddr ip;
+			ip.setV6( r->rdata );
+			dnsAnswer->answer( name, nlen, ip );
+		}
+		else if ( r->type == DnsView::TypeCname ) {
+			int clen;
+			const char *cname = view->name( view->offset( r->rdata ), &clen );
+			if ( cname != 0 )
+				dnsAnswer->answerCname( name, nlen, cname, clen );
 		}
-		return MatchFinished;
 	}
+}
 
-	virtual void capture( VPT *vpt, Node *node, Vector<char> *text ) {}
-};
-
-void SniffThread::matchedDns( Packet *packet, char *toa )
+void SniffThread::matchedDns( const IpAddr &ip )
 {
-	SniffThread *sniffThread = this;
+	/* The proxy listens on IPv4 only. Redirected IPv6 connections would
+	 * reach nothing, so they stay uninspected. */
+	if ( !ip.isV4() ) {
+		log_debug( DBG_PAT_DNS, "not redirecting IPv6 answer" );
+		return;
+	}
 
-	std::stringstream ss;
-	ss << "p " << toa;
+	struct kctrl_cmd command;
+	memset( &command, 0, sizeof(command) );
+	command.type = KCTRL_CMD_IP_ADD;
+	command.addr1.family = KCTRL_ADDR_IP4;
+	command.addr1.a.ip4 = ip.w[3];
 
-	struct kring_user *kring = &sniffThread->cmd;
-	kctrl_write_plain( kring, (char*)ss.str().c_str(), ss.str().size() + 1 );
+	/* No shuttle to tell when capturing with AF_PACKET. */
+	if ( cmdOpen )
+		kctrl_write_cmd( &cmd, &command );
 
 	/* Send out notification of the redirect. */
-	Packer::KringRedirect bkr( sniffThread->sendsPassthru->writer );
+	char toa[INET_ADDRSTRLEN];
+	inet_ntop( AF_INET, &ip.w[3], toa, sizeof(toa) );
+
+	Packer::KringRedirect bkr( sendsPassthru->writer );
 	bkr.set_ip( toa );
 	bkr.send();
 
-	log_debug( DBG_PAT_DNS, "sent kring cmd: " << ss.str() );
+	log_debug( DBG_PAT_DNS, "sent kring cmd: ip add " << toa );
 }
 
 
-PatNode *consPatDnsAnswer1( MatchDnsAnswer1 *a1 )
-{
-	PatNode *rra;
-	PatNode *dns = new PatNode( 0, Node::DnsAnswer );
-	dns->children.append( rra = new PatNode( dns, Node::DnsRrA ) );
-
-	rra->onMatch = a1;
-	rra->skip = true;
-	return dns;
-}
-
-
-PatNode *consPatDnsAnswer2( MatchDnsAnswer2 *a2 )
-{
-	PatNode *rrcname;
-	PatNode *dns = new PatNode( 0, Node::DnsAnswer );
-	dns->children.append( rrcname = new PatNode( dns, Node::DnsRrCname ) );
-
-	rrcname->onMatch = a2;
-	rrcname->skip = true;
-	return dns;
-}
-
 void SniffThread::configureContext( Context *ctx )
 {
-	MatchDnsAnswer *mda = new MatchDnsAnswer( this );
-	MatchDnsAnswer1 *a1 = new MatchDnsAnswer1( mda );
-	MatchDnsAnswer2 *a2 = new MatchDnsAnswer2( mda );
-
-	ctx->addPat( consPatDnsAnswer1( a1 ) );
-	ctx->addPat( consPatDnsAnswer2( a2 ) );
-
 	moduleList.sniffConfigureContext( this, ctx );
 }
 
-void handler( u_char *user, const struct pcap_pkthdr *h, const u_char *bytes )
-{
-	SniffThread *ut = (SniffThread*) user;
-	ut->handler.handler( Packet::UnknownDir, h, bytes );
-}
-
-static pcap_t *signalPcapAccess = 0;
-
-static void sigusrHandler( int s )
-{
-	if ( signalPcapAccess != 0 ) 
-		pcap_breakloop( signalPcapAccess );
-}
-
 void SniffThread::recvShutdown( Message::Shutdown *msg )
 {
 	log_message( "received shutdown" );
@@ -207,34 +145,30 @@ void SniffThread::recvShutdown( Message::Shutdown *msg )
 }
 
 
-/* PCAP compile is not thread safe. */
-void SniffThread::compileBpf()
+/* Called by main before the thread starts, then from the thread itself on a
+ * reload. A bad list leaves the current set in place. */
+bool SniffThread::loadProtected( const char *prefixes )
 {
-	pcap_t *pcap = pcap_open_dead( DLT_EN10MB, 1024 );
-
-	int cr1 = pcap_compile( pcap, &handler.srcProtectedBpf,
-		"src net 10.0.0.0/8 or 172.16.0.0/12 or 192.168.0.0/16", 0,
-		PCAP_NETMASK_UNKNOWN );
-
-	if ( cr1 != 0 )
-		log_ERROR( "failed to compile protected pcap expression: " << pcap_geterr( handler.pcap ) );
-
-	int cr2 = pcap_compile( pcap, &handler.dstProtectedBpf,
-		"dst net 10.0.0.0/8 or 172.16.0.0/12 or 192.168.0.0/16", 0,
-		PCAP_NETMASK_UNKNOWN );
+	if ( !handler.protectedNets.load( prefixes ) ) {
+		log_ERROR( "failed to parse protected networks: " << prefixes );
+		return false;
+	}
 
-	if ( cr2 != 0 )
-		log_ERROR( "failed to compile protected pcap expressoin: " << pcap_geterr( handler.pcap ) );
+	return true;
+}
 
-	pcap_close( pcap );
+void SniffThread::recvProtected( Message::Protected *msg )
+{
+	if ( loadProtected( msg->prefixes ) ) {
+		log_message( "reloaded protected networks: " <<
+				handler.protectedNets.count << " prefixes" );
+	}
 }
 
 int SniffThread::sniffDecrypted()
 {
 	handler.pcap = pcap_open_dead( DLT_EN10MB, 1024 );
 
-	compileBpf();
-
 	int r = kring_open( &kring, KRING_DATA, ring, KRING_DECRYPTED, KDATA_RING_ID_ALL, KRING_READ );
 	if ( r < 0 )
 		log_FATAL( "decrypted data kring open failed: " << kdata_error( &kring, r ) );
@@ -284,6 +218,7 @@ int SniffThread::sniffKring()
 	r = kring_open( &cmd, KRING_CTRL, "c0", KRING_PLAIN, 0, KRING_WRITE );
 	if ( r < 0 )
 		log_FATAL( "command kring open failed: " << kctrl_error( &cmd, r ) );
+	cmdOpen = true;
 
 	loopBegin();
 
@@ -321,46 +256,137 @@ int SniffThread::sniffKring()
 	return 0;
 }
 
-int SniffThread::sniffPcap()
+#define AFP_BLOCK_SIZE  ( 1 << 20 )
+#define AFP_BLOCK_COUNT 64
+#define AFP_FRAME_SIZE  2048
+
+/* Milliseconds. Partly filled blocks are handed over after this, and it bounds
+ * how long we go without checking for messages. */
+#define AFP_BLOCK_TIMEOUT 100
+
+/*
+ * TPACKET_V3 block ring. The kernel fills whole blocks of variable length
+ * frames and hands them over one at a time. Threads capturing on the same
+ * interface join a hash fanout group, so each flow, both directions, lands on
+ * one thread's Handler.
+ */
+int SniffThread::sniffAfPacket()
 {
-	const char *dev = "eth1";
-	char errbuf[PCAP_ERRBUF_SIZE];
-	#define BUFSIZE 16384
-
-	handler.pcap = pcap_open_live( dev, BUFSIZE, 1, 100, errbuf );
-	if ( handler.pcap == NULL ) {
-		log_ERROR( "couldn't open device " << dev << ": " << errbuf );
-		return 0;
-	}
+	long blockSize = MainThread::blockSize > 0 ? MainThread::blockSize : AFP_BLOCK_SIZE;
+	long blockCount = MainThread::blockCount > 0 ? MainThread::blockCount : AFP_BLOCK_COUNT;
+	long frameSize = MainThread::frameSize > 0 ? MainThread::frameSize : AFP_FRAME_SIZE;
 
-	signalPcapAccess = handler.pcap;
-	signal( SIGUSR1, sigusrHandler );
+	if ( blockSize % getpagesize() != 0 || blockSize % frameSize != 0 )
+		log_FATAL( "block size must be a multiple of the page size and the frame size" );
 
-	pcap_set_timeout( handler.pcap, 100 );
+	handler.pcap = pcap_open_dead( DLT_EN10MB, 1024 );
+	handler.datalink = DLT_EN10MB;
+
+	/* Frames past the ring's frame size are cut (tp_snaplen < tp_len). They
+	 * are not continued like kring records. */
+	handler.snapLimited = true;
+
+	int fd = socket( AF_PACKET, SOCK_RAW, htons( ETH_P_ALL ) );
+	if ( fd < 0 )
+		log_FATAL( "AF_PACKET socket failed: " << strerror( errno ) );
+
+	int version = TPACKET_V3;
+	if ( setsockopt( fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version) ) < 0 )
+		log_FATAL( "setting TPACKET_V3 failed: " << strerror( errno ) );
+
+	struct tpacket_req3 req;
+	memset( &req, 0, sizeof(req) );
+	req.tp_block_size = blockSize;
+	req.tp_block_nr = blockCount;
+	req.tp_frame_size = frameSize;
+	req.tp_frame_nr = ( blockSize / frameSize ) * blockCount;
+	req.tp_retire_blk_tov = AFP_BLOCK_TIMEOUT;
+
+	if ( setsockopt( fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req) ) < 0 )
+		log_FATAL( "PACKET_RX_RING failed: " << strerror( errno ) );
+
+	size_t mapLen = (size_t)blockSize * blockCount;
+	u_char *map = (u_char*) mmap( 0, mapLen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_LOCKED, fd, 0 );
+	if ( map == MAP_FAILED )
+		log_FATAL( "packet ring mmap failed: " << strerror( errno ) );
+
+	struct sockaddr_ll ll;
+	memset( &ll, 0, sizeof(ll) );
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons( ETH_P_ALL );
+	ll.sll_ifindex = if_nametoindex( ring );
+	if ( ll.sll_ifindex == 0 )
+		log_FATAL( "no such interface: " << ring );
+
+	if ( bind( fd, (struct sockaddr*)&ll, sizeof(ll) ) < 0 )
+		log_FATAL( "AF_PACKET bind to " << ring << " failed: " << strerror( errno ) );
+
+	/* Join the group after binding, so we only get frames from the interface. */
+	int fanout = ( fanoutId & 0xffff ) | ( ( PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG ) << 16 );
+	if ( setsockopt( fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout) ) < 0 )
+		log_FATAL( "PACKET_FANOUT failed: " << strerror( errno ) );
+
+	log_message( "capturing on " << ring << " with " << blockCount << " blocks of " << blockSize );
 
-	handler.datalink = pcap_datalink( handler.pcap );
+	loopBegin();
 
-	log_debug( DBG_PCAP, "entering packet loop, datalink: " << handler.datalink );
+	long block = 0;
+	while ( true ) {
+		poll();
 
-	loopBegin();
+		if ( !loopContinue() )
+			break;
 
-	if ( handler.datalink == DLT_EN10MB ) {
-		while ( true ) {
-			poll();
+		struct tpacket_block_desc *bd = (struct tpacket_block_desc*)( map + block * blockSize );
+
+		/* Acquire, so the frames are not read ahead of the status that hands
+		 * the block to us. */
+		uint32_t status = __atomic_load_n( &bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE );
+		if ( ( status & TP_STATUS_USER ) == 0 ) {
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLIN | POLLERR;
+			pfd.revents = 0;
+
+			int r = ::poll( &pfd, 1, AFP_BLOCK_TIMEOUT );
+			if ( r < 0 && errno != EINTR )
+				log_ERROR( "AF_PACKET poll failed: " << strerror( errno ) );
+			continue;
+		}
+
+		struct tpacket3_hdr *ph = (struct tpacket3_hdr*)( (u_char*)bd + bd->hdr.bh1.offset_to_first_pkt );
+		for ( unsigned i = 0; i < bd->hdr.bh1.num_pkts; i++ ) {
+			pcap_pkthdr hdr;
+			hdr.ts.tv_sec = ph->tp_sec;
+			hdr.ts.tv_usec = ph->tp_nsec / 1000;
+			hdr.len = ph->tp_len;
+			hdr.caplen = ph->tp_snaplen;
 
-			if ( !loopContinue() )
-				break;
+			/* The kernel strips the VLAN tag into tp_vlan_tci, so the
+			 * handler's tag stepping never sees one on this path. */
+			handler.handler( Packet::UnknownDir, &hdr, (u_char*)ph + ph->tp_mac );
 
-			int rt = pcap_dispatch( handler.pcap, -1, &::handler, (u_char*)this );
-			if ( rt < 0 )
-				break;
+			ph = (struct tpacket3_hdr*)( (u_char*)ph + ph->tp_next_offset );
 		}
+
+		/* Give the block back. */
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+		block = ( block + 1 ) % blockCount;
 	}
 
-	signalPcapAccess = 0;
+	struct tpacket_stats_v3 stats;
+	socklen_t slen = sizeof(stats);
+	if ( getsockopt( fd, SOL_PACKET, PACKET_STATISTICS, &stats, &slen ) == 0 ) {
+		log_message( "capture on " << ring << ": packets " << stats.tp_packets <<
+				" drops " << stats.tp_drops << " freeze " << stats.tp_freeze_q_cnt );
+	}
 
+	munmap( map, mapLen );
+	close( fd );
 	pcap_close( handler.pcap );
-	log_message( "exiting" );
 
 	return 0;
 }
@@ -375,6 +401,12 @@ int SniffThread::main()
 		case Decrypted:
 			ret = sniffDecrypted();
 			break;
+		case AfPacket:
+			ret = sniffAfPacket();
+			break;
+		case Replay:
+			ret = sniffReplay();
+			break;
 	}
 	return ret;
 }
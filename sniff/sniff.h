@@ -7,6 +7,8 @@
 #include "sniff_gen.h"
 #include "packet.h"
 
+struct MatchDnsAnswer;
+
 struct SniffThread
 :
 	public SniffGen,
@@ -14,11 +16,13 @@ struct SniffThread
 {
 	enum Type {
 		Net = 1,
-		Decrypted
+		Decrypted,
+		AfPacket,
+		Replay
 	};
 
 	SniffThread( const char *ring, Type type )
-		: ring(ring), type(type), handler(this)
+		: ring(ring), type(type), fanoutId(0), handler(this), cmdOpen(false), dnsAnswer(0)
 	{
 		recvRequiresSignal = true;
 	}
@@ -26,22 +30,34 @@ struct SniffThread
 	int main();
 
 	void recvShutdown( Message::Shutdown *msg );
+	void recvProtected( Message::Protected *msg );
 
 	SendsPassthru *sendsPassthru;
-	void matchedDns( Packet *packet, char *toa );
+	void matchedDns( const IpAddr &ip );
 
 	virtual void configureContext( Context *ctx );
+	virtual void dnsMessage( Packet *packet, DnsView *view );
 
-	void compileBpf();
+	bool loadProtected( const char *prefixes );
 	int sniffDecrypted();
-	int sniffPcap();
+	int sniffAfPacket();
+	int sniffReplay();
 	int sniffKring();
+
+	/* Ring name, the interface for AfPacket or the file for Replay. */
 	const char *ring;
 	Type type;
+
+	/* AfPacket threads on one interface share a fanout group. */
+	int fanoutId;
+
 	Handler handler;
 
 	struct kring_user kring;
 	struct kring_user cmd;
+	bool cmdOpen;
+
+	MatchDnsAnswer *dnsAnswer;
 };
 
 #endif
@@ -0,0 +1,144 @@
+/*
+ * Reader scaling of the kdata ring. One writer publishes fixed size units as
+ * fast as it can while 1 to 6 readers spin on the same ring. Uses the shared
+ * memory backend, so it runs without the kernel module.
+ */
+
+#include <kring/kring.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RINGSET "/bench1"
+#define NPAGES 2048
+#define MAX_READERS 6
+#define MESSAGES ( 4 * 1024 * 1024 )
+#define MSG_LEN 256
+
+struct reader
+{
+	pthread_t thread;
+	unsigned long received;
+	unsigned long skips;
+};
+
+static volatile int ready;
+static volatile int done;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *reader_main( void *arg )
+{
+	struct reader *reader = (struct reader*)arg;
+	struct kring_user kring;
+	struct kdata_plain plain;
+	int r;
+
+	r = kring_open( &kring, KRING_DATA, RINGSET, KRING_PLAIN, 0, KRING_READ );
+	if ( r < 0 ) {
+		fprintf( stderr, "reader: kring open failed: %s\n", kdata_error( &kring, r ) );
+		exit( 1 );
+	}
+
+	__sync_add_and_fetch( &ready, 1 );
+
+	while ( 1 ) {
+		if ( kdata_avail( &kring ) ) {
+			kdata_next_plain( &kring, &plain );
+			reader->received += 1;
+		}
+		else if ( done ) {
+			break;
+		}
+	}
+
+	reader->skips = kdata_skips( &kring );
+	kring_close( &kring );
+	return 0;
+}
+
+static void run( int nreaders )
+{
+	struct reader readers[MAX_READERS];
+	struct kring_user kring;
+	struct kdata_plain_header *h;
+	struct kdata_ring_stats stats;
+	unsigned long received = 0, skips = 0, lag_hwm = 0;
+	double start, elapsed;
+	long i;
+	int r;
+
+	memset( readers, 0, sizeof(readers) );
+	ready = 0;
+	done = 0;
+
+	kring_shm_unlink( RINGSET );
+	if ( kring_shm_create( RINGSET, KRING_DATA, 1, NPAGES, MAX_READERS, 1 ) < 0 ) {
+		perror( "bench1: kring_shm_create" );
+		exit( 1 );
+	}
+
+	for ( i = 0; i < nreaders; i++ )
+		pthread_create( &readers[i].thread, 0, reader_main, &readers[i] );
+
+	while ( ready < nreaders )
+		;
+
+	r = kring_open( &kring, KRING_DATA, RINGSET, KRING_PLAIN, 0, KRING_WRITE );
+	if ( r < 0 ) {
+		fprintf( stderr, "writer: kring open failed: %s\n", kdata_error( &kring, r ) );
+		exit( 1 );
+	}
+
+	/* Readers spin, so write without the wakeup. */
+	start = now();
+	for ( i = 0; i < MESSAGES; i++ ) {
+		h = (struct kdata_plain_header*) kdata_write_FIRST( &kring );
+		h->len = MSG_LEN;
+		memset( h + 1, (char)i, MSG_LEN );
+		kdata_write_SECOND( &kring );
+	}
+	elapsed = now() - start;
+
+	done = 1;
+	for ( i = 0; i < nreaders; i++ ) {
+		pthread_join( readers[i].thread, 0 );
+		received += readers[i].received;
+		skips += readers[i].skips;
+	}
+
+	kring_stats( &kring, 0, &stats );
+	for ( i = 0; i < nreaders; i++ ) {
+		if ( stats.reader[i].lag_hwm > lag_hwm )
+			lag_hwm = stats.reader[i].lag_hwm;
+	}
+
+	kring_close( &kring );
+	kring_shm_unlink( RINGSET );
+
+	/* Units a reader falls too far behind on are overwritten, so reads below
+	 * 100% mean the readers could not keep up. Skips count pages the writer
+	 * had to step over because a reader held them. */
+	printf( "%d readers: %8.2f Mwrites/s  %8.2f Mreads/s  read %5.1f%%  skips %lu  lag hwm %lu\n",
+			nreaders, MESSAGES / elapsed / 1e6, received / elapsed / 1e6,
+			100.0 * received / ( (double)MESSAGES * nreaders ), skips, lag_hwm );
+}
+
+int main( int argc, char **argv )
+{
+	int nreaders;
+
+	printf( "kdata control layout version %d\n", KDATA_CTRL_VERSION );
+	for ( nreaders = 1; nreaders <= MAX_READERS; nreaders++ )
+		run( nreaders );
+
+	return 0;
+}
@@ -41,7 +41,8 @@ int ReaderThread::main()
 		if ( kctrl_avail( &kring ) ) {
 			/* Load. */
 			struct kctrl_plain plain;
-			kctrl_next_plain( &kring, &plain );
+			if ( !kctrl_next_plain( &kring, &plain ) )
+				continue;
 
 			unsigned char w = plain.bytes[0];
 			long l = *( (long*)(plain.bytes+1) );
@@ -0,0 +1,222 @@
+#include "certstore.h"
+#include "main.h"
+#include "genf.h"
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include <vector>
+#include <algorithm>
+
+/* Certs expiring within this are not reused. Forged certs are good for 365
+ * days. */
+#define CERT_EXPIRY_MARGIN ( 7 * 24 * 3600 )
+
+/* Eviction removes down to this percentage of the max, so it does not run
+ * again on the next save. */
+#define CERT_EVICT_PERCENT 90
+
+CertStore::CertStore()
+:
+	cacert(0),
+	maxCerts(0),
+	lockFd(-1),
+	count(0)
+{
+	pthread_mutex_init( &mutex, 0 );
+}
+
+static bool isPemFile( const char *name )
+{
+	int len = strlen( name );
+	return name[0] != '.' && len > 4 && strcmp( name + len - 4, ".pem" ) == 0;
+}
+
+void CertStore::open( X509 *cacert, long maxCerts )
+{
+	this->cacert = cacert;
+	this->maxCerts = maxCerts;
+
+	dir = PKGSTATEDIR "/CA/forged";
+	mkdir( dir, 0700 );
+
+	String lockFile = dir + "/.lock";
+	lockFd = ::open( lockFile, O_RDWR | O_CREAT | O_CLOEXEC, 0600 );
+	if ( lockFd < 0 ) {
+		log_ERROR( "cert store: could not open lock file " << lockFile <<
+				": " << strerror( errno ) << ", not persisting certs" );
+		return;
+	}
+
+	DIR *d = opendir( dir );
+	if ( d != 0 ) {
+		struct dirent *de;
+		while ( ( de = readdir( d ) ) != 0 ) {
+			if ( isPemFile( de->d_name ) )
+				count += 1;
+		}
+		closedir( d );
+	}
+
+	log_message( "cert store: " << count << " certs in " << dir );
+}
+
+/* Host names become file names, so only plain DNS names are stored, and
+ * wildcard names with a leading '*.'. */
+bool CertStore::fileName( String &dest, const std::string &host )
+{
+	if ( lockFd < 0 || host.size() == 0 || host.size() > 253 || host[0] == '.' )
+		return false;
+
+	std::string::const_iterator c = host.begin();
+	if ( host.size() > 2 && host[0] == '*' && host[1] == '.' )
+		c += 2;
+
+	for ( ; c != host.end(); c++ ) {
+		if ( ! ( ( *c >= 'a' && *c <= 'z' ) || ( *c >= '0' && *c <= '9' ) ||
+				*c == '.' || *c == '-' || *c == '_' ) )
+			return false;
+	}
+
+	dest = dir + "/" + host.c_str() + ".pem";
+	return true;
+}
+
+bool CertStore::load( const std::string &host, EVP_PKEY **ppkey, X509 **px509 )
+{
+	String file;
+	if ( !fileName( file, host ) )
+		return false;
+
+	BIO *bio = BIO_new_file( file, "r" );
+	if ( bio == 0 )
+		return false;
+
+	EVP_PKEY *pkey = PEM_read_bio_PrivateKey( bio, 0, 0, 0 );
+	X509 *x509 = pkey != 0 ? PEM_read_bio_X509( bio, 0, 0, 0 ) : 0;
+	BIO_free( bio );
+
+	/* Must be ours, still valid for a while, and match the key. The CA may
+	 * have been regenerated since it was stored. */
+	time_t cutoff = time( 0 ) + CERT_EXPIRY_MARGIN;
+	bool usable = x509 != 0 &&
+			X509_check_issued( cacert, x509 ) == X509_V_OK &&
+			X509_cmp_time( X509_get_notAfter( x509 ), &cutoff ) > 0 &&
+			X509_check_private_key( x509, pkey ) == 1;
+
+	if ( !usable ) {
+		log_debug( DBG_PROXY, "cert store: ignoring stale or unreadable " << file );
+		if ( x509 != 0 )
+			X509_free( x509 );
+		if ( pkey != 0 )
+			EVP_PKEY_free( pkey );
+		return false;
+	}
+
+	/* Recently used. */
+	utimes( file, 0 );
+
+	*ppkey = pkey;
+	*px509 = x509;
+	return true;
+}
+
+void CertStore::save( const std::string &host, EVP_PKEY *pkey, X509 *x509 )
+{
+	String file;
+	if ( !fileName( file, host ) )
+		return;
+
+	String tmp = dir + "/.tmpXXXXXX";
+
+	pthread_mutex_lock( &mutex );
+	flock( lockFd, LOCK_EX );
+
+	int fd = mkstemp( tmp.data );
+	if ( fd < 0 ) {
+		log_ERROR( "cert store: could not create temp file in " << dir <<
+				": " << strerror( errno ) );
+	}
+	else {
+		BIO *bio = BIO_new_fd( fd, BIO_CLOSE );
+		bool written =
+				PEM_write_bio_PrivateKey( bio, pkey, 0, 0, 0, 0, 0 ) == 1 &&
+				PEM_write_bio_X509( bio, x509 ) == 1 &&
+				BIO_flush( bio ) == 1;
+		BIO_free( bio );
+
+		if ( written && rename( tmp, file ) == 0 ) {
+			/* Replacing a stale file does not grow the store, but counting it
+			 * only makes eviction a little early. */
+			count += 1;
+		}
+		else {
+			log_ERROR( "cert store: failed to write " << file );
+			unlink( tmp );
+		}
+	}
+
+	if ( count > maxCerts )
+		evict();
+
+	flock( lockFd, LOCK_UN );
+	pthread_mutex_unlock( &mutex );
+}
+
+struct StoredCert
+{
+	time_t mtime;
+	std::string name;
+
+	bool operator<( const StoredCert &o ) const
+		{ return mtime < o.mtime; }
+};
+
+/* Called holding the mutex and file lock. Recounts, since other processes
+ * write here as well. */
+void CertStore::evict()
+{
+	std::vector<StoredCert> certs;
+
+	DIR *d = opendir( dir );
+	if ( d == 0 )
+		return;
+
+	struct dirent *de;
+	while ( ( de = readdir( d ) ) != 0 ) {
+		if ( !isPemFile( de->d_name ) )
+			continue;
+
+		struct stat st;
+		String file = dir + "/" + de->d_name;
+		if ( stat( file, &st ) == 0 ) {
+			StoredCert sc;
+			sc.mtime = st.st_mtime;
+			sc.name = file.data;
+			certs.push_back( sc );
+		}
+	}
+	closedir( d );
+
+	long keep = maxCerts * CERT_EVICT_PERCENT / 100;
+	long remove = (long)certs.size() > keep ? certs.size() - keep : 0;
+
+	std::sort( certs.begin(), certs.end() );
+	for ( long i = 0; i < remove; i++ )
+		unlink( certs[i].name.c_str() );
+
+	count = certs.size() - remove;
+
+	log_message( "cert store: evicted " << remove << " least recently used certs" );
+}
@@ -0,0 +1,41 @@
+#ifndef _CERTSTORE_H
+#define _CERTSTORE_H
+
+#include <openssl/ssl.h>
+#include <aapl/astring.h>
+#include <pthread.h>
+#include <string>
+
+/*
+ * Forged certificates and their keys, kept on disk across restarts. One PEM
+ * file per host under PKGSTATEDIR/CA/forged. Files are written under a
+ * temporary name and renamed into place, so loads never see a partial file
+ * and take no lock. Saves and eviction take the mutex and an flock on the
+ * directory's lock file, which also excludes other processes sharing the
+ * state directory. File mtime is the LRU clock, a load bumps it.
+ */
+struct CertStore
+{
+	CertStore();
+
+	void open( X509 *cacert, long maxCerts );
+
+	bool load( const std::string &host, EVP_PKEY **ppkey, X509 **px509 );
+	void save( const std::string &host, EVP_PKEY *pkey, X509 *x509 );
+
+private:
+	bool fileName( String &dest, const std::string &host );
+	void evict();
+
+	String dir;
+	X509 *cacert;
+	long maxCerts;
+
+	pthread_mutex_t mutex;
+	int lockFd;
+
+	/* Files in the store, approximately. Other processes add to it too. */
+	long count;
+};
+
+#endif /* _CERTSTORE_H */
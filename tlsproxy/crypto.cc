@@ -12,6 +12,7 @@
 #include <openssl/err.h>
 #include <openssl/bn.h>
 #include <openssl/rsa.h>
+#include <openssl/ec.h>
 #include <openssl/evp.h>
 #include <openssl/x509.h>
 #include <openssl/pem.h>
@@ -188,6 +189,28 @@ EVP_PKEY *genrsa( int num )
 	return pkey;
 }
 
+/* ECDSA on P-256. */
+EVP_PKEY *genec()
+{
+	EC_KEY *ec = EC_KEY_new_by_curve_name( NID_X9_62_prime256v1 );
+	EC_KEY_set_asn1_flag( ec, OPENSSL_EC_NAMED_CURVE );
+
+	if ( !EC_KEY_generate_key( ec ) ) {
+		EC_KEY_free( ec );
+		return 0;
+	}
+
+	EVP_PKEY *pkey = EVP_PKEY_new();
+	EVP_PKEY_assign_EC_KEY( pkey, ec );
+	return pkey;
+}
+
+/* Key for a forged certificate. */
+EVP_PKEY *genkey( bool ecdsa )
+{
+	return ecdsa ? genec() : genrsa( 2048 );
+}
+
 int genrsa_file( char *outfile, int num )
 {
 	RSA *rsa = genrsa_rsa( num );
@@ -248,7 +271,7 @@ int make_ca_cert( char *keyfile, char *outfile, const char **nameTypes, const ch
 }
 
 X509 *sign_cert( EVP_PKEY *capkey, X509 *cacert, BIGNUM *serial, EVP_PKEY *pkey,
-		const char **nameTypes, const char **nameValues, long days )
+		const char **nameTypes, const char **nameValues, long days, const char *altName )
 {
 	int def_nid;
 	EVP_PKEY_get_default_digest_nid( capkey, &def_nid );
@@ -268,6 +291,13 @@ X509 *sign_cert( EVP_PKEY *capkey, X509 *cacert, BIGNUM *serial, EVP_PKEY *pkey,
 	X509_set_subject_name( x509, subject );
 	X509_set_pubkey( x509, pkey );
 
+	/* Clients match the host against the SAN, wildcards only there. */
+	if ( altName != 0 ) {
+		X509_set_version( x509, 2 );
+		String san = String( "DNS:" ) + altName;
+		addExtension( x509, NID_subject_alt_name, san );
+	}
+
 	sign( x509, capkey, dgst );
 
 	return x509;
@@ -0,0 +1,54 @@
+#include "main.h"
+#include "keygen.h"
+#include "listen.h"
+
+#include "genf.h"
+
+void KeygenThread::recvShutdown( Message::Shutdown *msg )
+{
+	log_debug( DBG_PROXY, "received shutdown" );
+	breakLoop();
+}
+
+int KeygenThread::main()
+{
+	log_message( "starting, pool low " << contextMap->keyLow <<
+			" high " << contextMap->keyHigh <<
+			( MainThread::ecdsa ? " ecdsa" : " rsa" ) );
+
+	loopBegin();
+
+	while ( true ) {
+		poll();
+
+		if ( !loopContinue() )
+			break;
+
+		/* Wake when a proxy takes the pool below the low mark. The timeout
+		 * bounds how long a shutdown message waits. */
+		if ( !contextMap->waitKeysWanted( 1 ) )
+			continue;
+
+		/* Refill to the high mark. Generation happens outside the lock.
+		 * Check for messages between keys, RSA keys are slow. */
+		int added = 0;
+		while ( contextMap->keysAvail() < contextMap->keyHigh ) {
+			EVP_PKEY *key = genkey( MainThread::ecdsa );
+			if ( key == 0 ) {
+				log_ERROR( "key generation failed" );
+				break;
+			}
+
+			contextMap->addKey( key );
+			added += 1;
+
+			poll();
+			if ( !loopContinue() )
+				break;
+		}
+
+		log_debug( DBG_PROXY, "added " << added << " keys to the pool" );
+	}
+
+	return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef _KEYGEN_H
+#define _KEYGEN_H
+
+#include "keygen_gen.h"
+
+struct ContextMap;
+
+/*
+ * Keeps the key pool in the context map stocked so certificate forging on the
+ * proxy threads does not pay for key generation.
+ */
+struct KeygenThread
+	: public KeygenGen
+{
+	KeygenThread( ContextMap *contextMap )
+	:
+		contextMap(contextMap)
+	{
+	}
+
+	ContextMap *contextMap;
+
+	virtual void recvShutdown( Message::Shutdown *msg );
+
+	int main();
+};
+
+#endif
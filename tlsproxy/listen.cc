@@ -2,10 +2,13 @@
 #include "listen.h"
 #include "proxy.h"
 #include "service.h"
+#include "parser.h"
 
 #include "packet_gen.h"
 #include "genf.h"
 
+#include <parse/module.h>
+
 #include <errno.h>
 #include <openssl/bio.h>
 #include <openssl/bn.h>
@@ -13,6 +16,10 @@
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <stdio.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -21,6 +28,65 @@
 #define _GNU_SOURCE 1
 #include <sched.h>
 
+/* Rings in the r1 ringset, as set up by updown. */
+#define DECRYPTED_RINGS 4
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* Per parser. Decrypted data is written in page-sized units. */
+#define PARSER_RING_PAGES 2048
+
+/* Seconds a verified origin chain is trusted. */
+#define VERIFY_CACHE_TTL 3600
+
+/* Seconds between logs of the resumption and passthrough counts. */
+#define STATS_INTERVAL 60
+
+void ListenThread::handleTimer()
+{
+	time_t now = time(0);
+	if ( now - statsLogged < STATS_INTERVAL )
+		return;
+	statsLogged = now;
+
+	SessionStats *stats = &contextMap.sessionStats;
+	SessionStats cur;
+	cur.clientHits = __atomic_load_n( &stats->clientHits, __ATOMIC_RELAXED );
+	cur.clientMisses = __atomic_load_n( &stats->clientMisses, __ATOMIC_RELAXED );
+	cur.serverHits = __atomic_load_n( &stats->serverHits, __ATOMIC_RELAXED );
+	cur.serverMisses = __atomic_load_n( &stats->serverMisses, __ATOMIC_RELAXED );
+
+	if ( cur.clientHits != statsPrev.clientHits || cur.clientMisses != statsPrev.clientMisses ||
+			cur.serverHits != statsPrev.serverHits || cur.serverMisses != statsPrev.serverMisses )
+	{
+		log_message( "session resumption: origin " << cur.clientHits << " hits " <<
+				cur.clientMisses << " misses, client " << cur.serverHits << " hits " <<
+				cur.serverMisses << " misses" );
+		statsPrev = cur;
+	}
+
+	BypassStats bypass;
+	bypass.conns = __atomic_load_n( &contextMap.bypassStats.conns, __ATOMIC_RELAXED );
+	bypass.bytes = __atomic_load_n( &contextMap.bypassStats.bytes, __ATOMIC_RELAXED );
+
+	if ( bypass.conns != bypassPrev.conns || bypass.bytes != bypassPrev.bytes ) {
+		log_message( "passthrough: " << bypass.conns << " connections " <<
+				bypass.bytes << " bytes" );
+		bypassPrev = bypass;
+	}
+
+	/* Whether connections actually got kernel TLS. */
+	KtlsStats ktls;
+	ktls.legs = __atomic_load_n( &contextMap.ktlsStats.legs, __ATOMIC_RELAXED );
+	ktls.active = __atomic_load_n( &contextMap.ktlsStats.active, __ATOMIC_RELAXED );
+
+	if ( ktls.legs != ktlsPrev.legs ) {
+		log_message( "kernel TLS: " << ktls.active << " of " << ktls.legs << " TLS legs" );
+		ktlsPrev = ktls;
+	}
+}
 
 void ListenThread::recvShutdown( Message::Shutdown *msg )
 {
@@ -35,6 +101,60 @@ void ListenThread::recvShutdown( Message::Shutdown *msg )
 		sendsToProxy->openShutdown();
 		sendsToProxy->send();
 	}
+
+	for ( std::list<SendsToParser*>::iterator s = parserSends.begin();
+			s != parserSends.end(); s++ )
+	{
+		log_debug( DBG_PROXY, "sending shutdown to parser thread" );
+		SendsToParser *sendsToParser = *s;
+		sendsToParser->openShutdown();
+		sendsToParser->send();
+	}
+}
+
+/* The ringset is private to this process, writers are the proxy threads and
+ * each parser reads its own ring. */
+void ListenThread::startParsers()
+{
+	nparser = 0;
+	if ( MainThread::parseInline )
+		return;
+
+	int n = MainThread::parserThreads > 0 ?
+			MainThread::parserThreads : ( nproxy + 3 ) / 4;
+	if ( n > KDATA_MAX_RINGS_PER_SET )
+		n = KDATA_MAX_RINGS_PER_SET;
+
+	if ( nproxy > KDATA_MAX_WRITERS_PER_RING ) {
+		log_ERROR( "more than " << KDATA_MAX_WRITERS_PER_RING <<
+				" proxy threads, parsing inline" );
+		return;
+	}
+
+	snprintf( parserRingset, sizeof(parserRingset), "/tlsproxy.%d", (int)getpid() );
+
+	kring_shm_unlink( parserRingset );
+	if ( kring_shm_create( parserRingset, KRING_DATA, n, PARSER_RING_PAGES, 1, nproxy ) < 0 ) {
+		log_ERROR( "failed to create parser ringset " << parserRingset <<
+				": " << strerror(errno) << ", parsing inline" );
+		return;
+	}
+
+	for ( int i = 0; i < n; i++ ) {
+		log_debug( DBG_PROXY, "starting parser thread" );
+
+		ParserThread *parser = new ParserThread( parserRingset, i );
+		SendsToParser *sendsToParser = registerSendsToParser( parser );
+
+		parser->sendsPassthru = parser->registerSendsPassthru( service );
+		parser->passthruWriter = parser->sendsPassthru->writer;
+
+		create( parser );
+
+		parserSends.push_back( sendsToParser );
+	}
+
+	nparser = n;
 }
 
 void ListenThread::enterInlineNamespace()
@@ -72,29 +192,125 @@ void ListenThread::leaveInlineNamespace()
 	::close( enterNsFd );
 }
 
+/* OpenSSL built with kTLS and the kernel's tls module loadable. Setting the
+ * ULP on an unconnected socket fails with ENOTCONN once the module is in, and
+ * ENOENT when it cannot be found. */
+static bool ktlsAvailable()
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if ( fd < 0 )
+		return false;
+
+	int r = setsockopt( fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls") );
+	bool avail = r == 0 || errno != ENOENT;
+	::close( fd );
+	return avail;
+#else
+	return false;
+#endif
+}
+
+/* Accept on the reuseport socket whose index is the CPU that received the
+ * connection. Sockets are indexed in the order they joined the group, which is
+ * the proxy thread order. Attaching to one socket applies to the group. */
+void ListenThread::steerToCpu( int listenFd )
+{
+	struct sock_filter code[] = {
+		{ BPF_LD  | BPF_W | BPF_ABS, 0, 0, (uint32_t)( SKF_AD_OFF + SKF_AD_CPU ) },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+
+	struct sock_fprog prog;
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+
+	int r = setsockopt( listenFd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog) );
+	if ( r < 0 )
+		log_ERROR( "failed to attach reuseport CPU program: " << strerror(errno) );
+}
+
 int ListenThread::main()
 {
 	serverCtx = sslCtxServer( PKGDATADIR "/self-signed.key", PKGDATADIR "/self-signed.crt" );
 	clientCtx = sslCtxClientPublic();
 
+	/* Connections take their mode and options from these. */
+	bool ktls = !MainThread::noKtls && ktlsAvailable();
+	if ( ktls ) {
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options( serverCtx, SSL_OP_ENABLE_KTLS );
+		SSL_CTX_set_options( clientCtx, SSL_OP_ENABLE_KTLS );
+#endif
+	}
+	log_message( "kernel TLS " << ( ktls ? "requested" : "not available" ) );
+
+	if ( MainThread::releaseBuffers ) {
+		SSL_CTX_set_mode( serverCtx, SSL_MODE_RELEASE_BUFFERS );
+		SSL_CTX_set_mode( clientCtx, SSL_MODE_RELEASE_BUFFERS );
+	}
+
+	/* Origin sessions go to the shared cache rather than the context's.
+	 * Tickets to clients are sealed with the shared keys, OpenSSL takes the
+	 * callback from this context even after SNI switches it. */
+	SSL_CTX_set_session_cache_mode( clientCtx,
+			SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE );
+	SSL_CTX_sess_set_new_cb( clientCtx, sessionNewCallback );
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb( serverCtx, ticketKeyCallback );
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb( serverCtx, ticketKeyCallback );
+#endif
+
+	sslCtxVerifyCache( clientCtx, MainThread::verifyCacheTtl > 0 ?
+			MainThread::verifyCacheTtl : VERIFY_CACHE_TTL );
+
 	if ( ! SSL_CTX_set_tlsext_servername_callback( serverCtx, sslServerNameCallback )
 			|| ! SSL_CTX_set_tlsext_servername_arg( serverCtx, 0 ) )
 	{
 		log_ERROR( "failed to set SNI callback" );
 	}
 
+	/* Without names from modules there is nothing to choose by, intercept
+	 * everything. */
+	moduleList.loadProxyHostNames( &contextMap.inspectHosts );
+	bool peekHello = !MainThread::inspectAll && contextMap.inspectHosts.length() > 0;
+	log_message( "uninspected hosts " << ( peekHello ? "passed through" : "intercepted" ) );
+
+	int ncpus = sysconf( _SC_NPROCESSORS_ONLN );
+	nproxy = MainThread::proxyThreads > 0 ? MainThread::proxyThreads : ncpus;
+	int nrings = MainThread::rings > 0 ? MainThread::rings : DECRYPTED_RINGS;
+
 	enterInlineNamespace();
 
-	/* Initiate listen in transparent mode. */
-	int listenFd = inetListen( 4430, true );
-	makeNonBlocking( listenFd );
+	/* Initiate listen in transparent mode. Each proxy thread gets its own
+	 * socket in one reuseport group, so an accept wakes only one thread. */
+	listenFds = new int[nproxy];
+	for ( int i = 0; i < nproxy; i++ ) {
+		listenFds[i] = inetListen( 4430, true, true );
+		makeNonBlocking( listenFds[i] );
+	}
+
+	if ( MainThread::pinProxy ) {
+		if ( nproxy == ncpus )
+			steerToCpu( listenFds[0] );
+		else
+			log_message( "proxy threads do not match CPUs, not steering connections" );
+	}
 
 	leaveInlineNamespace();
 
-	for ( int i = 0; i < 4; i++ ) {
+	startParsers();
+
+	for ( int i = 0; i < nproxy; i++ ) {
 		log_debug( DBG_PROXY, "starting proxy thread" );
 
-		ProxyThread *proxy = new ProxyThread( serverCtx, clientCtx, &contextMap, listenFd, -1, i );
+		ProxyThread *proxy = new ProxyThread( serverCtx, clientCtx, &contextMap,
+				listenFds[i], -1, i % nrings, MainThread::pinProxy ? i % ncpus : -1 );
+		proxy->parserRingset = nparser > 0 ? parserRingset : 0;
+		proxy->ktls = ktls;
+		proxy->peekHello = peekHello;
+		proxy->nparser = nparser;
 		SendsToProxy *sendsToProxy = registerSendsToProxy( proxy );
 		proxy->sendsToService = proxy->registerSendsToService( service );
 
@@ -112,11 +328,17 @@ int ListenThread::main()
 
 	selectLoop( &t );
 
-	::close( listenFd );
+	for ( int i = 0; i < nproxy; i++ )
+		::close( listenFds[i] );
+	delete[] listenFds;
+
 	log_debug( DBG_PROXY, "joining" );
 
 	join();
 
+	if ( nparser > 0 )
+		kring_shm_unlink( parserRingset );
+
 	log_debug( DBG_PROXY, "flushing TLS state" );
 
 	contextMap.close();
@@ -6,6 +6,10 @@
 #include <openssl/ssl.h>
 
 #include "listen_gen.h"
+#include <kring/kring.h>
+#include "certstore.h"
+#include "session.h"
+#include <parse/parse.h>
 #include <aapl/dlistval.h>
 #include <aapl/avlmap.h>
 #include <list>
@@ -15,25 +19,96 @@ struct ProxyThread;
 
 int sslServerNameCallback( SSL *ssl, int *al, void * );
 
+#define CTX_SHARDS 16
+
+/* Connections relayed without inspection and the bytes they moved. */
+struct BypassStats
+{
+	BypassStats()
+		: conns(0), bytes(0) {}
+
+	long conns, bytes;
+};
+
+/* TLS legs established while kernel TLS was requested, and those OpenSSL put
+ * on kernel TLS in both directions. */
+struct KtlsStats
+{
+	KtlsStats()
+		: legs(0), active(0) {}
+
+	long legs, active;
+};
+
+/* Server context for a cert name. Inserted not ready by the thread that
+ * creates it, which is the only one that does. */
+struct CtxEntry
+{
+	SSL_CTX *ctx;
+	bool ready;
+	time_t lastUse;
+};
+
+/* Lookups of ready entries take only the read lock. Threads wanting a
+ * pending entry sleep on readyCond. */
+struct CtxShard
+{
+	typedef AvlMap<std::string, CtxEntry*> Map;
+
+	CtxShard();
+
+	pthread_rwlock_t lock;
+	pthread_mutex_t waitMutex;
+	pthread_cond_t readyCond;
+	Map map;
+};
+
 struct ContextMap
 {
 	typedef DListVal<EVP_PKEY*> KeyList;
 
+	enum Lookup { Absent, Pending, Ready };
+
 	ContextMap();
 
 	void close();
 
+	/* Returns a reference the caller must free. */
 	SSL_CTX *serverCtx( ProxyThread *proxyThread, std::string host );
 
+	std::string certName( const std::string &host );
+	Lookup lookup( CtxShard *shard, const std::string &name, SSL_CTX **pctx );
+	SSL_CTX *createCtx( ProxyThread *proxyThread, CtxShard *shard,
+			const std::string &name, CtxEntry *entry );
+	void evict( CtxShard *shard );
+
+	/* Guards the key pool and serial. */
 	pthread_mutex_t mutex;
 
+	/* Key pool. Keys are taken under the mutex, the keygen thread waits on
+	 * keysWanted for the pool to drop below keyLow. */
+	pthread_cond_t keysWanted;
+	int keyLow, keyHigh;
+
 	int keysAvail();
-	void addKeys( int amt );
+	void addKey( EVP_PKEY *key );
+	bool waitKeysWanted( int timeoutSec );
 
-	typedef AvlMap<std::string, SSL_CTX*> CtxMap;
+	CtxShard shards[CTX_SHARDS];
+	long ctxMaxPerShard;
 
-	CtxMap ctxMap;
 	KeyList keyList;
+	CertStore certStore;
+
+	SessionCache sessionCache;
+	TicketKeys ticketKeys;
+	SessionStats sessionStats;
+
+	/* Host names modules ask for. Filled before the proxy threads start, read
+	 * only after. */
+	LookupSet inspectHosts;
+	BypassStats bypassStats;
+	KtlsStats ktlsStats;
 
 	EVP_PKEY *capkey;
 	X509 *cacert;
@@ -49,7 +124,8 @@ struct ListenThread
 {
 	ListenThread( ServiceThread *service )
 	:
-		service(service)
+		service(service),
+		statsLogged(0)
 	{
 		recvRequiresSignal = true;
 	}
@@ -63,14 +139,34 @@ struct ListenThread
 
 	std::list<SendsToProxy*> proxySends;
 
+	int nproxy;
+	int *listenFds;
+
+	/* Parser threads and the ringset proxies write decrypted data to. None
+	 * when parsing inline. */
+	std::list<SendsToParser*> parserSends;
+	int nparser;
+	char parserRingset[KRING_NLEN];
+
+	void startParsers();
+
 	/* For network namespace enter/leave. */
 	int origNsFd, enterNsFd;
 
 	int main();
 	void recvShutdown( Message::Shutdown *msg );
 
+	/* Counts as of the last log. */
+	SessionStats statsPrev;
+	BypassStats bypassPrev;
+	KtlsStats ktlsPrev;
+	time_t statsLogged;
+
+	virtual void handleTimer();
+
 	void enterInlineNamespace();
 	void leaveInlineNamespace();
+	void steerToCpu( int listenFd );
 };
 
 #endif /* _LISTEN_H */
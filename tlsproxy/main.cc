@@ -1,6 +1,7 @@
 #include "main.h"
 #include "listen.h"
 #include "service.h"
+#include "keygen.h"
 #include "genf.h"
 #include <parse/parse.h>
 
@@ -30,14 +31,15 @@ void makeCert( EVP_PKEY *capkey, X509 *cacert, BIGNUM *serial,
 		"Development", cert, "info@colm.net", 0
 	};
 
-	/* If no new key was supplied, create it. */
+	/* If the key pool was empty, create one here. This is on the proxy
+	 * thread, so it stalls the connections it handles. */
 	if ( *ppkey == 0 ) {
-		log_ERROR( "need to make genrsa in make-cert" );
-		*ppkey = genrsa( 2048 );
+		log_ERROR( "key pool empty, generating key inline for " << cert );
+		*ppkey = genkey( MainThread::ecdsa );
 	}
 
 	/* Sign. */
-	*px509 = sign_cert( capkey, cacert, serial, *ppkey, nameTypes, nameValues, 365 );
+	*px509 = sign_cert( capkey, cacert, serial, *ppkey, nameTypes, nameValues, 365, cert );
 }
 
 void makeCa()
@@ -71,6 +73,7 @@ void initTls()
 	chdir( PKGSTATEDIR );
 
 	mkdir( "CA",      0777 );
+	mkdir( "CA/forged", 0700 );
 	mkdir( "certs",   0777 );
 	mkdir( "private", 0777 );
 
@@ -103,19 +106,6 @@ int MainThread::funcInitTls()
 	return 0;
 }
 
-void MainThread::handleTimer()
-{
-	const int minPoolSize = 15;
-
-	/* Keep the key pool well-stocked. */
-	int avail = listen->contextMap.keysAvail();
-	if ( avail < minPoolSize ) {
-		int add = minPoolSize - avail;
-		log_debug( DBG_PROXY, "adding " << add << " keys to the pool of available keys" );
-		listen->contextMap.addKeys( add );
-	}
-}
-
 int MainThread::main()
 {
 	if ( makeCa )
@@ -136,20 +126,17 @@ int MainThread::main()
 
 	service = new ServiceThread;
 	listen = new ListenThread( service );
+	keygen = new KeygenThread( &listen->contextMap );
 
 	SendsToListen *sendsToListen = registerSendsToListen( listen );
 	SendsToService *sendsToService = registerSendsToService( service );
+	SendsToKeygen *sendsToKeygen = registerSendsToKeygen( keygen );
 
+	create( keygen );
 	create( listen );
 	create( service );
 
-	handleTimer();
-
-	struct timeval t;
-	t.tv_sec = 1;
-	t.tv_usec = 0;
-
-	signalLoop( &t );
+	signalLoop();
 
 	log_message( "sending shutdown messages" );
 
@@ -159,6 +146,9 @@ int MainThread::main()
 	sendsToService->openShutdown();
 	sendsToService->send( true );
 
+	sendsToKeygen->openShutdown();
+	sendsToKeygen->send();
+
 	join();
 
 	tlsShutdown();
@@ -9,10 +9,9 @@
 struct MainThread
 	: public MainGen
 {
-	void handleTimer();
-
 	ListenThread *listen;
 	ServiceThread *service;
+	KeygenThread *keygen;
 
 	int funcCert();
 	int funcMakeCa();
@@ -22,13 +21,15 @@ struct MainThread
 };
 
 EVP_PKEY *genrsa( int num );
+EVP_PKEY *genec();
+EVP_PKEY *genkey( bool ecdsa );
 int genrsa_file( char *outfile, int num );
 int make_ca_cert( char *keyfile, char *outfile, const char **ne_types,
 		const char **ne_values, int days );
 
 int cert_req( char *keyfile, char *outfile, char *subj );
 X509 *sign_cert( EVP_PKEY *cakey, X509 *cacert, BIGNUM *serial, EVP_PKEY *ppkey,
-		const char **ne_types, const char **ne_values, long days );
+		const char **ne_types, const char **ne_values, long days, const char *altName );
 
 void makeCert( EVP_PKEY *capkey, X509 *cacert, BIGNUM *serial, EVP_PKEY **ppkey, X509 **px509, const String &cert );
 
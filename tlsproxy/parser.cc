@@ -0,0 +1,55 @@
+#include "parser.h"
+#include "main.h"
+
+#include <parse/module.h>
+
+#include "genf.h"
+
+#include <errno.h>
+
+void ParserThread::configureContext( Context *ctx )
+{
+	moduleList.proxyConfigureContext( this, ctx );
+}
+
+void ParserThread::recvShutdown( Message::Shutdown *msg )
+{
+	log_debug( DBG_PROXY, "received shutdown" );
+	breakLoop();
+}
+
+int ParserThread::main()
+{
+	struct kring_user kring;
+
+	int r = kring_open( &kring, KRING_DATA, ringset, KRING_DECRYPTED, ringId, KRING_READ );
+	if ( r < 0 ) {
+		log_ERROR( "parser kring open failed: " << kdata_error( &kring, r ) );
+		return -1;
+	}
+
+	loopBegin();
+
+	while ( true ) {
+		poll();
+
+		if ( !loopContinue() )
+			break;
+
+		/* Drain, then sleep until a proxy thread writes. */
+		while ( kdata_avail( &kring ) ) {
+			struct kdata_decrypted dcy;
+			kdata_next_decrypted( &kring, &dcy );
+
+			handler.decrypted( dcy.id, dcy.type, dcy.host, dcy.bytes, dcy.len );
+		}
+
+		int r = kdata_read_wait( &kring );
+		if ( r < 0 )
+			log_ERROR( "parser kring wait failed: " << strerror( errno ) );
+	}
+
+	kring_close( &kring );
+
+	return 0;
+}
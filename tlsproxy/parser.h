@@ -0,0 +1,46 @@
+#ifndef _PARSER_H
+#define _PARSER_H
+
+#include <kring/kring.h>
+#include <parse/parse.h>
+
+#include "parser_gen.h"
+
+/*
+ * Parses decrypted data off the proxy threads. Proxy threads write each
+ * connection's data to parser ring connId % nparser of a process-private
+ * shared memory ringset. When a parser falls behind, the writers overwrite
+ * what it has not read. That data is dropped, and forwarding is never
+ * delayed.
+ */
+struct ParserThread
+:
+	public ParserGen,
+	public NetpConfigure
+{
+	ParserThread( const char *ringset, int ringId )
+	:
+		ringset(ringset),
+		ringId(ringId),
+		handler(this)
+	{
+		recvRequiresSignal = true;
+
+		NetpConfigure::stashErrors = MainGen::stashErrors;
+		NetpConfigure::stashAll = MainGen::stashAll;
+	}
+
+	const char *ringset;
+	int ringId;
+
+	Handler handler;
+	SendsPassthru *sendsPassthru;
+
+	virtual void configureContext( Context *ctx );
+
+	void recvShutdown( Message::Shutdown *msg );
+
+	int main();
+};
+
+#endif /* _PARSER_H */
@@ -15,8 +15,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 
 #include "listen.h"
 #include "genf.h"
@@ -26,6 +28,15 @@
 
 #define DAEMON_DAEMON_TIMEOUT 100
 
+#define KEY_POOL_LOW 16
+#define KEY_POOL_HIGH 64
+
+#define CERT_STORE_MAX 10000
+#define CTX_CACHE_MAX 4096
+
+/* Most a spliced read moves at once, a default pipe's capacity. */
+#define SPLICE_LEN ( 64 * 1024 )
+
 const char verifyResponse[] =
 	"HTTP/1.1 422 Unprocessable Entity\r\n"
 	"\r\n"
@@ -38,9 +49,17 @@ void ProxyThread::configureContext( Context *ctx )
 
 ContextMap::ContextMap()
 :
+	keyLow( MainThread::keyPoolLow > 0 ? MainThread::keyPoolLow : KEY_POOL_LOW ),
+	keyHigh( MainThread::keyPoolHigh > 0 ? MainThread::keyPoolHigh : KEY_POOL_HIGH ),
+	ctxMaxPerShard( ( MainThread::ctxCacheMax > 0 ? MainThread::ctxCacheMax :
+			CTX_CACHE_MAX ) / CTX_SHARDS + 1 ),
 	nextConId(0)
 {
 	pthread_mutex_init( &mutex, 0 );
+	pthread_cond_init( &keysWanted, 0 );
+
+	if ( keyHigh < keyLow )
+		keyHigh = keyLow;
 
 	String caKeyFile = String( PKGSTATEDIR "/CA/cakey.pem" );
 	String caCertFile = String( PKGSTATEDIR "/CA/cacert.pem" );
@@ -50,6 +69,9 @@ ContextMap::ContextMap()
 	cacert = loadCert( caCertFile );
 
 	serial = loadSerial( serialFile );
+
+	certStore.open( cacert, MainThread::certStoreMax > 0 ?
+			MainThread::certStoreMax : CERT_STORE_MAX );
 }
 
 void ContextMap::close()
@@ -68,95 +90,251 @@ int ContextMap::keysAvail()
 	return avail;
 }
 
-void ContextMap::addKeys( int amt )
+void ContextMap::addKey( EVP_PKEY *key )
 {
-	for ( int i = 0; i < amt; i++ ) {
-		EVP_PKEY *key = genrsa( 2048 );
-
-		pthread_mutex_lock( &mutex );
-		keyList.append( key );
-		pthread_mutex_unlock( &mutex );
-	}
+	pthread_mutex_lock( &mutex );
+	keyList.append( key );
+	pthread_mutex_unlock( &mutex );
 }
 
-SSL_CTX *ContextMap::serverCtx( ProxyThread *proxyThread, std::string host )
+/* True if the pool is below the low mark, waiting up to timeoutSec for it to
+ * get there. */
+bool ContextMap::waitKeysWanted( int timeoutSec )
 {
-	bool create = false, store = false;
-	SSL_CTX *rtnVal = 0;
-	BIGNUM *useSerial = 0;
-	EVP_PKEY *pkey = 0;
-	X509 *x509;
+	struct timespec ts;
+	clock_gettime( CLOCK_REALTIME, &ts );
+	ts.tv_sec += timeoutSec;
 
-	/* Lock. */
 	pthread_mutex_lock( &mutex );
+	if ( keyList.length() >= keyLow )
+		pthread_cond_timedwait( &keysWanted, &mutex, &ts );
+	bool wanted = keyList.length() < keyLow;
+	pthread_mutex_unlock( &mutex );
+
+	return wanted;
+}
+
+CtxShard::CtxShard()
+{
+	pthread_rwlock_init( &lock, 0 );
+	pthread_mutex_init( &waitMutex, 0 );
+	pthread_cond_init( &readyCond, 0 );
+}
+
+static void ctxRef( SSL_CTX *ctx )
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_CTX_up_ref( ctx );
+#else
+	CRYPTO_add( &ctx->references, 1, CRYPTO_LOCK_SSL_CTX );
+#endif
+}
+
+static time_t ctxNow()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+	return ts.tv_sec;
+}
+
+static unsigned long hashName( const std::string &name )
+{
+	unsigned long h = 5381;
+	for ( std::string::const_iterator c = name.begin(); c != name.end(); c++ )
+		h = h * 33 + (unsigned char)*c;
+	return h;
+}
+
+/* With wildcard certs on, a host shares the cert of its parent domain. Only
+ * when the parent looks like a registered domain: three or more labels, or a
+ * TLD longer than two characters, or a second level label longer than three.
+ * This keeps clear of suffixes like co.uk, which clients won't accept a
+ * wildcard for. */
+std::string ContextMap::certName( const std::string &host )
+{
+	if ( !MainThread::wildcardCerts )
+		return host;
+
+	std::string::size_type first = host.find( '.' );
+	if ( first == std::string::npos || first == 0 )
+		return host;
+
+	std::string parent = host.substr( first + 1 );
+	std::string::size_type last = parent.rfind( '.' );
+	if ( last == std::string::npos || last == 0 || last + 1 == parent.size() )
+		return host;
 
-	CtxMap::El *el = ctxMap.find( host );
-	if ( el == 0 ) {
-		/* We will create and store it, since we were the first to request it.
-		 * */
-		create = store = true;
-		ctxMap.insert( host, 0, &el );
+	bool twoLabels = parent.find( '.' ) == last;
+	if ( twoLabels && parent.size() - last - 1 <= 2 && last <= 3 )
+		return host;
+
+	return "*." + parent;
+}
+
+ContextMap::Lookup ContextMap::lookup( CtxShard *shard,
+		const std::string &name, SSL_CTX **pctx )
+{
+	Lookup result = Absent;
+
+	pthread_rwlock_rdlock( &shard->lock );
+
+	CtxShard::Map::El *el = shard->map.find( name );
+	if ( el != 0 ) {
+		CtxEntry *entry = el->value;
+		if ( entry->ready ) {
+			/* Reference taken under the lock, eviction may free the map's
+			 * as soon as we release it. Only write the LRU time if it
+			 * changed, keeps the line shared between readers. */
+			ctxRef( entry->ctx );
+			*pctx = entry->ctx;
+
+			time_t now = ctxNow();
+			if ( __atomic_load_n( &entry->lastUse, __ATOMIC_RELAXED ) != now )
+				__atomic_store_n( &entry->lastUse, now, __ATOMIC_RELAXED );
+
+			result = Ready;
+		}
+		else {
+			result = Pending;
+		}
 	}
-	else {
-		/* A record is present in the map. */
-		if ( el->value != 0 ) {
-			/* Value is also there, we can use it. Value is there. We can
-			 * return it. */
-			rtnVal = el->value;
+
+	pthread_rwlock_unlock( &shard->lock );
+
+	return result;
+}
+
+SSL_CTX *ContextMap::serverCtx( ProxyThread *proxyThread, std::string host )
+{
+	std::string name = certName( host );
+	CtxShard *shard = &shards[hashName( name ) % CTX_SHARDS];
+
+	while ( true ) {
+		SSL_CTX *ctx = 0;
+		Lookup l = lookup( shard, name, &ctx );
+		if ( l == Ready )
+			return ctx;
+
+		if ( l == Absent ) {
+			/* Insert a pending entry. If we get it in, we are the one
+			 * creating it. Otherwise someone beat us, look again. */
+			pthread_rwlock_wrlock( &shard->lock );
+
+			CtxEntry *entry = 0;
+			if ( shard->map.find( name ) == 0 ) {
+				entry = new CtxEntry;
+				entry->ctx = 0;
+				entry->ready = false;
+				entry->lastUse = 0;
+				shard->map.insert( name, entry );
+			}
+
+			pthread_rwlock_unlock( &shard->lock );
+
+			if ( entry != 0 )
+				return createCtx( proxyThread, shard, name, entry );
 		}
 		else {
-			/* If the value is null then some other thread is also creating it.
-			 * it will be the one to store it. */
-			create = true;
-			store = false;
+			/* Another thread is creating it. Check again holding the wait
+			 * mutex, so we cannot miss the broadcast. */
+			log_debug( DBG_PROXY, "waiting for SSL context for " << name );
+
+			pthread_mutex_lock( &shard->waitMutex );
+			l = lookup( shard, name, &ctx );
+			if ( l == Pending )
+				pthread_cond_wait( &shard->readyCond, &shard->waitMutex );
+			pthread_mutex_unlock( &shard->waitMutex );
+
+			if ( l == Ready )
+				return ctx;
 		}
 	}
+}
+
+SSL_CTX *ContextMap::createCtx( ProxyThread *proxyThread, CtxShard *shard,
+		const std::string &name, CtxEntry *entry )
+{
+	BIGNUM *useSerial = 0;
+	EVP_PKEY *pkey = 0;
+	X509 *x509 = 0;
+
+	log_debug( DBG_PROXY, "creating SSL context for " << name );
+
+	/* Use the cert from a previous run if there is one, otherwise make one.
+	 * We don't do this under lock. */
+	bool generated = false;
+	if ( !certStore.load( name, &pkey, &x509 ) ) {
+		pthread_mutex_lock( &mutex );
 
-	if ( create ) {
 		useSerial = BN_dup( serial );
+		BN_add_word( serial, 1 );
 
-		/* FIXME: could run out here. Need to make them when the cache is
-		 * empty. */
+		/* Normally there is a key in the pool. If it ran dry, makeCert
+		 * generates one inline. */
 		if ( keyList.length() > 0 ) {
 			pkey = keyList.head->value;
 			delete keyList.detachFirst();
 		}
 
-		BN_add_word( serial, 1 );
-	}
+		if ( keyList.length() < keyLow )
+			pthread_cond_signal( &keysWanted );
 
-	/* Unlock. */
-	pthread_mutex_unlock( &mutex );
+		pthread_mutex_unlock( &mutex );
 
-	if ( create ) {
-		log_debug( DBG_PROXY, "creating SSL context ourselves" );
+		makeCert( capkey, cacert, useSerial, &pkey, &x509, name.c_str() );
+		certStore.save( name, pkey, x509 );
+		generated = true;
+	}
 
-		/* Our job to create the cert. We don't do this under lock. */
-		makeCert( capkey, cacert, useSerial, &pkey, &x509, host.c_str() );
+	SSL_CTX *ctx = proxyThread->sslCtxServer( pkey, x509 );
 
-		SSL_CTX *ctx = proxyThread->sslCtxServer( pkey, x509 );
+	log_debug( DBG_PROXY, "finished creating SSL context" );
 
-		log_debug( DBG_PROXY, "finished creating SSL context" );
+	/* The map holds one reference, the caller gets another. */
+	ctxRef( ctx );
 
-		/* Update the element. So new requests see the context. Afterward we
-		 * can notify any other proxy threads of the completed creation. Once
-		 * this critical section completes we can be sure that the notify array
-		 * will not be touched again. Safe to iterate it not under lock. */
-		if ( store ) {
-			pthread_mutex_lock( &mutex );
-			el->value = ctx;
-			pthread_mutex_unlock( &mutex );
-		}
+	/* Publish, then wake the waiters. */
+	pthread_rwlock_wrlock( &shard->lock );
+	entry->ctx = ctx;
+	entry->ready = true;
+	entry->lastUse = ctxNow();
+	if ( shard->map.length() > ctxMaxPerShard )
+		evict( shard );
+	pthread_rwlock_unlock( &shard->lock );
 
-		rtnVal = ctx;
+	pthread_mutex_lock( &shard->waitMutex );
+	pthread_cond_broadcast( &shard->readyCond );
+	pthread_mutex_unlock( &shard->waitMutex );
 
-		/* Notify service thread. */
+	/* Notify service thread. */
+	if ( generated ) {
 		Message::CertGenerated *msg = proxyThread->sendsToService->openCertGenerated();
-		msg->set_host( proxyThread->sendsToService->writer, host.c_str() );
+		msg->set_host( proxyThread->sendsToService->writer, name.c_str() );
 		proxyThread->sendsToService->send();
 	}
 
-	return rtnVal;
+	return ctx;
+}
+
+/* Called holding the shard's write lock. Drops the least recently used ready
+ * entry. Connections using its context hold their own references. */
+void ContextMap::evict( CtxShard *shard )
+{
+	CtxShard::Map::El *oldest = 0;
+	for ( CtxShard::Map::Iter el = shard->map; el.lte(); el++ ) {
+		if ( el->value->ready && ( oldest == 0 ||
+				el->value->lastUse < oldest->value->lastUse ) )
+			oldest = el;
+	}
+
+	if ( oldest != 0 ) {
+		log_debug( DBG_PROXY, "evicting SSL context for " << oldest->key );
+
+		CtxEntry *entry = oldest->value;
+		shard->map.remove( oldest );
+		SSL_CTX_free( entry->ctx );
+		delete entry;
+	}
 }
 
 long ContextMap::connId()
@@ -181,11 +359,13 @@ char *FdDesc::readTo()
 void FdDesc::readIn( int amt )
 {
 	wbList.tail->tail += amt;
+	queued += amt;
+	lastRead = amt;
 }
 
 char *FdDesc::writeFrom()
 {
-	return wbList.head->data + wbList.tail->head;
+	return wbList.head->data + wbList.head->head;
 }
 
 int FdDesc::writeAvail()
@@ -193,21 +373,58 @@ int FdDesc::writeAvail()
 	return wbList.length() == 0 ? 0 : wbList.head->tail - wbList.head->head;
 }
 
+WriteBlock *BlockPool::get( SizeClass sizeClass )
+{
+	WriteBlock *block = freeList[sizeClass].head;
+	if ( block == 0 )
+		return new WriteBlock( blockLen( sizeClass ) );
+
+	freeList[sizeClass].detach( block );
+	block->head = block->tail = 0;
+	return block;
+}
+
+void BlockPool::put( WriteBlock *block )
+{
+	SizeClass sizeClass = block->blocklen == SMALL_BLOCK_LEN ? Small : Large;
+	if ( freeList[sizeClass].length() >= BLOCK_POOL_MAX )
+		delete block;
+	else
+		freeList[sizeClass].prepend( block );
+}
+
+BlockPool *FdDesc::pool()
+{
+	return &proxyConn->proxyThread->blockPool;
+}
+
+/* A read that filled a small block suggests more is coming. */
 int FdDesc::addSpace()
 {
-	wbList.append( new WriteBlock );
+	wbList.append( pool()->get( lastRead < SMALL_BLOCK_LEN ?
+			BlockPool::Small : BlockPool::Large ) );
 	return wbList.tail->blocklen;
 }
 
+/* A read that produced nothing gives back the block added for it, so an idle
+ * connection holds none. */
+void FdDesc::dropSpace()
+{
+	WriteBlock *tail = wbList.tail;
+	if ( tail != 0 && tail->tail == 0 ) {
+		wbList.detach( tail );
+		pool()->put( tail );
+	}
+}
+
 void FdDesc::consume( int amount )
 {
 	WriteBlock *head = wbList.head;
+	queued -= amount;
 	if ( head->head + amount >= head->tail ) {
 		/* Consumed the whole head. */
 		wbList.detach( head );
-
-		/* The delete will clean. */
-		delete head;
+		pool()->put( head );
 	}
 	else {
 		/* Consume part of the head. */
@@ -215,6 +432,21 @@ void FdDesc::consume( int amount )
 	}
 }
 
+/* Connection is done, return the queued blocks. */
+void FdDesc::release()
+{
+	while ( wbList.head != 0 )
+		pool()->put( wbList.detachFirst() );
+	queued = 0;
+
+	if ( pipe[0] >= 0 ) {
+		::close( pipe[0] );
+		::close( pipe[1] );
+		pipe[0] = pipe[1] = -1;
+	}
+	piped = 0;
+}
+
 std::ostream &operator<<( std::ostream &out, FdDesc *fdDesc )
 {
 	out << ( fdDesc->type == FdDesc::Client ?
@@ -277,8 +509,9 @@ void ProxyThread::serverName( SelectFd *selectFd, const char *host )
 	/* Retreive or create the CTX. */
 	SSL_CTX *newCtx = contextMap->serverCtx( this, host );
 
-	/* Stash and carry on. */
+	/* Stash and carry on. The SSL takes its own reference. */
 	SSL_set_SSL_CTX( selectFd->ssl, newCtx );
+	SSL_CTX_free( newCtx );
 
 	fdDesc->haveHostname = true;
 	fdDesc->hostname = host;
@@ -309,35 +542,326 @@ void ProxyConnection::failure( FailType failType )
 {
 	if ( failType == SslPeerFailedVerify )
 		proxyThread->sslPeerFailedVerify( selectFd );
+	else if ( failType == AsyncConnectFailed && fdDesc->passthrough ) {
+		/* The client's side has reads off until the origin connects, nothing
+		 * else would close it. Shutting down from there closes this fd too,
+		 * leave it out of Connection::close. */
+		proxyThread->proxyShutdown( fdDesc->other->proxyConn->selectFd );
+		selectFd->fd = -1;
+	}
 	else {
 		// probably: proxyShutdown( fd );
 	}
 }
 
+/* Host and port of the origin a connected socket goes to. */
+static std::string originKey( const std::string &host, int fd )
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	int port = 0;
+
+	if ( getpeername( fd, (struct sockaddr*)&addr, &len ) == 0 ) {
+		if ( addr.ss_family == AF_INET )
+			port = ntohs( ((struct sockaddr_in*)&addr)->sin_port );
+		else if ( addr.ss_family == AF_INET6 )
+			port = ntohs( ((struct sockaddr_in6*)&addr)->sin6_port );
+	}
+
+	char buf[16];
+	sprintf( buf, ":%d", port );
+	return host + buf;
+}
+
+static void countResumption( SSL *ssl, long *hits, long *misses )
+{
+	__atomic_add_fetch( SSL_session_reused( ssl ) ? hits : misses, 1, __ATOMIC_RELAXED );
+}
+
+static bool ktlsBoth( SSL *ssl )
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	return BIO_get_ktls_send( SSL_get_wbio( ssl ) ) &&
+			BIO_get_ktls_recv( SSL_get_rbio( ssl ) );
+#else
+	return false;
+#endif
+}
+
+/* A leg finished its handshake with kernel TLS requested. */
+static void countKtls( ContextMap *contextMap, SSL *ssl )
+{
+	KtlsStats *stats = &contextMap->ktlsStats;
+	__atomic_add_fetch( &stats->legs, 1, __ATOMIC_RELAXED );
+	if ( ktlsBoth( ssl ) )
+		__atomic_add_fetch( &stats->active, 1, __ATOMIC_RELAXED );
+}
+
 void ProxyConnection::notifyAccept( )
 {
+	if ( selectFd->ssl == 0 ) {
+		/* Accepted plain, the ClientHello decides. */
+		fdDesc->peeking = true;
+		fdDesc->peekStart = time(0);
+		proxyThread->peekList.push_back( fdDesc );
+		return;
+	}
+
 	selectFd->tlsWantRead = true;
 
+	SessionStats *stats = &proxyThread->contextMap->sessionStats;
+	countResumption( selectFd->ssl, &stats->serverHits, &stats->serverMisses );
+
+	if ( proxyThread->ktls ) {
+		countKtls( proxyThread->contextMap, selectFd->ssl );
+		proxyThread->maybeSplice( fdDesc );
+	}
+
 	/* Immediately try to read. Is this necessary? IE will the connect
 	 * leave data on the FD or buffer it in? */
 	proxyThread->sslReadReady( selectFd );
 }
 
 /* Maybe initiate the TLS conenction to the server. Can happen when connected
- * and when we have a hostname from the client. */
+ * and when we have a hostname from the client. A passthrough connection
+ * starts relaying instead. */
 void ProxyThread::maybeStartTlsClient( FdDesc *clientDesc )
 {
 	FdDesc *serverDesc = clientDesc->other;
 	if ( clientDesc->connected && serverDesc->haveHostname ) {
+		if ( serverDesc->passthrough ) {
+			startPassthrough( clientDesc );
+			return;
+		}
+
 		log_debug( DBG_PROXY, "starting TLS connection to server: " << serverDesc->hostname );
 
-		startTlsClient( clientCtx, clientDesc->proxyConn->selectFd, serverDesc->hostname.c_str() );
+		SelectFd *selectFd = clientDesc->proxyConn->selectFd;
+		startTlsClient( clientCtx, selectFd, serverDesc->hostname.c_str() );
+
+		/* Offer the session from the last connection to this origin. */
+		clientDesc->sessionKey = originKey( serverDesc->hostname, selectFd->fd );
+		SSL_SESSION *sess = contextMap->sessionCache.get( clientDesc->sessionKey );
+		if ( sess != 0 ) {
+			SSL_set_session( selectFd->ssl, sess );
+			SSL_SESSION_free( sess );
+		}
+
+		selectFd->type = SelectFd::Connection;
+		selectFd->state = SelectFd::TlsConnect;
+	}
+}
+
+/* Length of the TLS record holding a ClientHello, more than len if it is not
+ * all here. Sets host from the SNI when it is. Zero if the data is not a
+ * ClientHello in a single record. */
+static int helloServerName( const unsigned char *data, int len, std::string *host )
+{
+	if ( len < 5 )
+		return 5;
+
+	/* Handshake record. */
+	if ( data[0] != 0x16 || data[1] != 0x03 )
+		return 0;
+
+	int recLen = 5 + ( data[3] << 8 | data[4] );
+	if ( recLen > HELLO_PEEK_LEN )
+		return 0;
+	if ( len < recLen )
+		return recLen;
+
+	const unsigned char *p = data + 5, *end = data + recLen;
+
+	/* ClientHello, all of it in this record. */
+	if ( end - p < 4 || p[0] != 0x01 )
+		return 0;
+	int hsLen = p[1] << 16 | p[2] << 8 | p[3];
+	p += 4;
+	if ( hsLen > end - p )
+		return 0;
+	end = p + hsLen;
+
+	/* Version, random, session id, cipher suites, compression methods. */
+	if ( end - p < 35 )
+		return 0;
+	p += 34;
+	p += 1 + p[0];
+	if ( end - p < 2 )
+		return 0;
+	p += 2 + ( p[0] << 8 | p[1] );
+	if ( end - p < 1 )
+		return 0;
+	p += 1 + p[0];
+
+	/* No extensions. */
+	if ( end - p < 2 )
+		return recLen;
+
+	int extLen = p[0] << 8 | p[1];
+	p += 2;
+	if ( extLen > end - p )
+		return 0;
+	end = p + extLen;
+
+	while ( end - p >= 4 ) {
+		int type = p[0] << 8 | p[1];
+		int len = p[2] << 8 | p[3];
+		p += 4;
+		if ( len > end - p )
+			return 0;
+
+		if ( type == TLSEXT_TYPE_server_name ) {
+			/* Server name list, the first entry of type host_name. */
+			const unsigned char *n = p + 2, *nend = p + len;
+			while ( nend - n >= 3 ) {
+				int nameLen = n[1] << 8 | n[2];
+				if ( nameLen > nend - n - 3 )
+					return 0;
+
+				if ( n[0] == TLSEXT_NAMETYPE_host_name ) {
+					host->clear();
+					for ( int i = 0; i < nameLen; i++ )
+						host->push_back( tolower( n[3 + i] ) );
+					break;
+				}
+				n += 3 + nameLen;
+			}
+			break;
+		}
+
+		p += len;
+	}
+
+	return recLen;
+}
+
+/* Accepted connection readable before the TLS accept. Peek at the ClientHello
+ * and either pass the connection through or intercept it. */
+void ProxyThread::helloReady( SelectFd *fd )
+{
+	FdDesc *fdDesc = fdLocal( fd );
+	unsigned char hello[HELLO_PEEK_LEN];
+
+	ssize_t n = recv( fd->fd, hello, sizeof(hello), MSG_PEEK );
+	if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+		return;
+
+	/* At EOF the socket stays readable despite the low water mark and the
+	 * peek returns the same bytes. */
+	if ( n <= 0 || n == fdDesc->helloPeeked ) {
+		log_debug( DBG_PROXY, fdDesc << ": closed before ClientHello" );
+		proxyShutdown( fd );
+		return;
+	}
+	fdDesc->helloPeeked = n;
+
+	std::string host;
+	int recLen = helloServerName( hello, n, &host );
+	if ( recLen > n ) {
+		/* Came in pieces. Don't wake until the record is all here. */
+		if ( recLen != fdDesc->helloWant ) {
+			setsockopt( fd->fd, SOL_SOCKET, SO_RCVLOWAT, &recLen, sizeof(recLen) );
+			fdDesc->helloWant = recLen;
+		}
+		return;
+	}
+
+	if ( fdDesc->helloWant > 0 ) {
+		int one = 1;
+		setsockopt( fd->fd, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one) );
+	}
+
+	fdDesc->peeking = false;
+
+	if ( host.empty() || contextMap->inspectHosts.find( host.c_str(), host.size() ) >= 0 ) {
+		startIntercept( fd );
+		return;
+	}
+
+	log_debug( DBG_PROXY, fdDesc << ": passing through " << host );
+
+	/* Nothing more from the client until the origin is connected. */
+	fd->wantRead = false;
+
+	fdDesc->haveHostname = true;
+	fdDesc->hostname = host;
+	fdDesc->passthrough = fdDesc->other->passthrough = true;
+
+	maybeStartTlsClient( fdDesc->other );
+}
+
+/* Close connections that are taking too long to send a ClientHello. */
+void ProxyThread::handleTimer()
+{
+	time_t now = time(0);
 
-		clientDesc->proxyConn->selectFd->type = SelectFd::Connection;
-		clientDesc->proxyConn->selectFd->state = SelectFd::TlsConnect;
+	std::list<FdDesc*>::iterator i = peekList.begin();
+	while ( i != peekList.end() ) {
+		FdDesc *fdDesc = *i;
+		SelectFd *fd = fdDesc->proxyConn->selectFd;
+
+		if ( !fdDesc->peeking || fd->closed ) {
+			i = peekList.erase( i );
+		}
+		else if ( now - fdDesc->peekStart >= HELLO_TIMEOUT ) {
+			log_debug( DBG_PROXY, fdDesc << ": no ClientHello in time, closing" );
+			proxyShutdown( fd );
+			i = peekList.erase( i );
+		}
+		else {
+			i++;
+		}
 	}
 }
 
+/* Go on with the TLS accept the listener would have started. The fd is
+ * already on the select list, which startTlsServer adds it to. */
+void ProxyThread::startIntercept( SelectFd *fd )
+{
+	ProxyConnection *pc = static_cast<ProxyConnection*>( fd->local );
+
+	selectFdList.detach( fd );
+
+	pc->tlsConnect = true;
+	pc->sslCtx = serverCtx;
+	startTlsServer( serverCtx, fd );
+	fd->type = SelectFd::Connection;
+	fd->state = SelectFd::TlsAccept;
+}
+
+/* Both sides connected and the host is not inspected. Relay the raw TCP
+ * stream with splice. The sides take the TLS established state with no SSL,
+ * so the splice code's want flags drive select. */
+void ProxyThread::startPassthrough( FdDesc *clientDesc )
+{
+	FdDesc *serverDesc = clientDesc->other;
+
+	if ( pipe2( clientDesc->pipe, O_NONBLOCK | O_CLOEXEC ) < 0 ||
+			pipe2( serverDesc->pipe, O_NONBLOCK | O_CLOEXEC ) < 0 )
+	{
+		log_ERROR( "passthrough pipe creation failed: " << strerror(errno) );
+		proxyShutdown( serverDesc->proxyConn->selectFd );
+		return;
+	}
+
+	FdDesc *descs[2] = { serverDesc, clientDesc };
+	for ( int i = 0; i < 2; i++ ) {
+		SelectFd *fd = descs[i]->proxyConn->selectFd;
+		fd->type = SelectFd::Connection;
+		fd->state = SelectFd::TlsEstablished;
+		fd->tlsEstablished = true;
+		fd->wantRead = fd->wantWrite = false;
+		fd->tlsWantRead = true;
+		fd->tlsWantWrite = false;
+		descs[i]->spliced = true;
+	}
+
+	__atomic_add_fetch( &contextMap->bypassStats.conns, 1, __ATOMIC_RELAXED );
+
+	/* The ClientHello is waiting. */
+	spliceRead( serverDesc->proxyConn->selectFd );
+}
+
 void ProxyThread::sslPeerFailedVerify( SelectFd *fd )
 {
 	/* Need to propagate the verify failure to the client connection.
@@ -408,6 +932,12 @@ void ProxyThread::connectComplete( SelectFd *fd )
 	else {
 		log_debug( DBG_PROXY, "TLS connect completed" );
 
+		SessionStats *stats = &contextMap->sessionStats;
+		countResumption( fd->ssl, &stats->clientHits, &stats->clientMisses );
+
+		if ( ktls )
+			countKtls( contextMap, fd->ssl );
+
 		/* Go into the established state and start reading. We will buffer data
 		 * until the other half enteres established as well. */
 		fd->type = SelectFd::Connection;
@@ -425,12 +955,23 @@ void ProxyThread::connectComplete( SelectFd *fd )
 
 int ProxyThread::kdata( long id, int type, const char *remoteHost, char *data, int len )
 {
-	handler.decrypted( id, type, remoteHost, (unsigned char*)data, len );
+	/* All of a connection's data goes to the same parser. */
+	if ( nparser > 0 )
+		kdata_write_decrypted( &parserRings[id % nparser], id, type, remoteHost, data, len );
+	else
+		handler.decrypted( id, type, remoteHost, (unsigned char*)data, len );
 	return 0;
 }
 
 int ProxyThread::proxyWrite( FdDesc *fdDesc )
 {
+	/* Spliced data is older than anything in wbList. */
+	if ( fdDesc->piped > 0 ) {
+		spliceWrite( fdDesc );
+		if ( fdDesc->piped > 0 )
+			return 0;
+	}
+
 	/* If not in the established state we cannot write anything. Just queue.
 	 * Just indicate we want a write and wait the established state. This is
 	 * only imporant when called from a read on the other half. */
@@ -484,6 +1025,18 @@ int ProxyThread::proxyWrite( FdDesc *fdDesc )
 		}
 	}
 
+	/* Enough drained that the other side can be read again. It may have data
+	 * buffered inside SSL, which select won't report, so read now. */
+	FdDesc *source = fdDesc->other;
+	if ( source->readPaused && fdDesc->queued <= connQueueMax / 2 &&
+			fdDesc->piped == 0 && !source->proxyConn->selectFd->closed )
+	{
+		log_debug( DBG_PROXY, source << ": resuming read" );
+		source->readPaused = false;
+		source->proxyConn->selectFd->tlsWantRead = true;
+		sslReadReady( source->proxyConn->selectFd );
+	}
+
 	return -1;
 }
 
@@ -491,9 +1044,21 @@ bool ProxyThread::sslReadReady( SelectFd *fd )
 {
 	FdDesc *fdDesc = fdLocal( fd );
 
+	if ( fdDesc->spliced )
+		return spliceRead( fd );
+
 	while ( true ) {
 		FdDesc *other = fdDesc->other;
 
+		/* Backpressure. The other side is not taking data as fast as we
+		 * read it. Stop reading until proxyWrite drains it. */
+		if ( other->queued >= connQueueMax ) {
+			log_debug( DBG_PROXY, fdDesc << ": pausing read, queued " << other->queued );
+			fdDesc->readPaused = true;
+			fd->tlsWantRead = false;
+			break;
+		}
+
 		int length = other->readAvail();
 		if ( length == 0 ) {
 			other->addSpace();
@@ -526,6 +1091,121 @@ bool ProxyThread::sslReadReady( SelectFd *fd )
 		}
 		else {
 			log_debug( DBG_PROXY, fdDesc << ": nothing to read" );
+			other->dropSpace();
+		}
+
+		break;
+	}
+
+	if ( ktls && !fd->closed )
+		maybeSplice( fdDesc );
+
+	return true;
+}
+
+bool ProxyThread::spliceHost( const std::string &host )
+{
+	for ( OptStringEl *opt = MainThread::spliceHost.head; opt != 0; opt = opt->next ) {
+		std::string domain = opt->data;
+		if ( host == domain || ( host.size() > domain.size() &&
+				host.compare( host.size() - domain.size(), domain.size(), domain ) == 0 &&
+				host[host.size() - domain.size() - 1] == '.' ) )
+			return true;
+	}
+	return false;
+}
+
+/* When the kernel does TLS in both directions on both legs, an uninspected
+ * connection can move socket to socket through a pipe per direction without
+ * the data coming up to user space. Each side switches its reads on its own,
+ * when nothing it read is held in OpenSSL or queued for the other side, so
+ * order is kept. A side that left splice for a control record comes back the
+ * same way. */
+void ProxyThread::maybeSplice( FdDesc *fdDesc )
+{
+	FdDesc *other = fdDesc->other;
+	SelectFd *fd = fdDesc->proxyConn->selectFd;
+	SelectFd *otherFd = other->proxyConn->selectFd;
+
+	if ( fdDesc->spliced || fdDesc->noSplice )
+		return;
+
+	if ( fd->state != SelectFd::TlsEstablished || otherFd->state != SelectFd::TlsEstablished )
+		return;
+
+	/* Host and kTLS don't change for the connection. */
+	FdDesc *serverDesc = fdDesc->type == FdDesc::Server ? fdDesc : other;
+	if ( !serverDesc->haveHostname || !spliceHost( serverDesc->hostname ) ||
+			!ktlsBoth( fd->ssl ) || !ktlsBoth( otherFd->ssl ) )
+	{
+		fdDesc->noSplice = other->noSplice = true;
+		return;
+	}
+
+	/* Data read from this side waits in the other side's queue. The pipe
+	 * must not get ahead of it. */
+	if ( other->queued > 0 || SSL_pending( fd->ssl ) > 0 )
+		return;
+
+	/* The pipe stays after a side leaves splice for a control record. */
+	if ( other->pipe[0] < 0 && pipe2( other->pipe, O_NONBLOCK | O_CLOEXEC ) < 0 )
+		return;
+
+	log_debug( DBG_PROXY, fdDesc << ": splicing to " << serverDesc->hostname );
+
+	fdDesc->spliced = true;
+}
+
+/* Read from a spliced side into the other side's pipe, then on to its
+ * socket. */
+bool ProxyThread::spliceRead( SelectFd *fd )
+{
+	FdDesc *fdDesc = fdLocal( fd );
+	FdDesc *other = fdDesc->other;
+
+	while ( true ) {
+		/* Pipe is the queue, pause if it won't drain. */
+		if ( other->piped > 0 ) {
+			spliceWrite( other );
+
+			/* A failed write shuts down both sides. */
+			if ( fd->closed )
+				break;
+
+			if ( other->piped > 0 ) {
+				fdDesc->readPaused = true;
+				fd->tlsWantRead = false;
+				break;
+			}
+		}
+
+		ssize_t n = splice( fd->fd, 0, other->pipe[1], 0, SPLICE_LEN,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+
+		if ( n > 0 ) {
+			if ( fdDesc->passthrough )
+				__atomic_add_fetch( &contextMap->bypassStats.bytes, n, __ATOMIC_RELAXED );
+
+			other->piped += n;
+			spliceWrite( other );
+			if ( !fd->closed )
+				continue;
+		}
+		else if ( n == 0 ) {
+			log_debug( DBG_PROXY, fdDesc << ": spliced read EOF, closing" );
+			proxyShutdown( fd );
+		}
+		else if ( !fdDesc->passthrough && ( errno == EINVAL || errno == EIO ) ) {
+			/* A control record (alert, session ticket, key update) that the
+			 * kernel won't splice. OpenSSL reads it through the kTLS socket.
+			 * This side goes back to reading through OpenSSL. */
+			log_debug( DBG_PROXY, fdDesc << ": record needs OpenSSL, leaving splice" );
+			fdDesc->spliced = false;
+			return sslReadReady( fd );
+		}
+		else if ( errno != EAGAIN ) {
+			log_debug( DBG_PROXY, fdDesc << ": splice error, closing: " << strerror(errno) );
+			proxyShutdown( fd );
 		}
 
 		break;
@@ -534,9 +1214,38 @@ bool ProxyThread::sslReadReady( SelectFd *fd )
 	return true;
 }
 
+/* Drain the pipe of data waiting for this side. */
+void ProxyThread::spliceWrite( FdDesc *fdDesc )
+{
+	SelectFd *fd = fdDesc->proxyConn->selectFd;
+
+	while ( fdDesc->piped > 0 ) {
+		ssize_t n = splice( fdDesc->pipe[0], 0, fd->fd, 0, fdDesc->piped,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+
+		if ( n > 0 ) {
+			fdDesc->piped -= n;
+		}
+		else if ( n < 0 && errno == EAGAIN ) {
+			fd->tlsWantWrite = true;
+			return;
+		}
+		else {
+			log_debug( DBG_PROXY, fdDesc << ": spliced write failed, closing" );
+			proxyShutdown( fd );
+			return;
+		}
+	}
+
+	fd->tlsWantWrite = false;
+}
+
 void ProxyConnection::readReady()
 {
-	proxyThread->sslReadReady( selectFd );
+	if ( fdDesc->peeking )
+		proxyThread->helloReady( selectFd );
+	else
+		proxyThread->sslReadReady( selectFd );
 }
 
 void ProxyConnection::writeReady()
@@ -557,6 +1266,11 @@ void ProxyThread::proxyShutdown( SelectFd *fd )
 	 * this end. Close and/or put a stop to other end. */
 	FdDesc *fdDesc = fdLocal( fd );
 
+	/* Already down, from the other side. The fd numbers may belong to
+	 * someone else by now. */
+	if ( fd->closed )
+		return;
+
 	log_debug( DBG_PROXY, fdDesc << ": " <<
 			fdDesc->other << ": " << "proxy shutdown" );
 
@@ -576,6 +1290,9 @@ void ProxyThread::proxyShutdown( SelectFd *fd )
 	fdDesc->other->proxyConn->selectFd->wantRead = false; 
 	fdDesc->other->proxyConn->selectFd->wantWrite = false; 
 	fdDesc->other->stop = true;
+
+	fdDesc->release();
+	fdDesc->other->release();
 }
 
 void ProxyThread::recvShutdown( Message::Shutdown *msg )
@@ -588,18 +1305,57 @@ void ProxyThread::recvShutdown( Message::Shutdown *msg )
 
 int ProxyThread::main()
 {
+	if ( cpu >= 0 ) {
+		cpu_set_t set;
+		CPU_ZERO( &set );
+		CPU_SET( cpu, &set );
+
+		int r = pthread_setaffinity_np( pthread_self(), sizeof(set), &set );
+		if ( r != 0 )
+			log_ERROR( "failed to pin proxy thread to CPU " << cpu << ": " << strerror(r) );
+	}
+
 	ProxyListener *listener = new ProxyListener( this );
 
-	listener->startListenOnFd( listenFd, true, serverCtx, false );
+	/* When peeking, TLS accept starts once we know the host is inspected. */
+	listener->startListenOnFd( listenFd, !peekHello, serverCtx, false );
 
+	/* Nothing writes the decrypted ring at present. Running out of its
+	 * writer slots, as with more proxy threads than rings times writers,
+	 * must not end the thread and leave its listener dead in the reuseport
+	 * group. */
 	int res = kring_open( &kring, KRING_DATA, "r1", KRING_DECRYPTED, ringId, KRING_WRITE );
 	if ( res < 0 ) {
-		log_ERROR( "decrypted data kring open for write failed: " <<
-				kdata_error( &kring, res ) );
-		return -1;
+		log_WARNING( "decrypted data kring open for write failed: " <<
+				kdata_error( &kring, res ) << ", continuing without it" );
+	}
+
+	if ( nparser > 0 ) {
+		parserRings = new kring_user[nparser];
+		for ( int i = 0; i < nparser; i++ ) {
+			res = kring_open( &parserRings[i], KRING_DATA, parserRingset,
+					KRING_DECRYPTED, i, KRING_WRITE );
+			if ( res < 0 ) {
+				log_ERROR( "parser kring open for write failed: " <<
+						kdata_error( &parserRings[i], res ) << ", parsing inline" );
+				while ( --i >= 0 )
+					kring_close( &parserRings[i] );
+				delete[] parserRings;
+				nparser = 0;
+				break;
+			}
+		}
 	}
 
-	selectLoop();
+	/* Ticks for the ClientHello timeout. */
+	struct timeval t;
+	t.tv_sec = 1;
+	t.tv_usec = 0;
+
+	selectLoop( &t );
+
+	for ( int i = 0; i < nparser; i++ )
+		kring_close( &parserRings[i] );
 
 	return 0;
 }
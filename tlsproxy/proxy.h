@@ -14,6 +14,9 @@
 #include <kring/kring.h>
 #include <parse/parse.h>
 
+#include <list>
+#include <time.h>
+
 #define EC_SOCKET_CONNECT_FAILED        104
 #define EC_SSL_PEER_FAILED_VERIFY       100
 #define EC_SSL_CONNECT_FAILED           105
@@ -36,14 +39,29 @@
 
 #define PEER_CN_NAME_LEN 256
 
+#define SMALL_BLOCK_LEN 1024
+
+/* Free blocks kept per size class and thread. */
+#define BLOCK_POOL_MAX 512
+
+/* Default bytes queued toward one side of a connection before reading from
+ * the other side stops. Reading resumes when half of it has been written. */
+#define CONN_QUEUE_MAX ( 256 * 1024 )
+
+/* Most of a ClientHello we peek at for the SNI, a full TLS record. */
+#define HELLO_PEEK_LEN ( 5 + 16384 )
+
+/* Seconds an accepted connection may take to send its ClientHello. */
+#define HELLO_TIMEOUT 10
+
 struct ContextMap;
 struct ProxyThread;
 struct ProxyConnection;
 
 struct WriteBlock
 {
-	WriteBlock()
-		: blocklen( kdata_decrypted_max_data() )
+	WriteBlock( int blocklen )
+		: blocklen( blocklen )
 	{
 		data = new char[blocklen];
 		head = 0;
@@ -52,7 +70,6 @@ struct WriteBlock
 
 	~WriteBlock()
 	{
-		memset( data, 0, blocklen );
 		delete[] data;
 	}
 
@@ -65,6 +82,23 @@ struct WriteBlock
 
 typedef List<WriteBlock> WriteBlockList;
 
+/* Free relay blocks of a proxy thread. Small blocks take interactive traffic,
+ * large ones bulk transfers. A large block is one kring unit, so a write from
+ * it is always one unit of decrypted data. Blocks are reused as they are, not
+ * cleared. */
+struct BlockPool
+{
+	enum SizeClass { Small = 0, Large, Classes };
+
+	WriteBlock *get( SizeClass sizeClass );
+	void put( WriteBlock *block );
+
+	static int blockLen( SizeClass sizeClass )
+		{ return sizeClass == Small ? SMALL_BLOCK_LEN : kdata_decrypted_max_data(); }
+
+	WriteBlockList freeList[Classes];
+};
+
 struct FdDesc
 {
 	enum Type { Server = 1, Client };
@@ -75,10 +109,22 @@ struct FdDesc
 		type(type),
 		proxyConn(proxyConn),
 		other(0),
+		queued(0),
+		lastRead(0),
+		readPaused(false),
+		spliced(false),
+		noSplice(false),
+		piped(0),
+		peeking(false),
+		helloWant(0),
+		helloPeeked(0),
+		peekStart(0),
+		passthrough(false),
 		stop(false),
 		connected(false),
 		haveHostname(false)
 	{
+		pipe[0] = pipe[1] = -1;
 	}
 
 	long connId;
@@ -87,8 +133,36 @@ struct FdDesc
 	ProxyConnection *proxyConn;
 	FdDesc *other;
 
-	/* Input movement. */
+	/* Input movement. Data read from the other side, waiting to be written to
+	 * this one. */
 	WriteBlockList wbList;
+	int queued;
+
+	/* Size of the last read into wbList, picks the next block's size. */
+	int lastRead;
+
+	/* Reading from this side stopped because the other side's queue is
+	 * full. */
+	bool readPaused;
+
+	/* Reads from this side are spliced to the other side's pipe. Pipe holds
+	 * data read from the other side, waiting for this one. */
+	bool spliced;
+	bool noSplice;
+	int pipe[2];
+	int piped;
+
+	/* Waiting for the ClientHello, with the receive low water mark raised to
+	 * helloWant if it came in pieces. HelloPeeked is what the last peek
+	 * got, a wakeup without more means the client closed. */
+	bool peeking;
+	int helloWant;
+	int helloPeeked;
+	time_t peekStart;
+
+	/* Host is not inspected. The connection is spliced as raw TCP, there is
+	 * no SSL on either side. */
+	bool passthrough;
 
 	bool stop;
 
@@ -96,6 +170,9 @@ struct FdDesc
 	bool haveHostname;
 	std::string hostname;
 
+	/* Origin host:port, sessions for this connection are cached under it. */
+	std::string sessionKey;
+
 
 	static void connect( FdDesc *serverDesc, FdDesc *clientDesc )
 	{
@@ -105,12 +182,16 @@ struct FdDesc
 
 	int readAvail();
 	int addSpace();
+	void dropSpace();
 	char *readTo();
 	void readIn( int amt );
 
 	int writeAvail();
 	char *writeFrom();
 	void consume( int amt );
+
+	BlockPool *pool();
+	void release();
 };
 
 /* Logging. */
@@ -150,7 +231,7 @@ struct ProxyThread
 
 {
 	ProxyThread( SSL_CTX *servetCtx, SSL_CTX *clientCtx,
-			ContextMap *contextMap, int listenFd, int acceptFd, int ringId )
+			ContextMap *contextMap, int listenFd, int acceptFd, int ringId, int cpu )
 	:
 		serverCtx( servetCtx ),
 		clientCtx( clientCtx ),
@@ -158,8 +239,15 @@ struct ProxyThread
 		listenFd( listenFd ),
 		acceptFd( acceptFd ),
 		ringId( ringId ),
+		cpu( cpu ),
 		receivedCtx(0),
-		handler( this )
+		ktls(false),
+		peekHello(false),
+		connQueueMax( MainGen::connQueueMax > 0 ? MainGen::connQueueMax : CONN_QUEUE_MAX ),
+		handler( this ),
+		parserRingset(0),
+		nparser(0),
+		parserRings(0)
 	{
 		recvRequiresSignal = true;
 
@@ -175,6 +263,9 @@ struct ProxyThread
 	int acceptFd;
 	int ringId;
 
+	/* CPU to pin to, or -1. */
+	int cpu;
+
 	bool capture;
 
 	SendsToService *sendsToService;
@@ -211,9 +302,37 @@ struct ProxyThread
 
 	void sslPeerFailedVerify( SelectFd *fd );
 
+	/* Kernel TLS is on for new connections. */
+	bool ktls;
+
+	/* Accepted connections are plain until the ClientHello is seen. */
+	bool peekHello;
+
+	void helloReady( SelectFd *fd );
+
+	/* Connections waiting for a ClientHello, timed out in handleTimer. */
+	std::list<FdDesc*> peekList;
+	virtual void handleTimer();
+
+	void startIntercept( SelectFd *fd );
+	void startPassthrough( FdDesc *clientDesc );
+
+	bool spliceHost( const std::string &host );
+	void maybeSplice( FdDesc *fdDesc );
+	bool spliceRead( SelectFd *fd );
+	void spliceWrite( FdDesc *fdDesc );
+
+	BlockPool blockPool;
+	long connQueueMax;
+
 	Handler handler;
 	int kdata( long id, int type, const char *remoteHost, char *data, int len );
 
+	/* Write handles on the parser rings, parsing is inline if none. */
+	const char *parserRingset;
+	int nparser;
+	struct kring_user *parserRings;
+
 	SendsPassthru *sendsPassthru;
 };
 
@@ -0,0 +1,248 @@
+#include "session.h"
+#include "main.h"
+#include "listen.h"
+#include "proxy.h"
+
+#include "genf.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#include <string.h>
+#include <time.h>
+
+static void sessionRef( SSL_SESSION *sess )
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_SESSION_up_ref( sess );
+#else
+	CRYPTO_add( &sess->references, 1, CRYPTO_LOCK_SSL_SESSION );
+#endif
+}
+
+static bool sessionExpired( SSL_SESSION *sess, time_t now )
+{
+	return SSL_SESSION_get_time( sess ) + SSL_SESSION_get_timeout( sess ) <= now;
+}
+
+SessionCache::SessionCache()
+:
+	max( MainThread::sessionCacheMax > 0 ? MainThread::sessionCacheMax : SESSION_CACHE_MAX )
+{
+	pthread_mutex_init( &mutex, 0 );
+}
+
+SSL_SESSION *SessionCache::get( const std::string &key )
+{
+	SSL_SESSION *sess = 0;
+
+	pthread_mutex_lock( &mutex );
+
+	Map::El *el = map.find( key );
+	if ( el != 0 ) {
+		if ( sessionExpired( el->value, time(0) ) ) {
+			SSL_SESSION_free( el->value );
+			map.remove( el );
+		}
+		else {
+			sess = el->value;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+			/* TLS 1.3 tickets are meant for one use. The server sends new
+			 * ones after the handshake. */
+			if ( SSL_SESSION_get_protocol_version( sess ) == TLS1_3_VERSION )
+				map.remove( el );
+			else
+				sessionRef( sess );
+#else
+			sessionRef( sess );
+#endif
+		}
+	}
+
+	pthread_mutex_unlock( &mutex );
+
+	return sess;
+}
+
+void SessionCache::put( const std::string &key, SSL_SESSION *sess )
+{
+	pthread_mutex_lock( &mutex );
+
+	Map::El *el = map.find( key );
+	if ( el != 0 ) {
+		SSL_SESSION_free( el->value );
+		el->value = sess;
+	}
+	else {
+		if ( map.length() >= max ) {
+			expire( time(0) );
+
+			/* Still full, drop one. */
+			Map::Iter first = map;
+			if ( map.length() >= max && first.lte() ) {
+				SSL_SESSION_free( first->value );
+				map.remove( first );
+			}
+		}
+
+		map.insert( key, sess );
+	}
+
+	pthread_mutex_unlock( &mutex );
+}
+
+/* Called holding the mutex. */
+void SessionCache::expire( time_t now )
+{
+	Map::Iter el = map;
+	while ( el.lte() ) {
+		Map::El *cur = el;
+		el++;
+		if ( sessionExpired( cur->value, now ) ) {
+			SSL_SESSION_free( cur->value );
+			map.remove( cur );
+		}
+	}
+}
+
+TicketKeys::TicketKeys()
+:
+	havePrev(false),
+	rotated( time(0) ),
+	interval( MainThread::ticketRotate > 0 ? MainThread::ticketRotate : TICKET_ROTATE )
+{
+	pthread_mutex_init( &mutex, 0 );
+	newKey( &keys[0] );
+}
+
+void TicketKeys::newKey( Key *key )
+{
+	if ( RAND_bytes( (unsigned char*)key, sizeof(Key) ) != 1 )
+		log_FATAL( "failed to generate session ticket key" );
+}
+
+/* Called holding the mutex. */
+void TicketKeys::maybeRotate( time_t now )
+{
+	if ( now - rotated >= interval ) {
+		/* Past two periods the previous key has expired too. */
+		if ( now - rotated < 2 * interval ) {
+			keys[1] = keys[0];
+			havePrev = true;
+		}
+		else {
+			havePrev = false;
+		}
+
+		newKey( &keys[0] );
+		rotated = now;
+	}
+}
+
+void TicketKeys::current( Key *key )
+{
+	pthread_mutex_lock( &mutex );
+	maybeRotate( time(0) );
+	*key = keys[0];
+	pthread_mutex_unlock( &mutex );
+}
+
+int TicketKeys::find( const unsigned char *name, Key *key )
+{
+	int which = -1;
+
+	pthread_mutex_lock( &mutex );
+	maybeRotate( time(0) );
+	if ( memcmp( name, keys[0].name, sizeof(keys[0].name) ) == 0 )
+		which = 0;
+	else if ( havePrev && memcmp( name, keys[1].name, sizeof(keys[1].name) ) == 0 )
+		which = 1;
+
+	if ( which >= 0 )
+		*key = keys[which];
+	pthread_mutex_unlock( &mutex );
+
+	return which;
+}
+
+/* Called by proxy threads when an origin server gives us a session. Installed
+ * into the client context in the listen thread. Returning one keeps the
+ * reference. */
+int sessionNewCallback( SSL *ssl, SSL_SESSION *sess )
+{
+	ProxyThread *proxyThread = static_cast<ProxyThread*>( Thread::getThis() );
+	SelectFd *selectFd = (SelectFd*)SSL_get_ex_data( ssl, 0 );
+	FdDesc *fdDesc = ProxyThread::fdLocal( selectFd );
+
+	if ( fdDesc->sessionKey.empty() )
+		return 0;
+
+	proxyThread->contextMap->sessionCache.put( fdDesc->sessionKey, sess );
+	return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static void ticketMacInit( EVP_MAC_CTX *hctx, TicketKeys::Key *key )
+{
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_octet_string( OSSL_MAC_PARAM_KEY, key->hmac, sizeof(key->hmac) ),
+		OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST, (char*)"SHA256", 0 ),
+		OSSL_PARAM_construct_end()
+	};
+	EVP_MAC_CTX_set_params( hctx, params );
+}
+#else
+static void ticketMacInit( HMAC_CTX *hctx, TicketKeys::Key *key )
+{
+	HMAC_Init_ex( hctx, key->hmac, sizeof(key->hmac), EVP_sha256(), 0 );
+}
+#endif
+
+/* Seals and opens session tickets for clients. Returns two when OpenSSL
+ * should issue a new ticket: the ticket used the previous key, or it is TLS
+ * 1.3, where a ticket should be used only once. */
+int ticketKeyCallback( SSL *ssl, unsigned char *keyName, unsigned char *iv,
+		EVP_CIPHER_CTX *cctx, TicketMacCtx *hctx, int enc )
+{
+	ProxyThread *proxyThread = static_cast<ProxyThread*>( Thread::getThis() );
+	TicketKeys *ticketKeys = &proxyThread->contextMap->ticketKeys;
+	TicketKeys::Key key;
+	int result;
+
+	if ( enc ) {
+		ticketKeys->current( &key );
+
+		if ( RAND_bytes( iv, EVP_CIPHER_iv_length( EVP_aes_256_cbc() ) ) != 1 ) {
+			result = -1;
+		}
+		else {
+			memcpy( keyName, key.name, sizeof(key.name) );
+			EVP_EncryptInit_ex( cctx, EVP_aes_256_cbc(), 0, key.aes, iv );
+			ticketMacInit( hctx, &key );
+			result = 1;
+		}
+	}
+	else {
+		int which = ticketKeys->find( keyName, &key );
+		if ( which < 0 ) {
+			/* Unknown or expired key, full handshake. */
+			result = 0;
+		}
+		else {
+			ticketMacInit( hctx, &key );
+			EVP_DecryptInit_ex( cctx, EVP_aes_256_cbc(), 0, key.aes, iv );
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+			result = which == 0 && SSL_version( ssl ) < TLS1_3_VERSION ? 1 : 2;
+#else
+			result = which == 0 ? 1 : 2;
+#endif
+		}
+	}
+
+	OPENSSL_cleanse( &key, sizeof(key) );
+	return result;
+}
@@ -0,0 +1,85 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <openssl/ssl.h>
+#include <aapl/avlmap.h>
+#include <pthread.h>
+#include <string>
+
+#define SESSION_CACHE_MAX 10000
+#define TICKET_ROTATE 3600
+
+/* Sessions from origin servers, keyed by host:port, shared by all proxy
+ * threads. Each holds a reference on its session. */
+struct SessionCache
+{
+	typedef AvlMap<std::string, SSL_SESSION*> Map;
+
+	SessionCache();
+
+	/* Returns a reference the caller must free, or null. */
+	SSL_SESSION *get( const std::string &key );
+
+	/* Takes over the caller's reference. */
+	void put( const std::string &key, SSL_SESSION *sess );
+
+	void expire( time_t now );
+
+	pthread_mutex_t mutex;
+	Map map;
+	long max;
+};
+
+/* Ticket encryption keys for the client-facing leg. Tickets are sealed with
+ * the current key. The previous key still opens tickets for one rotation
+ * period, they are then reissued under the current key. */
+struct TicketKeys
+{
+	struct Key
+	{
+		unsigned char name[16];
+		unsigned char aes[32];
+		unsigned char hmac[32];
+	};
+
+	TicketKeys();
+
+	void current( Key *key );
+
+	/* Zero if the ticket's key is the current one, one if the previous, -1
+	 * if unknown. */
+	int find( const unsigned char *name, Key *key );
+
+	void maybeRotate( time_t now );
+	void newKey( Key *key );
+
+	pthread_mutex_t mutex;
+	Key keys[2];
+	bool havePrev;
+	time_t rotated;
+	long interval;
+};
+
+/* Resumption counts, for both legs. Bumped with atomics by the proxy
+ * threads, read by the listen thread for logging. */
+struct SessionStats
+{
+	SessionStats()
+		: clientHits(0), clientMisses(0), serverHits(0), serverMisses(0) {}
+
+	long clientHits, clientMisses;
+	long serverHits, serverMisses;
+};
+
+/* OpenSSL 3 deprecates the HMAC_CTX ticket callback for an EVP_MAC_CTX one. */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TicketMacCtx;
+#else
+typedef HMAC_CTX TicketMacCtx;
+#endif
+
+int sessionNewCallback( SSL *ssl, SSL_SESSION *sess );
+int ticketKeyCallback( SSL *ssl, unsigned char *keyName, unsigned char *iv,
+		EVP_CIPHER_CTX *cctx, TicketMacCtx *hctx, int enc );
+
+#endif /* _SESSION_H */
@@ -12,8 +12,9 @@ shuttle_up()
 	undo rmmod kring
 
 	# FIXME: remove rings
-	echo r0 4 > /sys/kring/add_data
-	echo r1 4 > /sys/kring/add_data
+	# name, rings, pages per ring, readers, writers (zero selects the default)
+	echo r0 4 2048 6 6 > /sys/kring/add_data
+	echo r1 4 2048 6 6 > /sys/kring/add_data
 
 	echo c0 > /sys/kring/add_cmd
 